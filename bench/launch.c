@@ -0,0 +1,229 @@
+#define _GNU_SOURCE
+#include <notstd/core.h>
+#include <notstd/str.h>
+#include <notstd/opt.h>
+#include <notstd/delay.h>
+
+#include <hestia/config.h>
+#include <hestia/cache.h>
+#include <hestia/launcher.h>
+#include <hestia/mount.h>
+#include <hestia/analyzer.h>
+#include <hestia/inutility.h>
+#include <hestia/trace.h>
+
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/*
+ * launch benchmark, run with meson benchmark
+ *	process enter a new user and mount namespace with own uid/gid mapped to root, real root is not required
+ *	config and cache path are redirected in build directory at compile time, see bench/meson.build
+ *	each stage is timed alone repeat times, report is min p50 p90 p99 max in microseconds
+ *	launch.exec is from hestia_launch call to begin of exec stage in sandbox, read from trace
+ *	analyze walk a synthetic upper of n files, BENCH_TREE_FANOUT files for each directory
+*/
+
+#define BENCH_REPEAT      20
+#define BENCH_TREE_FANOUT 100
+#define BENCH_CONFIG      "os"
+#define BENCH_SANDBOX     "userns"
+
+typedef enum { B_w, B_r, B_n, B_h } BENCHOPT_E;
+
+option_s OPT[] = {
+	{'w', "--workdir", "location of sandbox and tree", OPT_PATH, 0, 0},
+	{'r', "--repeat" , "repeat each stage"           , OPT_NUM, 0, 0},
+	{'n', "--files"  , "files of synthetic upper"    , OPT_NUM | OPT_ARRAY, 0, 0},
+	{'h', "--help"   , "display this"                , OPT_END | OPT_NOARG, 0, 0}
+};
+
+__private unsigned long TREEFILES[] = { 10000, 100000, 1000000 };
+
+__private void map_write(const char* path, const char* map){
+	int fd = open(path, O_WRONLY | O_CLOEXEC);
+	if( fd == -1 ) die("open %s: %m", path);
+	if( write(fd, map, strlen(map)) < 0 ) die("write %s: %m", path);
+	close(fd);
+}
+
+//need to be called before any thread is created
+__private void userns_enter(void){
+	uid_t const uid = geteuid();
+	gid_t const gid = getegid();
+	if( unshare(CLONE_NEWUSER | CLONE_NEWNS) ) die("unshare user namespace: %m");
+	map_write("/proc/self/setgroups", "deny");
+	__free char* umap = str_printf("0 %u 1", uid);
+	__free char* gmap = str_printf("0 %u 1", gid);
+	map_write("/proc/self/uid_map", umap);
+	map_write("/proc/self/gid_map", gmap);
+	if( mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) ) die("remount / private: %m");
+}
+
+__private int u64_cmp(const void* a, const void* b){
+	const uint64_t ua = *(const uint64_t*)a;
+	const uint64_t ub = *(const uint64_t*)b;
+	return ua < ub ? -1 : ua > ub;
+}
+
+__private double pct(const uint64_t* ns, unsigned count, unsigned p){
+	unsigned i = (count * p + 99) / 100;
+	return NSTOUS((double)ns[i ? i - 1 : 0]);
+}
+
+__private void report(const char* stage, uint64_t* ns, unsigned count){
+	if( !count ) return;
+	qsort(ns, count, sizeof(uint64_t), u64_cmp);
+	printf("%-20s %6u %12.1f %12.1f %12.1f %12.1f %12.1f\n", stage, count,
+		NSTOUS((double)ns[0]), pct(ns, count, 50), pct(ns, count, 90), pct(ns, count, 99), NSTOUS((double)ns[count-1])
+	);
+}
+
+__private uint64_t exec_begin(trace_s* trace){
+	unsigned const count = trace->count < trace->max ? trace->count : trace->max;
+	for( unsigned i = 0; i < count; ++i ){
+		if( !strcmp(trace->event[i].stage, "exec") ) return trace->event[i].begin;
+	}
+	return 0;
+}
+
+//a vm not loaded from cache can't be released, it is built in a child and only the time come back
+__private uint64_t build_cold(char* sandbox, option_s* exec){
+	int pfd[2];
+	if( pipe2(pfd, O_CLOEXEC) ) die("pipe: %m");
+	pid_t pid = fork();
+	if( pid == -1 ) die("fork: %m");
+	if( !pid ){
+		close(pfd[0]);
+		uint64_t const start = time_mono_ns();
+		config_vm_build(BENCH_CONFIG, sandbox, 0, 0, NULL, exec);
+		uint64_t const ns = time_mono_ns() - start;
+		_exit(write(pfd[1], &ns, sizeof ns) == sizeof ns ? 0 : 1);
+	}
+	close(pfd[1]);
+	uint64_t ns = 0;
+	ssize_t nr = read(pfd[0], &ns, sizeof ns);
+	close(pfd[0]);
+	int status;
+	waitpid(pid, &status, 0);
+	if( nr != sizeof ns || !WIFEXITED(status) || WEXITSTATUS(status) ) die("build %s fail", BENCH_CONFIG);
+	return ns;
+}
+
+__private void bench_config(char* sandbox, option_s* exec, unsigned repeat){
+	__free uint64_t* cold   = MANY(uint64_t, repeat);
+	__free uint64_t* cached = MANY(uint64_t, repeat);
+	for( unsigned i = 0; i < repeat; ++i ){
+		rm(HESTIA_CACHE_PATH);
+		cold[i] = build_cold(sandbox, exec);
+	}
+	for( unsigned i = 0; i < repeat; ++i ){
+		uint64_t const start = time_mono_ns();
+		configvm_s* vm = config_vm_build(BENCH_CONFIG, sandbox, 0, 0, NULL, exec);
+		cached[i] = time_mono_ns() - start;
+		if( !vm->cache ) die("config %s not cached", BENCH_CONFIG);
+		config_cache_free(vm);
+	}
+	report("config.cold", cold, repeat);
+	report("config.cached", cached, repeat);
+}
+
+__private void bench_launch(char* sandbox, option_s* exec, unsigned repeat){
+	__free uint64_t* toexec = MANY(uint64_t, repeat);
+	__free uint64_t* total  = MANY(uint64_t, repeat);
+	__free uint64_t* umount = MANY(uint64_t, repeat);
+	configvm_s* vm = config_vm_build(BENCH_SANDBOX, sandbox, 0, 0, NULL, exec);
+	vm->trace = trace_new();
+	if( !vm->trace ) die("unable to create trace");
+	for( unsigned i = 0; i < repeat; ++i ){
+		vm->trace->count = 0;
+		uint64_t const start = time_mono_ns();
+		if( hestia_launch(sandbox, vm, NULL) ) die("launch %s fail", BENCH_SANDBOX);
+		uint64_t const end = time_mono_ns();
+		uint64_t const ex = exec_begin(vm->trace);
+		if( !ex ) die("exec stage not traced");
+		toexec[i] = ex - start;
+		total[i]  = end - start;
+		uint64_t const ustart = time_mono_ns();
+		hestia_umount(sandbox);
+		umount[i] = time_mono_ns() - ustart;
+	}
+	trace_free(vm->trace);
+	vm->trace = NULL;
+	report("launch.exec", toexec, repeat);
+	report("launch.total", total, repeat);
+	report("umount", umount, repeat);
+}
+
+//destdir/data.upper/dNNNNNN/fNNN
+__private void tree_make(const char* destdir, unsigned long files){
+	__free char* upper = str_printf("%s/data.upper", destdir);
+	mk_dir(upper, 0755);
+	int dfd = -1;
+	for( unsigned long i = 0; i < files; ++i ){
+		if( !(i % BENCH_TREE_FANOUT) ){
+			if( dfd != -1 ) close(dfd);
+			__free char* dir = str_printf("%s/d%06lu", upper, i / BENCH_TREE_FANOUT);
+			mk_dir(dir, 0755);
+			dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if( dfd == -1 ) die("open %s: %m", dir);
+		}
+		char name[32];
+		sprintf(name, "f%03lu", i % BENCH_TREE_FANOUT);
+		int fd = openat(dfd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+		if( fd == -1 ) die("create %s: %m", name);
+		close(fd);
+	}
+	if( dfd != -1 ) close(dfd);
+}
+
+__private void bench_analyze(const char* workdir, unsigned long files, unsigned repeat){
+	__free char* destdir = str_printf("%s/tree.%lu", workdir, files);
+	tree_make(destdir, files);
+	FILE* out = fopen("/dev/null", "w");
+	if( !out ) die("open /dev/null: %m");
+	__free uint64_t* ns = MANY(uint64_t, repeat);
+	for( unsigned i = 0; i < repeat; ++i ){
+		uint64_t const start = time_mono_ns();
+		hestia_analyze(destdir, out);
+		ns[i] = time_mono_ns() - start;
+	}
+	fclose(out);
+	rm(destdir);
+	__free char* stage = str_printf("analyze.%lu", files);
+	report(stage, ns, repeat);
+}
+
+int main(int argc, char** argv){
+	notstd_begin();
+	__argv option_s* opt = argv_parse(OPT, argc, argv);
+	if( opt[B_h].set ) argv_usage(opt, argv[0]);
+	argv_default_str(opt, B_w, "/tmp");
+	argv_default_num(opt, B_r, BENCH_REPEAT);
+	unsigned const repeat = opt[B_r].value->ui ? opt[B_r].value->ui : 1;
+
+	userns_enter();
+	__free char* tmpl = str_printf("%s/hestia-bench.XXXXXX", opt[B_w].value->str);
+	if( !mkdtemp(tmpl) ) die("mkdtemp %s: %m", tmpl);
+	__free char* sandbox = str_printf("%s/sandbox", tmpl);
+	mk_dir(sandbox, 0755);
+
+	optValue_u exv[] = { { .str = "/bin/true" } };
+	option_s exec = { .set = 1, .value = exv };
+
+	printf("%-20s %6s %12s %12s %12s %12s %12s\n", "stage(us)", "n", "min", "p50", "p90", "p99", "max");
+	bench_config(sandbox, &exec, repeat);
+	bench_launch(sandbox, &exec, repeat);
+	if( opt[B_n].set ){
+		for( unsigned i = 0; i < opt[B_n].set; ++i ) bench_analyze(tmpl, opt[B_n].value[i].ui, repeat);
+	}
+	else{
+		for( unsigned i = 0; i < sizeof_vector(TREEFILES); ++i ) bench_analyze(tmpl, TREEFILES[i], repeat);
+	}
+	rm(tmpl);
+	return 0;
+}
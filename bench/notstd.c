@@ -0,0 +1,283 @@
+#include <notstd/core.h>
+#include <notstd/str.h>
+#include <notstd/opt.h>
+#include <notstd/bench.h>
+#include <notstd/json.h>
+#include <notstd/utf8.h>
+#include <notstd/fzs.h>
+#include <notstd/rbtree.h>
+
+/*
+ * micro benchmark of notstd primitive, run with meson benchmark
+ *	one suite for each module, -s run only one suite
+ *	input are generated at start with a fixed seed, same input for every run
+ *	result of each call is stored in sink, compiler can't remove the call
+*/
+
+#define MB_PUSH     4096
+#define MB_UPSIZE   64
+#define MB_TEXT     8192
+#define MB_JSON     256
+#define MB_NODES    4096
+#define MB_FZS      64
+
+typedef enum { M_w, M_r, M_s, M_j, M_h } MBOPT_E;
+
+option_s OPT[] = {
+	{'w', "--warmup", "warmup samples"        , OPT_NUM, 0, 0},
+	{'r', "--repeat", "measured samples"      , OPT_NUM, 0, 0},
+	{'s', "--suite" , "run only suite"        , OPT_STR, 0, 0},
+	{'j', "--json"  , "write json result"     , OPT_STR, 0, 0},
+	{'h', "--help"  , "display this"          , OPT_END | OPT_NOARG, 0, 0}
+};
+
+__private volatile size_t sink;
+__private unsigned long seed = 0x9E3779B97F4A7C15UL;
+
+__private unsigned long rnd(void){
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return seed;
+}
+
+/**********/
+/* memory */
+/**********/
+
+__private void mb_ipush(__unused void* ctx){
+	__free unsigned* v = MANY(unsigned, 1);
+	for( unsigned i = 0; i < MB_PUSH; ++i ){
+		unsigned const it = mem_ipush(&v);
+		v[it] = i;
+	}
+	sink = mem_header(v)->len;
+}
+
+__private void mb_upsize(__unused void* ctx){
+	__free char* v = MANY(char, 1);
+	for( unsigned i = 0; i < MB_PUSH; ++i ){
+		v = mem_upsize(v, MB_UPSIZE);
+		mem_header(v)->len += MB_UPSIZE;
+	}
+	sink = mem_header(v)->len;
+}
+
+__private void suite_memory(bench_s* b){
+	if( !bench_suite(b, "memory") ) return;
+	bench_run(b, "mem_ipush", MB_PUSH * sizeof(unsigned), mb_ipush, NULL);
+	bench_run(b, "mem_upsize", MB_PUSH * MB_UPSIZE, mb_upsize, NULL);
+}
+
+/*******/
+/* str */
+/*******/
+
+__private void mb_printf(__unused void* ctx){
+	__free char* s = str_printf("%s/%s.%lu.%s", "/var/cache/hestia", "config", 0x123456789ABCUL, "cbc");
+	sink = mem_header(s)->len;
+}
+
+__private void mb_tok(void* ctx){
+	const char* text = ctx;
+	unsigned next = 0;
+	unsigned len  = 0;
+	size_t count  = 0;
+	while( text[next] ){
+		str_tok(text, " ", 0, &len, &next);
+		++count;
+	}
+	sink = count;
+}
+
+__private char* words_new(void){
+	char* text = MANY(char, MB_TEXT + 1);
+	unsigned i = 0;
+	while( i < MB_TEXT ){
+		unsigned wl = 1 + rnd() % 12;
+		for( unsigned k = 0; k < wl && i < MB_TEXT; ++k ) text[i++] = 'a' + rnd() % 26;
+		if( i < MB_TEXT ) text[i++] = ' ';
+	}
+	text[i] = 0;
+	mem_header(text)->len = i;
+	return text;
+}
+
+__private void suite_str(bench_s* b){
+	if( !bench_suite(b, "str") ) return;
+	__free char* text = words_new();
+	__free char* probe = str_printf("%s/%s.%lu.%s", "/var/cache/hestia", "config", 0x123456789ABCUL, "cbc");
+	bench_run(b, "str_printf", mem_header(probe)->len, mb_printf, NULL);
+	bench_run(b, "str_tok", mem_header(text)->len, mb_tok, text);
+}
+
+/********/
+/* json */
+/********/
+
+__private void mb_decode(void* ctx){
+	__free jvalue_s* jv = json_decode(ctx, NULL, NULL);
+	sink = jv ? (size_t)jv->type : 0;
+}
+
+__private void mb_encode(void* ctx){
+	__free char* s = json_encode(ctx, 3, 0);
+	sink = mem_header(s)->len;
+}
+
+__private void text_append(char** text, const char* s){
+	size_t const len = strlen(s);
+	size_t const at  = mem_header(*text)->len;
+	*text = mem_upsize(*text, len + 1);
+	memcpy(&(*text)[at], s, len + 1);
+	mem_header(*text)->len += len;
+}
+
+__private char* json_text_new(void){
+	char* text = MANY(char, 4096);
+	text_append(&text, "{\"event\":[");
+	for( unsigned i = 0; i < MB_JSON; ++i ){
+		__free char* ev = str_printf("%s{\"stage\":\"mount\",\"label\":\"/usr usr\\n\",\"pid\":%lu,\"begin_ns\":%lu,\"ratio\":%lu.%03lu,\"ok\":true,\"arg\":[1,2,3,null]}",
+			i ? "," : "", rnd() % 65536, rnd() % 1000000000UL, rnd() % 100, rnd() % 1000
+		);
+		text_append(&text, ev);
+	}
+	text_append(&text, "]}");
+	return text;
+}
+
+__private void suite_json(bench_s* b){
+	if( !bench_suite(b, "json") ) return;
+	__free char* text = json_text_new();
+	__free jvalue_s* jv = json_decode(text, NULL, NULL);
+	if( !jv ) die("invalid json of suite");
+	__free char* enc = json_encode(jv, 3, 0);
+	bench_run(b, "json_decode", mem_header(text)->len, mb_decode, text);
+	bench_run(b, "json_encode", mem_header(enc)->len, mb_encode, jv);
+}
+
+/********/
+/* utf8 */
+/********/
+
+__private void mb_grapheme(void* ctx){
+	const utf8_t* u = ctx;
+	size_t count = 0;
+	while( *u ){
+		u = utf8_grapheme_next(u);
+		++count;
+	}
+	sink = count;
+}
+
+__private char* utf8_text_new(void){
+	__private const char* piece[] = { "hestia ", "sandbox ", "\xC3\xA8", "\xE2\x82\xAC", "e\xCC\x81", "\xF0\x9F\x91\x8D", "\xF0\x9F\x91\x8D\xF0\x9F\x8F\xBD", "\xE3\x81\x82", "\r\n" };
+	char* text = MANY(char, MB_TEXT + 32);
+	unsigned len = 0;
+	while( len < MB_TEXT ){
+		const char* p = piece[rnd() % sizeof_vector(piece)];
+		size_t const pl = strlen(p);
+		memcpy(&text[len], p, pl);
+		len += pl;
+	}
+	text[len] = 0;
+	mem_header(text)->len = len;
+	return text;
+}
+
+__private void suite_utf8(bench_s* b){
+	if( !bench_suite(b, "utf8") ) return;
+	__free char* text = utf8_text_new();
+	bench_run(b, "utf8_grapheme_next", mem_header(text)->len, mb_grapheme, text);
+}
+
+/*******/
+/* fzs */
+/*******/
+
+typedef struct mbPair{
+	char a[MB_FZS + 1];
+	char b[MB_FZS + 1];
+}mbPair_s;
+
+__private void mb_levenshtein(void* ctx){
+	mbPair_s* p = ctx;
+	sink = fzs_levenshtein(p->a, MB_FZS, p->b, MB_FZS);
+}
+
+__private void suite_fzs(bench_s* b){
+	if( !bench_suite(b, "fzs") ) return;
+	mbPair_s p;
+	for( unsigned i = 0; i < MB_FZS; ++i ){
+		p.a[i] = 'a' + rnd() % 8;
+		p.b[i] = 'a' + rnd() % 8;
+	}
+	p.a[MB_FZS] = 0;
+	p.b[MB_FZS] = 0;
+	bench_run(b, "fzs_levenshtein", MB_FZS * 2, mb_levenshtein, &p);
+}
+
+/**********/
+/* rbtree */
+/**********/
+
+typedef struct mbTree{
+	rbtNode_s*     node;
+	unsigned long* key;
+}mbTree_s;
+
+__private int key_cmp(const void* a, const void* b){
+	const unsigned long ka = *(const unsigned long*)a;
+	const unsigned long kb = *(const unsigned long*)b;
+	return ka < kb ? -1 : ka > kb;
+}
+
+//nodes are reused, each call build a new tree
+__private void mb_insert(void* ctx){
+	mbTree_s* t = ctx;
+	rbtree_s tree;
+	rbtree_ctor(&tree, key_cmp);
+	for( unsigned i = 0; i < MB_NODES; ++i ){
+		rbtree_insert(&tree, rbtNode_ctor(&t->node[i], &t->key[i]));
+	}
+	sink = tree.count;
+}
+
+__private void suite_rbtree(bench_s* b){
+	if( !bench_suite(b, "rbtree") ) return;
+	__free rbtNode_s*     node = MANY(rbtNode_s, MB_NODES);
+	__free unsigned long* key  = MANY(unsigned long, MB_NODES);
+	for( unsigned i = 0; i < MB_NODES; ++i ) key[i] = rnd();
+	mbTree_s t = { .node = node, .key = key };
+	bench_run(b, "rbtree_insert", 0, mb_insert, &t);
+}
+
+int main(int argc, char** argv){
+	notstd_begin();
+	__argv option_s* opt = argv_parse(OPT, argc, argv);
+	if( opt[M_h].set ) argv_usage(opt, argv[0]);
+	argv_default_num(opt, M_w, BENCH_WARMUP);
+	argv_default_num(opt, M_r, BENCH_REPEAT);
+
+	bench_s b;
+	bench_ctor(&b, opt[M_w].value->ui, opt[M_r].value->ui);
+	if( opt[M_s].set ) b.filter = opt[M_s].value->str;
+
+	suite_memory(&b);
+	suite_str(&b);
+	suite_json(&b);
+	suite_utf8(&b);
+	suite_fzs(&b);
+	suite_rbtree(&b);
+
+	bench_print(&b, stdout);
+	if( opt[M_j].set ){
+		__free char* json = bench_json(&b, 1);
+		FILE* f = fopen(opt[M_j].value->str, "w");
+		if( !f ) die("open %s: %m", opt[M_j].value->str);
+		fprintf(f, "%s\n", json);
+		fclose(f);
+	}
+	bench_dtor(&b);
+	return 0;
+}
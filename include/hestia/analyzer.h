@@ -1,17 +1,18 @@
 #ifndef __ANALYZER_H__
 #define __ANALYZER_H__
 
+#include <stdio.h>
 #include <hestia/config.h>
 
 #define HESTIA_ANALYZER "@analyzer@"
 
-typedef struct analEnt{
-	unsigned type;
-	char*    path;
-}analEnt_s;
+//dirfd and name locate entry, path is full path
+typedef void(*analyze_f)(FILE* out, int dirfd, const char* name, unsigned type, const char* path, void* ctx);
 
 const char* dtname(unsigned dt);
-analEnt_s* hestia_analyze_list(const char* destdir);
+unsigned dttype(const char* name);
+void hestia_analyze_walk(const char* destdir, FILE* out, analyze_f emit, void* ctx);
+void hestia_analyze(const char* destdir, FILE* out);
 void hestia_analyze_root(const char* destdir);
 
 #endif
@@ -0,0 +1,33 @@
+#ifndef __HESTIA_CACHE_H__
+#define __HESTIA_CACHE_H__
+
+#include <sys/stat.h>
+#include <hestia/config.h>
+
+/*
+ * compiled config cache, one file for each key
+ * /var/cache/hestia/confname.hash.cbc
+ *
+ * [header][dep * ndep][op * (stage+atexit+onfail+cgroup)][sock_filter * nfilter][string table]
+ * string in op is offset+1 in string table, 0 is NULL
+ * cache is valid only if all dependency have same dev, ino, size and mtime and still pass root owner check
+*/
+
+#ifndef HESTIA_CACHE_PATH
+#define HESTIA_CACHE_PATH    "/var/cache/hestia"
+#endif
+#define HESTIA_CACHE_EXT     "cbc"
+#define HESTIA_CACHE_MAGIC   0x43424348
+#define HESTIA_CACHE_VERSION 5
+
+typedef struct cdep{
+	char*       path;
+	struct stat info;
+}cdep_s;
+
+configvm_s* config_cache_load(const char* key);
+//only vm returned by config_cache_load, bytecode strings live in cache mapping
+void config_cache_free(configvm_s* vm);
+int config_cache_save(configvm_s* vm, const char* key, cdep_s* deps);
+
+#endif
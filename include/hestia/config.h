@@ -12,18 +12,25 @@
  * r MS_RDONLY
  * t MS_STRICTATIME
  * p MS_PRIVATE
+ * i idmap, only bind and overlay, owner of src is seen as uid/gid without chown, require new mount api
+ * v volatile, only overlay, upper is never synced
+ * m metacopy=on,redirect_dir=on, only overlay, chmod/chown copy up only metadata
  *
  * use configname
  * uid num/%u
  * gid num/%g
  * prv 0755/rwxrwxrwx
+ * upper disk/tmpfs size, next overlay have upper and work in destdir or on own tmpfs of size, tmpfs upper is lost at exit
+ * tmpfs size is a number with optional k m g or % suffix
  *
  * mount type, dest, ?option, ?mode, ?prv, ?uid, ?gid
  * bind   src, dest, ?option, ?mode, ?prv, ?uid, ?gid
- * [s0] src [s1] destdir/dest [s2] type [u3] flags [u4] mode [u5] prv [u6] uid [u7] uid
+ * [s0] src [s1] destdir/dest [s2] type [u3] flags [s4] mode [u5] prv [u6] uid [u7] gid [u8] idmap
  *
  * overlay src, dest, ?option, ?mode, ?prv, ?uid, ?gid
- * [s0] src [s1] dest [s2] destdir [u3] flags [u4] mode [u5] prv [u6] uid [u7] uid
+ * [s0] src [s1] dest [s2] destdir [s3] rootdir [u4] flags [s5] mode [u6] prv [u7] uid [u8] gid [u9] i/v/m [s10] tmpfs size
+ * idmap overlay use src idmapped in destdir/dest.lower as lowerdir
+ * tmpfs upper is mounted in destdir/dest.tmpfs with upper and work inside
  *
  * dir dest/%D(homedir)
  * [s0] path [u1] prv [u2] uid [u3] gid
@@ -31,21 +38,49 @@
  * script mout/root/atexit/fail, scriptname
  * [s0] cmd
  *
- * systemcall allow/deny/syscallname
- * [s0] allowDeny
+ * syscall allow/deny[=action] name[:arg op value][=action] ...
+ * op is == != & (any bit set), action is kill, allow, errno, errno:N/ENAME, notify, notify:N/ENAME, notify:allow
+ * @group[=action] expand to all syscall of group, @mount @file-system @network-io ..., see SYSCALLGROUP
+ * first line set mode and default action, kill if not set
+ * allow: listed syscall are allowed, other use default action
+ * deny: listed syscall use default action, other are allowed
+ * rule with condition match only if all condition match, else use mode default
+ * compiled in filter of vm, seccomp has no argument
+ * each arch of filter translate rule by name, with compat variant (setuid32, fcntl64) and socketcall/ipc subcall
+ * notify is logged and answered by supervisor thread of launcher, notify reply EPERM, notify:N/ENAME reply that errno
+ * notify:allow log and let syscall run, argument can change after check, it is an audit and not a boundary
  *
  * chdir pathinsidesandbox, ?prv
  * [s0] dir [u1] prv [u2] uid [u3] gid
  *
  *
- * snapshot snapname
- * [s0] destdir [s1] snapname
+ * cgroup property value...
+ * [s0] property [s1] value
+ * property is cpu.max cpu.weight memory.max memory.high memory.swap.max io.max io.weight pids.max
+ * value is written as is, more token are joined with space: cgroup cpu.max 50000 100000
+ * each run has own cgroup created by launcher, child is cloned inside it
+ *
+ * timeout seconds, ?grace
+ * [u0] seconds [u1] grace, default HESTIA_KILL_GRACE
+ * cputime seconds
+ * [u0] seconds of cpu used by all process of sandbox, read from cgroup cpu.stat
+ * on limit launcher send SIGTERM to all process of sandbox, after grace kill pid namespace, onfail stage is run
+ * grace is HESTIA_KILL_GRACE also when only cputime is set
+ *
+ * snapshot snapname, ?hash
+ * [s0] destdir [s1] snapname [u2] flags
  * output /destdir/snapname.snapshot only before change root
 */
 
 
 #define HESTIA_ROOT        "root"
+#ifndef HESTIA_CONFIG_PATH
 #define HESTIA_CONFIG_PATH "/etc/hestia/config.d"
+#endif
+//bench build run unprivileged in user namespace, host files are owned by overflow id and can't pass owner check
+#ifndef HESTIA_CONFIG_OWNER_CHECK
+#define HESTIA_CONFIG_OWNER_CHECK 1
+#endif
 #define HESTIA_SCRIPT_PATH "/etc/hestia/script.d"
 #define HESTIA_CMD_CHR     '@'
 #define HESTIA_SCRIPT_ENT  "@SCRIPT@"
@@ -55,6 +90,11 @@
 #define HESTIA_CGROUP_ENT  "@CGROUP@"
 
 #define MAX_TOKEN 32
+#define HESTIA_PARALLEL_WORKER 4
+#define HESTIA_KILL_GRACE      5
+
+//vm->flags
+#define HESTIA_VM_USERNS 0x01
 
 typedef struct configvm configvm_s;
 typedef struct cbc cbc_s;
@@ -71,17 +111,45 @@ struct cbc{
 	}arg[16];
 };
 
+typedef struct cop{
+	eval_f      fn;
+	const char* name;
+	const char* arg;  //s string, u unsigned, a array of string
+}cop_s;
+
 struct configvm{
 	cbc_s*  stage;
 	cbc_s*  atexit;
 	cbc_s*  onfail;
 	cbc_s*  current;
+	cbc_s*  root;
+	cbc_s*  cgroup;
+	char*   group;
+	unsigned timeout;
+	unsigned grace;
+	unsigned cputime;
 	struct sock_filter* filter;
+	struct seccompListener* listener;
+	struct trace* trace;
 	unsigned flags;
+	void*    cache;     //mapping of cache file, NULL if vm is compiled
+	size_t   cachesize;
 };
 
+cbc_s* cbc_new(void);
+configvm_s* vm_new(void);
+const cop_s* config_vm_op(unsigned opcode);
+int config_vm_opcode(eval_f fn);
+const char* config_file_distrust(const char* path, struct stat* info);
+void config_file_trusted(const char* path, struct stat* info);
 int config_vm_run(configvm_s* vm);
+int config_vm_run_mount(configvm_s* vm);
+int config_vm_run_exec(configvm_s* vm);
+void config_vm_exec_argv(configvm_s* vm, char** argv);
+int config_vm_run_cgroup(configvm_s* vm, const char* name);
+int config_vm_privilege(configvm_s* vm, uid_t* uid, gid_t* gid);
 int config_vm_atexit(configvm_s* vm, int ret);
+configvm_s* config_vm_cached(const char* confname, char* destdir, uid_t uid, gid_t gid, const char* scriptArg, option_s* execArg);
 configvm_s* config_vm_build(const char* confname, char* destdir, uid_t uid, gid_t gid, const char* scriptArg, option_s* execArg);
 
 #endif
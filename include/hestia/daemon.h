@@ -0,0 +1,15 @@
+#ifndef __HESTIA_DAEMON_H__
+#define __HESTIA_DAEMON_H__
+
+#include <unistd.h>
+
+#define HESTIA_DAEMON_SOCKET  "/run/hestia.sock"
+#define HESTIA_DAEMON_DESTDIR "/var/lib/hestia"
+#define HESTIA_DAEMON_MSG_MAX 65536
+#define HESTIA_DAEMON_ARG_MAX 1024
+#define HESTIA_DAEMON_PRESERVE 0x01
+
+int hestia_daemon(const char* sockpath);
+int hestia_remote(const char* sockpath, const char* confname, const char* destdir, uid_t uid, gid_t gid, const char* scriptArg, unsigned flags, char** argv, unsigned argc);
+
+#endif
@@ -11,6 +11,19 @@ typedef enum{
 	O_a,
 	O_A,
 	O_e,
+	O_p,
+	O_D,
+	O_r,
+	O_s,
+	O_S,
+	O_L,
+	O_x,
+	O_k,
+	O_X,
+	O_q,
+	O_t,
+	O_T,
+	O_R,
 	O_h
 }OPT_E;
 
@@ -6,6 +6,11 @@
 #include <hestia/config.h>
 
 
+int mount_api_available(void);
+int mount_detached(const char* src, const char* type, unsigned long flags, const char* data);
+int mount_attach(int mfd, const char* dst);
+int hestia_mount(const char* src, const char* dst, const char* type, unsigned long flags, const char* data);
+int hestia_mount_idmap(const char* src, const char* dst, unsigned long flags, uid_t uid, gid_t gid);
 int hestia_umount(const char* destdir);
 
 
@@ -0,0 +1,11 @@
+#ifndef __HESTIA_POOL_H__
+#define __HESTIA_POOL_H__
+
+#include <hestia/config.h>
+
+#define HESTIA_POOL_EXT     "pool"
+#define HESTIA_POOL_CMD_MAX 65536
+
+int hestia_pool(const char* destdir, configvm_s* vm, unsigned count);
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef __HESTIA_SNAPSHOT_H__
+#define __HESTIA_SNAPSHOT_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+
+/*
+ * snapshot of overlay upper, destdir/name.snapshot
+ * binary file used directly with mmap
+ *
+ * [header][record * count][path table]
+ * record are fixed width and sorted by path in walk order, see snapshot_path_cmp
+ * path table is prefix compressed, each path is [u16 shared with previous][u16 len][suffix]
+ * every HESTIA_SNAPSHOT_RESTART path store full path, lookup is a binary search on restart and a short scan
+ *
+ * path is relative to destdir
+ * hash is fasthash of content, only for regular file and only with HESTIA_SNAPSHOT_HASH, 0 if not computed
+ * hash of previous snapshot with same name is reused if size, mtime and inode are not changed
+ * text export: [type] mode uid gid size mtime ino hash path
+*/
+
+#define HESTIA_SNAPSHOT_EXT     "snapshot"
+#define HESTIA_SNAPSHOT_MAGIC   0x504E5348
+#define HESTIA_SNAPSHOT_VERSION 3
+#define HESTIA_SNAPSHOT_RESTART 16
+#define HESTIA_SNAPSHOT_HASH    0x01
+
+typedef struct snapHeader{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint32_t restart;
+	uint64_t rec;
+	uint64_t path;
+	uint64_t pathsize;
+}snapHeader_s;
+
+typedef struct snapRec{
+	uint64_t size;
+	uint64_t mtime;
+	uint64_t ino;
+	uint64_t hash;
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t type;
+	uint32_t path;
+	uint32_t reserved;
+}snapRec_s;
+
+typedef struct snapshot{
+	void*               map;
+	size_t              size;
+	const snapHeader_s* hdr;
+	const snapRec_s*    rec;
+	const char*         path;
+}snapshot_s;
+
+//sequential read, path of current record is in path
+typedef struct snapCursor{
+	const snapshot_s* snap;
+	unsigned          next;
+	unsigned          len;
+	char              path[PATH_MAX];
+}snapCursor_s;
+
+int snapshot_path_cmp(const char* a, const char* b);
+char* snapshot_file(const char* destdir, const char* name);
+snapshot_s* snapshot_open(const char* fname);
+void snapshot_close(snapshot_s* snap);
+void snapshot_cursor(snapCursor_s* cur, const snapshot_s* snap, unsigned index);
+const snapRec_s* snapshot_next(snapCursor_s* cur);
+const snapRec_s* snapshot_find(const snapshot_s* snap, const char* path);
+int snapshot_write(const char* destdir, const char* name, unsigned flags);
+int snapshot_export(const char* fname, FILE* out);
+int snapshot_query(const char* fname, const char* path, FILE* out);
+int snapshot_diff(const char* a, const char* b, FILE* out);
+
+#endif
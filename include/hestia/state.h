@@ -0,0 +1,21 @@
+#ifndef __HESTIA_STATE_H__
+#define __HESTIA_STATE_H__
+
+/*
+ * persistent sandbox state
+ * destdir/.state/name/ contains a copy of each overlay .upper of a finished run
+ * load clone it back in destdir before mount, next run start from that state
+ *
+ * clone is a btrfs snapshot when upper is a subvolume, on btrfs upper are created as subvolume
+ * otherwise is a tree copy where regular file are shared with FICLONE, fallback copy_file_range
+ * ownership, mode, time, xattr and overlay whiteout are preserved, hardlink are copied as distinct file
+*/
+
+#define HESTIA_STATE_DIR ".state"
+
+void state_upper_mkdir(const char* path, unsigned privilege);
+int state_clone(const char* src, const char* dst);
+int state_save(const char* destdir, const char* name);
+int state_load(const char* destdir, const char* name);
+
+#endif
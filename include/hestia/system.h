@@ -2,21 +2,123 @@
 #define __SYSTEM_H__
 
 #include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <linux/audit.h>
 
 #define HESTIA_MOUNT_OLD_ROOT "old_root"
+#define HESTIA_CGROUP_DIR     "hestia"
 
-struct sock_filter* syscall_ctor(void);
-int syscall_add(struct sock_filter** filter, const char* name, unsigned allowDeny);
-void syscall_end(struct sock_filter** filter, int allowDeny);
-int syscall_apply(struct sock_filter* filter);
+#define SECCOMP_COND_MAX 6
+#define SECCOMP_COND_EQ  0
+#define SECCOMP_COND_NE  1
+#define SECCOMP_COND_SET 2
+#define SECCOMP_LISTENER_TIMEOUT 2
+#define SECCOMP_LISTENER_WAIT    10
+#define SECCOMP_NOTIFY_CONTINUE  0xFFFF
+
+#if defined(__x86_64__) && !defined(__ILP32__)
+#	define HESTIA_AUDIT_ARCH AUDIT_ARCH_X86_64
+#	define HESTIA_ARCH_NAME  "x86_64"
+#elif defined(__i386__)
+#	define HESTIA_AUDIT_ARCH AUDIT_ARCH_I386
+#	define HESTIA_ARCH_NAME  "i386"
+#elif defined(__aarch64__)
+#	define HESTIA_AUDIT_ARCH AUDIT_ARCH_AARCH64
+#	define HESTIA_ARCH_NAME  "aarch64"
+#elif defined(__arm__)
+#	define HESTIA_AUDIT_ARCH AUDIT_ARCH_ARM
+#	define HESTIA_ARCH_NAME  "arm"
+#elif defined(__riscv) && __riscv_xlen == 64
+#	define HESTIA_AUDIT_ARCH AUDIT_ARCH_RISCV64
+#	define HESTIA_ARCH_NAME  "riscv64"
+#elif defined(__powerpc64__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#	define HESTIA_AUDIT_ARCH AUDIT_ARCH_PPC64LE
+#	define HESTIA_ARCH_NAME  "ppc64le"
+#elif defined(__s390x__)
+#	define HESTIA_AUDIT_ARCH AUDIT_ARCH_S390X
+#	define HESTIA_ARCH_NAME  "s390x"
+#elif defined(__loongarch64)
+#	define HESTIA_AUDIT_ARCH AUDIT_ARCH_LOONGARCH64
+#	define HESTIA_ARCH_NAME  "loongarch64"
+#else
+#	error "seccomp: unsupported architecture"
+#endif
+
+typedef struct sysName{
+	const char* name;
+	unsigned    nr;
+}sysName_s;
+
+//syscall table of an arch, generated by generate.syscall, first is native
+//bit is or'ed to index to get nr, x32 share audit arch with x86_64
+//index is sorted by name
+typedef struct sysArch{
+	const char*      name;
+	unsigned         audit;
+	unsigned         bit;
+	char**           table;
+	unsigned         count;
+	const sysName_s* index;
+	unsigned         nindex;
+}sysArch_s;
+
+extern char* SYSTEMCALLNAME[];
+extern const unsigned SYSTEMCALLNAMECOUNT;
+extern const sysArch_s SYSTEMCALLARCH[];
+extern const unsigned SYSTEMCALLARCHCOUNT;
+
+//arg op value, SET is true if any bit of value is set in arg
+typedef struct sysCond{
+	unsigned arg;
+	unsigned op;
+	uint64_t value;
+}sysCond_s;
+
+//rule match if all condition match, action is a SECCOMP_RET_*
+//group is 0 or index+1 of a syscall group, expanded with table of each arch when filter is compiled
+typedef struct sysRule{
+	unsigned  nr;
+	unsigned  id;
+	unsigned  action;
+	unsigned  group;
+	unsigned  ncond;
+	sysCond_s cond[SECCOMP_COND_MAX];
+}sysRule_s;
+
+//shared page between sandbox and supervisor, fd is -1 until filter is applied
+typedef struct seccompListener{
+	int fd;
+	int taken;
+}seccompListener_s;
+
+int syscall_nr(const char* name);
+long syscall_action(const char* name);
+int syscall_add(sysRule_s** rule, const char* token, unsigned action);
+struct sock_filter* syscall_compile(sysRule_s* rule, unsigned def);
+int syscall_notify(struct sock_filter* filter);
+int syscall_apply(struct sock_filter* filter, unsigned flags);
+void syscall_listener_send(seccompListener_s* l, int fd, struct sock_filter* filter);
+int syscall_listener_take(seccompListener_s* l, int pidfd);
+void syscall_supervisor(int fd, struct sock_filter* filter);
+unsigned syscall_eval(struct sock_filter* filter, const struct seccomp_data* data);
+const char* syscall_action_name(unsigned action, char* buf, size_t size);
+int syscall_test(struct sock_filter* filter, const char* spec, FILE* out);
 
 int systemcall_deny(char** sys, unsigned const count);
 char* cgroup_new(const char* name);
 int cgroup_delete(char* group);
 int cgroup_rule(const char* group, const char* dest, const char* rule, int add);
 int cgroup_apply(const char* group, unsigned pid);
+int cgroup_open(const char* group);
+unsigned cgroup_signal(const char* group, int sig);
+long cgroup_cpu_usage(const char* group);
 
+pid_t sandbox_fork(int* pidfd, int cgroup, int userns);
+int userns_map(pid_t pid, uid_t uid, gid_t gid);
+int userns_idmap(uid_t ufrom, uid_t uto, gid_t gfrom, gid_t gto);
 int change_root(const char* path);
 int privilege_drop(uid_t uid, gid_t gid );
 
@@ -0,0 +1,19 @@
+#ifndef __HESTIA_TEARDOWN_H__
+#define __HESTIA_TEARDOWN_H__
+
+/*
+ * sandbox teardown
+ * directory are not removed in place, are renamed in destdir/.grave and a detached reaper delete it in background
+ * reaper use getdents64 and unlinkat relative to directory fd, unlinkat are batched on io_uring when available
+ * a reaper killed before end leave the graveyard, next teardown on same destdir complete the job
+*/
+
+#define HESTIA_GRAVEYARD        ".grave"
+#define HESTIA_TEARDOWN_RING    64
+#define HESTIA_TEARDOWN_DENTS   32768
+
+int teardown_bury(const char* destdir, const char* path);
+void teardown_reap(const char* destdir);
+int rm_at(int dirfd);
+
+#endif
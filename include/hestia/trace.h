@@ -0,0 +1,40 @@
+#ifndef __HESTIA_TRACE_H__
+#define __HESTIA_TRACE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * launch timing
+ * event are in a shared anonymous mapping, sandbox child write there the bytecode stage
+ * timestamp are CLOCK_MONOTONIC ns, event not ended (exec) are closed when sandbox is reaped
+ * report is json: {"total_ns":n,"event":[{"stage","label","pid","begin_ns","dur_ns"}]}, begin is relative to first event
+*/
+
+#define HESTIA_TRACE_MAX   256
+#define HESTIA_TRACE_STAGE 16
+#define HESTIA_TRACE_LABEL 96
+
+typedef struct traceEvent{
+	uint64_t begin;
+	uint64_t end;
+	pid_t    pid;
+	char     stage[HESTIA_TRACE_STAGE];
+	char     label[HESTIA_TRACE_LABEL];
+}traceEvent_s;
+
+typedef struct trace{
+	unsigned     count;
+	unsigned     max;
+	traceEvent_s event[];
+}trace_s;
+
+trace_s* trace_new(void);
+void trace_free(trace_s* t);
+int trace_begin(trace_s* t, const char* stage, const char* label);
+void trace_end(trace_s* t, int id);
+void trace_close(trace_s* t);
+int trace_json(trace_s* t, FILE* out);
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef __NOTSTD_BENCH_H__
+#define __NOTSTD_BENCH_H__
+
+#include <notstd/core.h>
+#include <notstd/delay.h>
+
+/** micro benchmark
+ * each case is called batch times for each sample, batch grow in warmup until a sample take BENCH_SAMPLE_NS of cpu
+ * sample is measured with time_cpu_ns, result is ns for one call
+ * cycles are reference cycles of tsc calibrated on monotonic clock, 0 where tsc is not available
+ */
+
+#define BENCH_WARMUP    3
+#define BENCH_REPEAT    30
+#define BENCH_SAMPLE_NS 2000000UL
+#define BENCH_BATCH_MAX (1U<<24)
+
+typedef void(*bench_f)(void* ctx);
+
+typedef struct benchResult{
+	char*    suite;
+	char*    name;
+	size_t   bytes;   /**< bytes processed by one call, 0 if not meaningful*/
+	unsigned batch;
+	unsigned count;
+	double   min;
+	double   p50;
+	double   p90;
+	double   max;
+}benchResult_s;
+
+typedef struct bench{
+	unsigned        warmup;
+	unsigned        repeat;
+	double          cpn;    /**< cycles for ns*/
+	const char*     suite;
+	const char*     filter; /**< run only suite with this name, NULL all*/
+	benchResult_s*  result;
+}bench_s;
+
+/** init bench and calibrate cycles
+ * @param b bench
+ * @param warmup samples discarded, 0 use BENCH_WARMUP
+ * @param repeat samples measured, 0 use BENCH_REPEAT
+ */
+bench_s* bench_ctor(bench_s* b, unsigned warmup, unsigned repeat);
+void bench_dtor(bench_s* b);
+
+/** set suite of next cases, return 0 if suite is filtered */
+int bench_suite(bench_s* b, const char* name);
+
+/** run case and store result, skipped if suite is filtered
+ * @param bytes processed by one call of fn, used for cycles/byte
+ */
+benchResult_s* bench_run(bench_s* b, const char* name, size_t bytes, bench_f fn, void* ctx);
+
+/** cycles for byte of result, 0 if unknown */
+double bench_cpb(const bench_s* b, const benchResult_s* r);
+
+void bench_print(const bench_s* b, FILE* out);
+
+/** json of all results, human readable if human */
+char* bench_json(const bench_s* b, unsigned human);
+
+#endif
@@ -59,11 +59,15 @@
 	#define __parallef     DO_PRAGMA(omp parallel for)
 	#define __paralleft(V) DO_PRAGMA(omp parallel for num_threads(V))
 	#define __parallefc(Z) DO_PRAGMA(omp parallel for collapse Z)
+	#define __parallefo    DO_PRAGMA(omp parallel for ordered schedule(dynamic))
+	#define __ordered      DO_PRAGMA(omp ordered)
 #else
 	#define __parallel
 	#define __parallef
 	#define __paralleft(V)	__unused __typeof(V) __POOR_CLANG__ = V;
 	#define __parallefc(Z)
+	#define __parallefo
+	#define __ordered
 #endif
 
 #ifdef __cplusplus
@@ -24,6 +24,7 @@ typedef uint64_t delay_t;
 delay_t time_ms(void);
 delay_t time_us(void);
 delay_t time_ns(void);
+delay_t time_mono_ns(void);
 
 delay_t time_cpu_ms(void);
 delay_t time_cpu_us(void);
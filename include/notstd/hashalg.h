@@ -9,6 +9,10 @@
 
 uint64_t hash_one_at_a_time(const void *key, size_t len);
 uint64_t hash_fasthash(const void* key, size_t len);
+//streaming fasthash, same result of hash_fasthash, total is full length, update consume only 8 byte blocks
+uint64_t hash_fasthash_init(size_t total);
+uint64_t hash_fasthash_update(uint64_t h, const void* key, size_t len);
+uint64_t hash_fasthash_final(uint64_t h, const void* key, size_t len);
 uint64_t hash_kr(const void* key, size_t len);
 uint64_t hash_sedgewicks(const void* key, size_t len);
 uint64_t hash_sobel(const void* key, size_t len);
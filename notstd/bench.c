@@ -0,0 +1,151 @@
+#include <notstd/bench.h>
+#include <notstd/str.h>
+#include <notstd/json.h>
+
+#define BENCH_CALIBRATE_NS 20000000UL
+
+__private void result_cleanup(void* pr){
+	benchResult_s* r = pr;
+	mem_free(r->suite);
+	mem_free(r->name);
+}
+
+__private uint64_t cycles(void){
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return 0;
+#endif
+}
+
+//tsc tick for ns, busy wait on monotonic clock
+__private double cycles_calibrate(void){
+	uint64_t const c0 = cycles();
+	uint64_t const t0 = time_mono_ns();
+	uint64_t t1;
+	while( (t1=time_mono_ns()) - t0 < BENCH_CALIBRATE_NS );
+	uint64_t const c1 = cycles();
+	return (double)(c1 - c0) / (double)(t1 - t0);
+}
+
+bench_s* bench_ctor(bench_s* b, unsigned warmup, unsigned repeat){
+	b->warmup = warmup ? warmup : BENCH_WARMUP;
+	b->repeat = repeat ? repeat : BENCH_REPEAT;
+	b->cpn    = cycles_calibrate();
+	b->suite  = NULL;
+	b->filter = NULL;
+	b->result = MANY(benchResult_s, 16);
+	return b;
+}
+
+void bench_dtor(bench_s* b){
+	mforeach(b->result, i){
+		result_cleanup(&b->result[i]);
+	}
+	mem_free(b->result);
+}
+
+int bench_suite(bench_s* b, const char* name){
+	b->suite = name;
+	return !b->filter || !strcmp(b->filter, name);
+}
+
+__private uint64_t sample(unsigned batch, bench_f fn, void* ctx){
+	uint64_t const start = time_cpu_ns();
+	for( unsigned i = 0; i < batch; ++i ) fn(ctx);
+	return time_cpu_ns() - start;
+}
+
+__private int dcmp(const void* a, const void* b){
+	const double da = *(const double*)a;
+	const double db = *(const double*)b;
+	return da < db ? -1 : da > db;
+}
+
+benchResult_s* bench_run(bench_s* b, const char* name, size_t bytes, bench_f fn, void* ctx){
+	if( b->filter && b->suite && strcmp(b->filter, b->suite) ) return NULL;
+	//warmup also find batch to fill a sample
+	unsigned batch = 1;
+	for( unsigned i = 0; i < b->warmup; ++i ){
+		while( sample(batch, fn, ctx) < BENCH_SAMPLE_NS && batch < BENCH_BATCH_MAX ) batch *= 2;
+	}
+	__free double* ns = MANY(double, b->repeat);
+	for( unsigned i = 0; i < b->repeat; ++i ){
+		ns[i] = (double)sample(batch, fn, ctx) / batch;
+	}
+	qsort(ns, b->repeat, sizeof(double), dcmp);
+
+	unsigned const ir = mem_ipush(&b->result);
+	benchResult_s* r = &b->result[ir];
+	r->suite = str_dup(b->suite ? b->suite : "", 0);
+	r->name  = str_dup(name, 0);
+	r->bytes = bytes;
+	r->batch = batch;
+	r->count = b->repeat;
+	r->min   = ns[0];
+	r->p50   = ns[b->repeat / 2];
+	r->p90   = ns[(b->repeat * 9) / 10];
+	r->max   = ns[b->repeat - 1];
+	return r;
+}
+
+double bench_cpb(const bench_s* b, const benchResult_s* r){
+	if( !r->bytes || b->cpn <= 0.0 ) return 0.0;
+	return r->p50 * b->cpn / r->bytes;
+}
+
+void bench_print(const bench_s* b, FILE* out){
+	fprintf(out, "%-8s %-24s %10s %12s %12s %12s %12s %8s\n", "suite", "case", "bytes", "min(ns)", "p50(ns)", "p90(ns)", "max(ns)", "c/B");
+	mforeach(b->result, i){
+		const benchResult_s* r = &b->result[i];
+		fprintf(out, "%-8s %-24s %10zu %12.1f %12.1f %12.1f %12.1f ", r->suite, r->name, r->bytes, r->min, r->p50, r->p90, r->max);
+		double const cpb = bench_cpb(b, r);
+		if( cpb > 0.0 ){
+			fprintf(out, "%8.2f\n", cpb);
+		}
+		else{
+			fprintf(out, "%8s\n", "-");
+		}
+	}
+}
+
+__private void json_num(jvalue_s* obj, const char* name, long n){
+	jvalue_s* jv = jvalue_property_new(obj, str_dup(name, 0));
+	jv->type = JV_NUM;
+	jv->n    = n;
+}
+
+__private void json_float(jvalue_s* obj, const char* name, double f){
+	jvalue_s* jv = jvalue_property_new(obj, str_dup(name, 0));
+	jv->type = JV_FLOAT;
+	jv->f    = f;
+}
+
+__private void json_str(jvalue_s* obj, const char* name, const char* s){
+	jvalue_string_ctor(jvalue_property_new(obj, str_dup(name, 0)), obj, str_dup(s, 0));
+}
+
+char* bench_json(const bench_s* b, unsigned human){
+	jvalue_s root;
+	jvalue_object_ctor(&root, NULL);
+	json_num(&root, "warmup", b->warmup);
+	json_num(&root, "repeat", b->repeat);
+	json_float(&root, "cycles_ns", b->cpn);
+	jvalue_s* res = jvalue_array_ctor(jvalue_property_new(&root, str_dup("result", 0)), &root);
+	mforeach(b->result, i){
+		const benchResult_s* r = &b->result[i];
+		jvalue_s* e = jvalue_object_ctor(jvalue_array_new(res), res);
+		json_str(e, "suite", r->suite);
+		json_str(e, "case", r->name);
+		json_num(e, "bytes", r->bytes);
+		json_num(e, "batch", r->batch);
+		json_float(e, "min_ns", r->min);
+		json_float(e, "p50_ns", r->p50);
+		json_float(e, "p90_ns", r->p90);
+		json_float(e, "max_ns", r->max);
+		json_float(e, "cycles_byte", bench_cpb(b, r));
+	}
+	char* str = json_encode(&root, 3, human);
+	jvalue_dtor(&root);
+	return str;
+}
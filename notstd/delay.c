@@ -26,6 +26,12 @@ delay_t time_ns(void){
 	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
+delay_t time_mono_ns(void){
+	struct timespec ts; 
+	clock_gettime(CLOCK_MONOTONIC, &ts); 
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 delay_t time_cpu_ms(void){
 	struct timespec ts; 
 	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts); 
@@ -0,0 +1,47 @@
+#include <notstd/hashalg.h>
+
+#define fasthash_mix(H) ({ (H) ^= (H) >> 23; (H) *= 0x2127599bf4325c37ULL; (H) ^= (H) >> 47; })
+#define FASTHASH_M      0x880355f21e6d1965ULL
+
+// fasthash64 Zilong Tan, MIT licensed, seed 0
+uint64_t hash_fasthash_init(size_t total){
+	return total * FASTHASH_M;
+}
+
+uint64_t hash_fasthash_update(uint64_t h, const void* key, size_t len){
+	const unsigned char* p = key;
+	const unsigned char* end = p + (len & ~(size_t)7);
+	uint64_t v;
+	for(; p != end; p += 8 ){
+		memcpy(&v, p, sizeof v);
+		h ^= fasthash_mix(v);
+		h *= FASTHASH_M;
+	}
+	return h;
+}
+
+uint64_t hash_fasthash_final(uint64_t h, const void* key, size_t len){
+	h = hash_fasthash_update(h, key, len);
+	const unsigned char* p = (const unsigned char*)key + (len & ~(size_t)7);
+	uint64_t v = 0;
+	__unsafe_begin;
+	__unsafe_fallthrough;
+	switch( len & 7 ){
+		case 7: v ^= (uint64_t)p[6] << 48;
+		case 6: v ^= (uint64_t)p[5] << 40;
+		case 5: v ^= (uint64_t)p[4] << 32;
+		case 4: v ^= (uint64_t)p[3] << 24;
+		case 3: v ^= (uint64_t)p[2] << 16;
+		case 2: v ^= (uint64_t)p[1] << 8;
+		case 1:
+			v ^= (uint64_t)p[0];
+			h ^= fasthash_mix(v);
+			h *= FASTHASH_M;
+	}
+	__unsafe_end;
+	return fasthash_mix(h);
+}
+
+uint64_t hash_fasthash(const void* key, size_t len){
+	return hash_fasthash_final(hash_fasthash_init(len), key, len);
+}
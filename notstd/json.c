@@ -706,8 +706,9 @@ __private void jestr(jenc_s* je, const char* str){
 			case '\n': je->str[len++] = '\\'; je->str[len++] = 'n'; break;
 			case '\r': je->str[len++] = '\\'; je->str[len++] = 'r'; break;
 			case '\t': je->str[len++] = '\\'; je->str[len++] = 't'; break;
-			default  : je->str[len++] = *str++;                     break;
+			default  : je->str[len++] = *str;                       break;
 		}
+		++str;
 	}
 	je->str[len++] = '"';
 	mem_header(je->str)->len = len;
@@ -762,7 +763,7 @@ __private void encode(jvalue_s* jv, jenc_s* je, int hum){
 				je->str[mem_header(je->str)->len++] = ',';
 				if( hum ) je->str[mem_header(je->str)->len++] = ' ';
 			}
-			if( mem_header(jv->a)->len ) --mem_header(je->str)->len;
+			if( mem_header(jv->a)->len ) mem_header(je->str)->len -= 1 + hum;
 			je->str = mem_upsize(je->str, 1);
 			je->str[mem_header(je->str)->len++] = ']';
 		}break;
@@ -775,11 +776,16 @@ __private void encode(jvalue_s* jv, jenc_s* je, int hum){
 			rbtreeit_s it;
 			rbtreeit_ctor(&it, jv->o, 0);
 			jproperty_s* ojp;
+			unsigned count = 0;
 			while( (ojp=rbtree_iterate_inorder(&it)) ){
 				jpenc(ojp, je, hum);
+				++count;
+			}
+			//remove last separator
+			if( count ){
+				mem_header(je->str)->len -= 1 + hum;
+				if( hum ) je->str[mem_header(je->str)->len++] = '\n';
 			}
-			--mem_header(je->str)->len;
-			if( hum ) je->str[mem_header(je->str)->len] = '\n';
 			--je->tab;
 			if( hum ) entab(je, 1);
 			je->str = mem_upsize(je->str, 1);
@@ -798,8 +804,8 @@ char* json_encode(jvalue_s* jv, unsigned fprec, unsigned human){
 	};
 	
 	encode(jv, &je, human);
-	je.str = mem_nullterm(je.str);
 	je.str = mem_fit(je.str);
+	je.str = mem_nullterm(je.str);
 	return je.str;
 }
 
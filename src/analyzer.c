@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <notstd/core.h>
 #include <notstd/str.h>
 
@@ -6,6 +7,44 @@
 #include <hestia/analyzer.h>
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+/*
+ * analyzer
+ *	entries of each upper are split in task, directory are expanded in place until there are enough task for all worker
+ *	each task walk its subtree with getdents64 on dirfd in sorted order and write in own buffer
+ *	ordered loop stream buffer in task order, output is same of a sequential sorted walk
+ *	memory is limited to directory in walk and buffer of task in fly
+ *	emit is called from worker thread, for each entry that is not a directory and for each empty directory
+ *	directory that can't be read is reported on stderr and is never emitted as empty
+*/
+
+#define ANALYZER_DENTS      32768
+#define ANALYZER_TASK_SCALE 16
+#define ANALYZER_EXPAND_MAX 4
+
+typedef struct anTask{
+	unsigned type;
+	char*    path;
+}anTask_s;
+
+//each entry in name is [type][name\0], off is sorted by name
+typedef struct anDir{
+	char*     name;
+	unsigned* off;
+}anDir_s;
+
+//reverse of dtname, DT_UNKNOWN if not exists
+unsigned dttype(const char* name){
+	for( unsigned i = 0; i <= DT_SOCK; ++i ){
+		const char* n = dtname(i);
+		if( n && !strcmp(n, name) ) return i;
+	}
+	return DT_UNKNOWN;
+}
 
 const char* dtname(unsigned dt){
 	__private const char* DTNAME[] = {
@@ -20,104 +59,203 @@ const char* dtname(unsigned dt){
 	return DTNAME[dt];
 }
 
-__private void dump_search_mod(char* path, analEnt_s** list){
-	DIR* d = opendir(path);
-	struct dirent* ent;
-	unsigned count = 0;
-	if( !d ){
-		dbg_error("%s: %m", path);
-		return;
+__private int name_cmp(const void* a, const void* b, void* ctx){
+	const char* name = ctx;
+	return strcmp(&name[*(const unsigned*)a + 1], &name[*(const unsigned*)b + 1]);
+}
+
+__private void an_error(const char* path){
+	fprintf(stderr, "hestia: analyze %s: %m\n", path);
+}
+
+__private int dir_read(int fd, anDir_s* d){
+	d->name = MANY(char, 4096);
+	d->off  = MANY(unsigned, 64);
+	__free char* buf = MANY(char, ANALYZER_DENTS);
+	ssize_t nr;
+	while( (nr=getdents64(fd, buf, ANALYZER_DENTS)) > 0 ){
+		for( ssize_t p = 0; p < nr; ){
+			struct dirent64* ent = (struct dirent64*)&buf[p];
+			p += ent->d_reclen;
+			if( !strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..") ) continue;
+			unsigned type = ent->d_type;
+			if( type == DT_UNKNOWN ){
+				struct stat st;
+				type = fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) ? DT_REG : IFTODT(st.st_mode);
+			}
+			size_t len = strlen(ent->d_name) + 1;
+			unsigned at = mem_header(d->name)->len;
+			d->name = mem_upsize(d->name, len + 1);
+			d->name[at] = type;
+			memcpy(&d->name[at+1], ent->d_name, len);
+			mem_header(d->name)->len += len + 1;
+			unsigned i = mem_ipush(&d->off);
+			d->off[i] = at;
+		}
+	}
+	qsort_r(d->off, mem_header(d->off)->len, sizeof(unsigned), name_cmp, d->name);
+	return nr < 0 ? -1 : 0;
+}
+
+__private void dir_free(anDir_s* d){
+	mem_free(d->name);
+	mem_free(d->off);
+}
+
+//path is a PATH_MAX buffer, len is length of directory path
+__private void walk(int fd, char* path, unsigned len, FILE* out, analyze_f emit, void* ctx){
+	anDir_s d;
+	int err = dir_read(fd, &d);
+	if( err ) an_error(path);
+	if( !err && !mem_header(d.off)->len ){
+		emit(out, AT_FDCWD, path, DT_DIR, path, ctx);
 	}
-	while( (ent=readdir(d)) ){
-		if( !strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..") ) continue;
-		++count;
-		__free char* fullname = str_printf("%s/%s", path, ent->d_name);
-		if( ent->d_type == DT_DIR ){
-			dump_search_mod(fullname, list);
+	mforeach(d.off, i){
+		const unsigned type = d.name[d.off[i]];
+		const char* name    = &d.name[d.off[i]+1];
+		unsigned nl = strlen(name);
+		if( len + nl + 2 > PATH_MAX ){
+			dbg_error("path too long %s/%s", path, name);
+			continue;
+		}
+		path[len] = '/';
+		memcpy(&path[len+1], name, nl + 1);
+		if( type == DT_DIR ){
+			int sub = openat(fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if( sub == -1 ){
+				an_error(path);
+			}
+			else{
+				walk(sub, path, len + nl + 1, out, emit, ctx);
+				close(sub);
+			}
 		}
 		else{
-			unsigned i = mem_ipush(list);
-			(*list)[i].type = ent->d_type;
-			(*list)[i].path = mem_borrowed(fullname);
+			emit(out, fd, name, type, path, ctx);
 		}
 	}
-	closedir(d);
-	if( !count ){
-		unsigned i = mem_ipush(list);
-		(*list)[i].type = DT_DIR;
-		(*list)[i].path = mem_borrowed(path);
+	path[len] = 0;
+	dir_free(&d);
+}
+
+//push sorted content of dir as task, return count of pushed or -1 if dir can't be open
+__private int task_dir(anTask_s** task, const char* path){
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if( fd == -1 ){
+		an_error(path);
+		return -1;
+	}
+	anDir_s d;
+	if( dir_read(fd, &d) ){
+		an_error(path);
 	}
+	close(fd);
+	mforeach(d.off, i){
+		unsigned it = mem_ipush(task);
+		(*task)[it].type = d.name[d.off[i]];
+		(*task)[it].path = str_printf("%s/%s", path, &d.name[d.off[i]+1]);
+	}
+	int count = mem_header(d.off)->len;
+	dir_free(&d);
+	return count;
 }
 
-__private void dump_overlay(const char* path, analEnt_s** list){
-	DIR* d = opendir(path);
-	struct dirent* ent;
-	if( !d ){
-		dbg_error("%s: %m", path);
+__private void find_overlay(const char* path, anTask_s** task){
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if( fd == -1 ){
+		an_error(path);
 		return;
 	}
-	while( (ent=readdir(d)) ){
-		if( !strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..") ) continue;
-		__free char* fullname = str_printf("%s/%s", path, ent->d_name);
-		if( ent->d_type == DT_DIR ){
-			dump_search_mod(fullname, list);
+	anDir_s d;
+	if( dir_read(fd, &d) ) an_error(path);
+	close(fd);
+	mforeach(d.off, i){
+		const char* name = &d.name[d.off[i]+1];
+		//skip also hidden graveyard and state
+		if( d.name[d.off[i]] != DT_DIR || name[0] == '.' || !strcmp(name, HESTIA_ROOT) ) continue;
+		const char* ext = strrchr(name, '.');
+		if( !ext ) continue;
+		__free char* child = str_printf("%s/%s", path, name);
+		if( !strcmp(ext, ".upper") ){
+			task_dir(task, child);
 		}
-		else{
-			unsigned i = mem_ipush(list);
-			(*list)[i].type = ent->d_type;
-			(*list)[i].path = mem_borrowed(fullname);
+		else if( strcmp(ext, ".work") && strcmp(ext, ".merge") && strcmp(ext, ".lower") && strcmp(ext, ".tmpfs") ){
+			find_overlay(child, task);
 		}
 	}
-	closedir(d);
+	dir_free(&d);
 }
 
-__private void find_overlay(const char* path, analEnt_s** list){
-	DIR* d = opendir(path);
-	struct dirent* ent;
-	if( !d ){
-		dbg_error("%s: %m", path);
-		return;
-	}
-	while( (ent=readdir(d)) ){
-		if( !strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..") || !strcmp(ent->d_name, HESTIA_ROOT) ) continue;
-		if( ent->d_type != DT_DIR ) continue;
-		const char* name = strrchr(ent->d_name, '.');
-		if( !name ) continue;
-		if( !strcmp(name, ".upper") ){
-			__free char* overlay = str_printf("%s/%s", path, ent->d_name);
-			dump_overlay(overlay, list);
-		}
-		else if( !strcmp(name, ".work") || !strcmp(name, ".merge") ){
+//replace each directory task with its content, empty directory is a line task, unreadable directory is dropped
+__private anTask_s* task_expand(anTask_s* task, int* expanded){
+	anTask_s* ex = MANY(anTask_s, mem_header(task)->len * 2);
+	*expanded = 0;
+	mforeach(task, i){
+		int count = task[i].type == DT_DIR ? task_dir(&ex, task[i].path) : 0;
+		if( count ){
+			if( count > 0 ) *expanded = 1;
+			mem_free(task[i].path);
 			continue;
 		}
-		else{
-			__free char* childpath = str_printf("%s/%s", path, ent->d_name);
-			find_overlay(childpath, list);
-		}
+		if( task[i].type == DT_DIR ) task[i].type = DT_UNKNOWN;
+		unsigned it = mem_ipush(&ex);
+		ex[it] = task[i];
 	}
-	closedir(d);
+	mem_free(task);
+	return ex;
 }
 
-__private void list_cleanup(void* pan){
-	analEnt_s* an = pan;
-	mforeach(an, i){
-		mem_free(an[i].path);
+__private void text_emit(FILE* out, __unused int dirfd, __unused const char* name, unsigned type, const char* path, __unused void* ctx){
+	fprintf(out, "[%s]%s\n", dtname(type), path);
+}
+
+void hestia_analyze_walk(const char* destdir, FILE* out, analyze_f emit, void* ctx){
+	anTask_s* task = MANY(anTask_s, 64);
+	find_overlay(destdir, &task);
+	unsigned const want = sysconf(_SC_NPROCESSORS_ONLN) * ANALYZER_TASK_SCALE;
+	int expanded = 1;
+	for( unsigned level = 0; expanded && level < ANALYZER_EXPAND_MAX && mem_header(task)->len < want; ++level ){
+		task = task_expand(task, &expanded);
+	}
+
+	unsigned const count = mem_header(task)->len;
+	__parallefo
+	for( unsigned i = 0; i < count; ++i ){
+		char*  buf  = NULL;
+		size_t size = 0;
+		FILE* f = open_memstream(&buf, &size);
+		if( task[i].type == DT_DIR ){
+			char path[PATH_MAX];
+			strncpy(path, task[i].path, PATH_MAX-1);
+			path[PATH_MAX-1] = 0;
+			int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if( fd == -1 ){
+				an_error(path);
+			}
+			else{
+				walk(fd, path, strlen(path), f, emit, ctx);
+				close(fd);
+			}
+		}
+		else{
+			//DT_UNKNOWN is a directory already expanded and empty
+			emit(f, AT_FDCWD, task[i].path, task[i].type == DT_UNKNOWN ? DT_DIR : task[i].type, task[i].path, ctx);
+		}
+		fclose(f);
+		__ordered
+		fwrite(buf, 1, size, out);
+		free(buf);
+		mem_free(task[i].path);
 	}
+	mem_free(task);
 }
 
-analEnt_s* hestia_analyze_list(const char* destdir){
-	analEnt_s* an = MANY(analEnt_s, 32, list_cleanup);
-	find_overlay(destdir, &an);
-	return an;
+void hestia_analyze(const char* destdir, FILE* out){
+	hestia_analyze_walk(destdir, out, text_emit, NULL);
 }
 
 void hestia_analyze_root(const char* destdir){
 	printf(HESTIA_ANALYZER"%s\n", destdir);
-	__free analEnt_s* an = hestia_analyze_list(destdir);
-	mforeach(an, i){
-		printf("[%s]%s\n", dtname(an[i].type), an[i].path);
-	}
+	hestia_analyze(destdir, stdout);
 	puts("");
 }
-
-
@@ -0,0 +1,324 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/filter.h>
+
+#include <notstd/core.h>
+#include <notstd/str.h>
+#include <notstd/hashalg.h>
+
+#include <hestia/inutility.h>
+#include <hestia/config.h>
+#include <hestia/cache.h>
+
+#define CACHE_LIST_COUNT 4
+
+typedef struct cacheHeader{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t abi;
+	uint32_t size;
+	uint32_t key;
+	uint32_t keylen;
+	uint32_t ndep;
+	uint32_t dep;
+	uint32_t nop[CACHE_LIST_COUNT];
+	uint32_t op;
+	uint32_t root;
+	uint32_t nfilter;
+	uint32_t filter;
+	uint32_t str;
+	uint32_t strsize;
+	uint32_t reserved;
+}cacheHeader_s;
+
+typedef struct cacheDep{
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t  mtime;
+	int64_t  mtimens;
+	uint64_t path;
+}cacheDep_s;
+
+typedef struct cacheOp{
+	uint64_t opcode;
+	uint64_t arg[16];
+}cacheOp_s;
+
+__private char* cache_path(const char* key){
+	const char* end = strchrnul(key, '\n');
+	__free char* name = str_dup(key, end-key);
+	str_tr(name, "/", '_');
+	return str_printf("%s/%s.%016lx.%s", HESTIA_CACHE_PATH, name, hash_fasthash(key, strlen(key)), HESTIA_CACHE_EXT);
+}
+
+//any change on opcode table invalidate all cache
+__private uint64_t cache_abi(void){
+	uint64_t abi = HESTIA_CACHE_VERSION;
+	const cop_s* op;
+	for( unsigned i = 0; (op=config_vm_op(i)); ++i ){
+		abi ^= hash_fasthash(op->name, strlen(op->name)) + (abi << 6) + (abi >> 2);
+		abi ^= hash_fasthash(op->arg, strlen(op->arg)) + (abi << 6) + (abi >> 2);
+	}
+	return abi;
+}
+
+//removed or untrusted dependency is a miss, build report the error
+__private int dep_valid(const char* path, cacheDep_s* dep){
+	struct stat info;
+	const char* why = config_file_distrust(path, &info);
+	if( why ){
+		dbg_info("cache dependency %s %s", path, why);
+		return 0;
+	}
+	return
+		(uint64_t)info.st_dev  == dep->dev   &&
+		(uint64_t)info.st_ino  == dep->ino   &&
+		(uint64_t)info.st_size == dep->size  &&
+		info.st_mtim.tv_sec    == dep->mtime &&
+		info.st_mtim.tv_nsec   == dep->mtimens
+	;
+}
+
+__private int header_valid(cacheHeader_s* h, size_t size){
+	if( size < sizeof(cacheHeader_s) ) return 0;
+	if( h->magic != HESTIA_CACHE_MAGIC || h->version != HESTIA_CACHE_VERSION || h->abi != cache_abi() || h->size != size ) return 0;
+	uint64_t nop = 0;
+	for( unsigned l = 0; l < CACHE_LIST_COUNT; ++l ) nop += h->nop[l];
+	if( (uint64_t)h->dep + (uint64_t)h->ndep * sizeof(cacheDep_s) > size ) return 0;
+	if( (uint64_t)h->op + nop * sizeof(cacheOp_s) > size ) return 0;
+	if( (uint64_t)h->filter + (uint64_t)h->nfilter * sizeof(struct sock_filter) > size ) return 0;
+	if( (uint64_t)h->str + h->strsize > size || !h->strsize ) return 0;
+	if( (uint64_t)h->key + h->keylen >= h->strsize ) return 0;
+	//string table need to be terminated
+	if( ((char*)h)[h->str + h->strsize - 1] ) return 0;
+	return 1;
+}
+
+__private cbc_s* cache_list(cacheOp_s* op, unsigned count, const char* str, uint32_t strsize){
+	cbc_s* head = NULL;
+	for( unsigned i = 0; i < count; ++i ){
+		const cop_s* info = config_vm_op(op[i].opcode);
+		if( !info ) return NULL;
+		cbc_s* bc = cbc_new();
+		bc->fn = info->fn;
+		for( unsigned a = 0; info->arg[a]; ++a ){
+			switch( info->arg[a] ){
+				case 's':
+					if( op[i].arg[a] > strsize ) return NULL;
+					bc->arg[a].s = op[i].arg[a] ? (char*)&str[op[i].arg[a]-1] : NULL;
+				break;
+				case 'u': bc->arg[a].u  = op[i].arg[a]; break;
+				case 'a': bc->arg[a].as = NULL; break;
+			}
+		}
+		if( head ) ld_before(head, bc);
+		else head = bc;
+	}
+	return head;
+}
+
+configvm_s* config_cache_load(const char* key){
+	__free char* path = cache_path(key);
+	int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if( fd == -1 ) return NULL;
+	struct stat info;
+	if( fstat(fd, &info) || info.st_uid != 0 || (info.st_mode & (S_IWGRP | S_IWOTH)) || !S_ISREG(info.st_mode) ){
+		dbg_error("cache %s is not trusted", path);
+		close(fd);
+		return NULL;
+	}
+	if( (size_t)info.st_size < sizeof(cacheHeader_s) ){
+		close(fd);
+		return NULL;
+	}
+	//strings in bytecode point inside mapping, released only with config_cache_free
+	void* map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if( map == MAP_FAILED ) return NULL;
+	
+	cacheHeader_s* h = map;
+	const char* str = (char*)map + h->str;
+	if( !header_valid(h, info.st_size) || h->keylen != strlen(key) || memcmp(&str[h->key], key, h->keylen) ) goto ONMISS;
+	
+	cacheDep_s* dep = (cacheDep_s*)((char*)map + h->dep);
+	for( unsigned i = 0; i < h->ndep; ++i ){
+		if( dep[i].path >= h->strsize || !dep_valid(&str[dep[i].path], &dep[i]) ){
+			dbg_info("cache %s is stale", path);
+			goto ONMISS;
+		}
+	}
+	
+	configvm_s* vm = vm_new();
+	cacheOp_s* op = (cacheOp_s*)((char*)map + h->op);
+	cbc_s** list[CACHE_LIST_COUNT] = { &vm->stage, &vm->atexit, &vm->onfail, &vm->cgroup };
+	for( unsigned l = 0; l < CACHE_LIST_COUNT; ++l ){
+		if( h->nop[l] && !(*list[l] = cache_list(op, h->nop[l], str, h->strsize)) ) goto ONMISS;
+		op += h->nop[l];
+	}
+	if( !vm->stage || h->root >= h->nop[0] ) goto ONMISS;
+	vm->root = vm->stage;
+	for( unsigned i = 0; i < h->root; ++i ) vm->root = vm->root->next;
+	
+	if( h->nfilter ){
+		vm->filter = MANY(struct sock_filter, h->nfilter);
+		memcpy(vm->filter, (char*)map + h->filter, sizeof(struct sock_filter) * h->nfilter);
+		mem_header(vm->filter)->len = h->nfilter;
+	}
+	vm->cache     = map;
+	vm->cachesize = info.st_size;
+	dbg_info("cache hit %s", path);
+	return vm;
+ONMISS:
+	munmap(map, info.st_size);
+	return NULL;
+}
+
+__private void cache_list_free(cbc_s* head){
+	if( !head ) return;
+	cbc_s* it = head;
+	do{
+		cbc_s* next = it->next;
+		mem_free(it);
+		it = next;
+	}while( it != head );
+}
+
+void config_cache_free(configvm_s* vm){
+	iassert( vm->cache );
+	mem_free(vm->stage->prev->arg[0].as);
+	cache_list_free(vm->stage);
+	cache_list_free(vm->atexit);
+	cache_list_free(vm->onfail);
+	cache_list_free(vm->cgroup);
+	mem_free(vm->filter);
+	mem_free(vm->group);
+	munmap(vm->cache, vm->cachesize);
+	mem_free(vm);
+}
+
+__private uint64_t str_table(char** table, const char* s){
+	if( !s ) return 0;
+	size_t const len = strlen(s) + 1;
+	uint64_t const off = mem_header(*table)->len;
+	*table = mem_upsize(*table, len);
+	memcpy(&(*table)[off], s, len);
+	mem_header(*table)->len += len;
+	return off + 1;
+}
+
+__private int list_count(cbc_s* list){
+	int count = 0;
+	ldforeach(list, it) ++count;
+	return count;
+}
+
+__private int op_push(cacheOp_s** ops, char** table, cbc_s* list){
+	ldforeach(list, it){
+		int opcode = config_vm_opcode(it->fn);
+		if( opcode < 0 ) return -1;
+		const cop_s* info = config_vm_op(opcode);
+		unsigned i = mem_ipush(ops);
+		memset(&(*ops)[i], 0, sizeof(cacheOp_s));
+		(*ops)[i].opcode = opcode;
+		for( unsigned a = 0; info->arg[a]; ++a ){
+			switch( info->arg[a] ){
+				case 's': (*ops)[i].arg[a] = str_table(table, it->arg[a].s); break;
+				case 'u': (*ops)[i].arg[a] = it->arg[a].u; break;
+				case 'a': (*ops)[i].arg[a] = 0; break;
+			}
+		}
+	}
+	return 0;
+}
+
+__private int write_all(int fd, const void* data, size_t size){
+	const char* p = data;
+	while( size ){
+		ssize_t nw = write(fd, p, size);
+		if( nw < 0 ){
+			if( errno == EINTR ) continue;
+			return -1;
+		}
+		p    += nw;
+		size -= nw;
+	}
+	return 0;
+}
+
+int config_cache_save(configvm_s* vm, const char* key, cdep_s* deps){
+	if( geteuid() != 0 ) return -1;
+	if( !dir_exists(HESTIA_CACHE_PATH) ) mk_dir(HESTIA_CACHE_PATH, 0700);
+	
+	__free char* table = MANY(char, 4096);
+	__free cacheOp_s* ops = MANY(cacheOp_s, 32);
+	__free cacheDep_s* dep = MANY(cacheDep_s, mem_header(deps)->len + 1);
+	cacheHeader_s h = {
+		.magic   = HESTIA_CACHE_MAGIC,
+		.version = HESTIA_CACHE_VERSION,
+		.abi     = cache_abi(),
+		.ndep    = mem_header(deps)->len,
+		.nop     = { list_count(vm->stage), list_count(vm->atexit), list_count(vm->onfail), list_count(vm->cgroup) },
+		.nfilter = vm->filter ? mem_header(vm->filter)->len : 0,
+		.keylen  = strlen(key)
+	};
+	h.key = str_table(&table, key) - 1;
+	
+	mforeach(deps, i){
+		dep[i].dev     = deps[i].info.st_dev;
+		dep[i].ino     = deps[i].info.st_ino;
+		dep[i].size    = deps[i].info.st_size;
+		dep[i].mtime   = deps[i].info.st_mtim.tv_sec;
+		dep[i].mtimens = deps[i].info.st_mtim.tv_nsec;
+		dep[i].path    = str_table(&table, deps[i].path) - 1;
+	}
+	
+	if( op_push(&ops, &table, vm->stage) || op_push(&ops, &table, vm->atexit) || op_push(&ops, &table, vm->onfail) || op_push(&ops, &table, vm->cgroup) ){
+		dbg_error("unknown bytecode, cache disabled");
+		return -1;
+	}
+	h.root = 0;
+	ldforeach(vm->stage, it){
+		if( it == vm->root ) break;
+		++h.root;
+	}
+	
+	h.dep     = sizeof(cacheHeader_s);
+	h.op      = h.dep + sizeof(cacheDep_s) * h.ndep;
+	h.filter  = h.op + sizeof(cacheOp_s) * mem_header(ops)->len;
+	h.str     = h.filter + sizeof(struct sock_filter) * h.nfilter;
+	h.strsize = mem_header(table)->len;
+	h.size    = h.str + h.strsize;
+	
+	__free char* path = cache_path(key);
+	__free char* tmp  = str_printf("%s.XXXXXX", path);
+	int fd = mkstemp(tmp);
+	if( fd == -1 ){
+		dbg_error("unable to create cache %s: %m", tmp);
+		return -1;
+	}
+	fchmod(fd, 0600);
+	if( 
+		write_all(fd, &h, sizeof h) ||
+		write_all(fd, dep, sizeof(cacheDep_s) * h.ndep) ||
+		write_all(fd, ops, sizeof(cacheOp_s) * mem_header(ops)->len) ||
+		write_all(fd, vm->filter, sizeof(struct sock_filter) * h.nfilter) ||
+		write_all(fd, table, h.strsize)
+	){
+		dbg_error("unable to write cache %s: %m", tmp);
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	close(fd);
+	if( rename(tmp, path) ){
+		dbg_error("unable to rename cache %s: %m", path);
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
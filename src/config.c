@@ -4,6 +4,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <pwd.h>
+#include <linux/seccomp.h>
 
 #include <notstd/core.h>
 #include <notstd/str.h>
@@ -12,91 +13,214 @@
 #include <hestia/config.h>
 #include <hestia/system.h>
 #include <hestia/analyzer.h>
+#include <hestia/cache.h>
+#include <hestia/mount.h>
+#include <hestia/teardown.h>
+#include <hestia/state.h>
+#include <hestia/snapshot.h>
+#include <hestia/trace.h>
+#include <limits.h>
 
-__private char* config_load(const char* confname){
-	__free char* path = str_printf("%s/%s", HESTIA_CONFIG_PATH, confname);
-	struct stat info;
-	if( stat(path, &info) ) die("unable to get info on file '%s'::%m", path);
-	if( info.st_uid != 0 || info.st_gid != 0 ) die("config '%s' required root owner for uid and gid", path);
-	if( info.st_mode & S_IWOTH ) die("config '%s' can't share write privilege with others", path);
-	return mem_nullterm(load_file(path, 1));
+//NULL if file can be used as config, else the reason
+const char* config_file_distrust(const char* path, struct stat* info){
+	if( stat(path, info) ) return "not exists";
+	if( HESTIA_CONFIG_OWNER_CHECK && (info->st_uid != 0 || info->st_gid != 0) ) return "required root owner for uid and gid";
+	if( info->st_mode & S_IWOTH ) return "can't share write privilege with others";
+	return NULL;
 }
 
-//cgroup
-//	cgroup.new group
-//	cgroup.rule group, [*+-], property, rule
-//	cgroup.apply group
+void config_file_trusted(const char* path, struct stat* info){
+	const char* why = config_file_distrust(path, info);
+	if( why ) die("config '%s' %s", path, why);
+}
 
+//rootless sandbox map only its user, chown to any other id fail
+__private void mountpoint_owner(configvm_s* vm, const char* path, unsigned uid, unsigned gid){
+	if( !uid && !gid ) return;
+	if( chown(path, uid, gid) && (vm->flags & HESTIA_VM_USERNS) ){
+		dbg_warning("%s owner %u:%u is not mapped in user namespace", path, uid, gid);
+	}
+}
 
 __private int vm_mount(configvm_s* vm){
 	const char*    src  = vm->current->arg[0].s;
 	const char*    dst  = vm->current->arg[1].s;
 	const char*    type = vm->current->arg[2].s;
-	unsigned       flag = vm->current->arg[3].u;
+	unsigned const flag = vm->current->arg[3].u;
 	const char*    mode = vm->current->arg[4].s;
 	unsigned const prv  = vm->current->arg[5].u;
 	unsigned const uid  = vm->current->arg[6].u;
 	unsigned const gid  = vm->current->arg[7].u;
-	dbg_info("mount %s %s %s %X %s (%u:%u::%X)", src, dst, type, flag, mode, uid, gid, prv);
+	unsigned const imap = vm->current->arg[8].u;
+	dbg_info("mount %s %s %s %X %s (%u:%u::%X)%s", src, dst, type, flag, mode, uid, gid, prv, imap ? " idmap" : "");
 	mk_dir(dst, prv);
-	unsigned bindflags = 0;
-	if( flag & MS_BIND ){
-		bindflags = flag & (~MS_BIND);
-		flag = MS_BIND;
-	}
-	if( mount(src, dst, type, flag, mode) ){
-		dbg_error("mount.error src:'%s' '%s'::%s %X [%s]::%m", src, dst, type, flag, mode);
-		return -1;
-	}
-	if( bindflags ){
-		if( mount( NULL, dst, NULL, bindflags, NULL) ){
-			dbg_error("remount.error src:'%s' '%s'::%s %X [%s]::%m", src, dst, type, bindflags, mode);
-		}
+	//idmap show owner of src as uid:gid without touch the tree, mountpoint is owned by src
+	if( imap ){
+		if( hestia_mount_idmap(src, dst, flag, uid, gid) ) return -1;
+		return 0;
 	}
+	if( hestia_mount(src, dst, type, flag, mode) ) return -1;
 	chmod(dst, prv);
-	if( uid || gid ) chown(dst, uid, gid);
+	mountpoint_owner(vm, dst, uid, gid);
+	return 0;
+}
+
+#define OVERLAY_IDMAP    0x01
+#define OVERLAY_VOLATILE 0x02
+#define OVERLAY_METACOPY 0x04
+
+typedef struct overlayPath{
+	char* tmpdir;
+	char* lowerdir;
+	char* upperdir;
+	char* workdir;
+	char* ttarget;
+	char* target;
+}overlayPath_s;
+
+__private void overlay_path_ctor(overlayPath_s* op, cbc_s* bc){
+	const char* dst  = bc->arg[1].s;
+	const char* dd   = bc->arg[2].s;
+	const char* root = bc->arg[3].s;
+	op->lowerdir = bc->arg[9].u & OVERLAY_IDMAP ? str_printf("%s/%s.lower", dd, dst) : NULL;
+	if( bc->arg[10].s ){
+		op->tmpdir   = str_printf("%s/%s.tmpfs", dd, dst);
+		op->upperdir = str_printf("%s/upper", op->tmpdir);
+		op->workdir  = str_printf("%s/work", op->tmpdir);
+	}
+	else{
+		op->tmpdir   = NULL;
+		op->upperdir = str_printf("%s/%s.upper", dd, dst);
+		op->workdir  = str_printf("%s/%s.work", dd, dst);
+	}
+	op->ttarget  = str_printf("%s/%s.merge", dd, dst);
+	op->target   = str_printf("%s/%s", root, dst);
+}
+
+__private void overlay_path_dtor(overlayPath_s* op){
+	if( op->tmpdir ) mem_free(op->tmpdir);
+	if( op->lowerdir ) mem_free(op->lowerdir);
+	mem_free(op->upperdir);
+	mem_free(op->workdir);
+	mem_free(op->ttarget);
+	mem_free(op->target);
+}
+
+//metacopy copy up only metadata on chmod/chown, require redirect_dir for rename of directory
+__private char* overlay_mode(cbc_s* bc, overlayPath_s* op){
+	const char*    src  = bc->arg[0].s;
+	const char*    mode = bc->arg[5].s;
+	unsigned const ovl  = bc->arg[9].u;
+	return str_printf("%s%s%slowerdir=%s,upperdir=%s,workdir=%s",
+		(mode?mode:""),
+		(ovl & OVERLAY_METACOPY ? "metacopy=on,redirect_dir=on," : "metacopy=off,"),
+		(ovl & OVERLAY_VOLATILE ? "volatile," : ""),
+		(op->lowerdir?op->lowerdir:src), op->upperdir, op->workdir
+	);
+}
+
+__private void overlay_mkdir(cbc_s* bc, overlayPath_s* op){
+	unsigned const prv = bc->arg[6].u;
+	if( op->tmpdir ){
+		mk_dir(op->tmpdir, prv);
+	}
+	else{
+		state_upper_mkdir(op->upperdir, prv);
+		mk_dir(op->workdir , prv);
+	}
+	if( op->lowerdir ) mk_dir(op->lowerdir, prv);
+	mk_dir(op->ttarget , prv);
+	mk_dir(op->target  , prv);
+}
+
+__private int overlay_bind(configvm_s* vm, cbc_s* bc, overlayPath_s* op){
+	unsigned const prv = bc->arg[6].u;
+	unsigned const uid = bc->arg[7].u;
+	unsigned const gid = bc->arg[8].u;
+	if( hestia_mount(op->ttarget, op->target, "bind", MS_BIND, NULL) ) return -1;
+	chmod(op->target, prv);
+	mountpoint_owner(vm, op->target, uid, gid);
+	return 0;
+}
+
+//overlay can't be idmapped, lower is an idmapped clone of src, copy up write the mapped owner in upper
+__private int overlay_lower(cbc_s* bc, overlayPath_s* op){
+	if( !op->lowerdir ) return 0;
+	return hestia_mount_idmap(bc->arg[0].s, op->lowerdir, MS_BIND | MS_REC, bc->arg[7].u, bc->arg[8].u);
+}
+
+//upper and work on own tmpfs, are lost when sandbox end
+__private int overlay_upper(cbc_s* bc, overlayPath_s* op){
+	if( !op->tmpdir ) return 0;
+	unsigned const prv = bc->arg[6].u;
+	__free char* mode = str_printf("size=%s,mode=%o", bc->arg[10].s, prv);
+	if( hestia_mount("tmpfs", op->tmpdir, "tmpfs", MS_NOSUID | MS_NODEV, mode) ) return -1;
+	mk_dir(op->upperdir, prv);
+	mk_dir(op->workdir , prv);
 	return 0;
 }
 
 __private int vm_overlay(configvm_s* vm){
-	const char*    src  = vm->current->arg[0].s;
-	const char*    dst  = vm->current->arg[1].s;
-	const char*    dd   = vm->current->arg[2].s;
-	const char*    root = vm->current->arg[3].s;
-	unsigned const flag = vm->current->arg[4].u;
-	const char*    mode = vm->current->arg[5].s;
-	unsigned const prv  = vm->current->arg[6].u;
-	unsigned const uid  = vm->current->arg[7].u;
-	unsigned const gid  = vm->current->arg[8].u;
-	
-	__free char* upperdir = str_printf("%s/%s.upper", dd, dst);
-	__free char* workdir  = str_printf("%s/%s.work", dd, dst);
-	__free char* ttarget  = str_printf("%s/%s.merge", dd, dst);
-	__free char* overmode = str_printf("%smetacopy=off,lowerdir=%s,upperdir=%s,workdir=%s", (mode?mode:""), src, upperdir, workdir);
-	__free char* target   = str_printf("%s/%s", root, dst);
-	dbg_info("overlay %s->%s %X %s (%u:%u::%X)", src, target, flag, mode, uid, gid, prv);
-	mk_dir(upperdir, prv);
-	mk_dir(workdir , prv);
-	mk_dir(ttarget , prv);
-	mk_dir(target, prv);
+	cbc_s* bc = vm->current;
+	overlayPath_s op;
+	overlay_path_ctor(&op, bc);
+	__free char* overmode = overlay_mode(bc, &op);
+	dbg_info("overlay %s->%s %lX %s (%lu:%lu::%lX) %s", bc->arg[0].s, op.target, bc->arg[4].u, bc->arg[5].s, bc->arg[7].u, bc->arg[8].u, bc->arg[6].u, bc->arg[10].s ? bc->arg[10].s : "disk");
+	overlay_mkdir(bc, &op);
+	int ret = -1;
+	if( !overlay_lower(bc, &op) && !overlay_upper(bc, &op) && !hestia_mount("overlay", op.ttarget, "overlay", bc->arg[4].u, overmode) ) ret = overlay_bind(vm, bc, &op);
+	overlay_path_dtor(&op);
+	return ret;
+}
+
+//[u0] count, next count bytecode are overlay not nested, prepared in parallel and attached in order
+__private int vm_parallel(configvm_s* vm){
+	unsigned const count = vm->current->arg[0].u;
+	__free cbc_s** bc = MANY(cbc_s*, count);
+	__free overlayPath_s* op = MANY(overlayPath_s, count);
+	__free int* mfd = MANY(int, count);
+	cbc_s* it = vm->current;
+	for( unsigned i = 0; i < count; ++i ){
+		it = it->next;
+		iassert( it->fn == vm_overlay );
+		bc[i] = it;
+	}
+	if( !mount_api_available() ){
+		for( unsigned i = 0; i < count; ++i ){
+			vm->current = bc[i];
+			if( vm_overlay(vm) ) return -1;
+		}
+		return 0;
+	}
 	
-	if( mount("overlay", ttarget, "overlay", flag, overmode) ){
-		dbg_error("mount.error src:'%s' '%s'::%s [%s@%X]::%m", src, dst, "overlay", overmode, flag);
-		return -1;
+	dbg_info("parallel overlay %u", count);
+	__paralleft(HESTIA_PARALLEL_WORKER)
+	for( unsigned i = 0; i < count; ++i ){
+		overlay_path_ctor(&op[i], bc[i]);
+		__free char* overmode = overlay_mode(bc[i], &op[i]);
+		overlay_mkdir(bc[i], &op[i]);
+		mfd[i] = overlay_lower(bc[i], &op[i]) || overlay_upper(bc[i], &op[i]) ? -1 : mount_detached("overlay", "overlay", bc[i]->arg[4].u, overmode);
 	}
-	if( mount(ttarget, target, "bind", MS_BIND, NULL) ){
-		dbg_error("mount.error src:'%s' '%s'::%s [%s]::%m", ttarget, target, "bindOverlay", "");
-		return -1;
+	
+	int ret = 0;
+	for( unsigned i = 0; i < count; ++i ){
+		if( !ret && mfd[i] != -1 && !mount_attach(mfd[i], op[i].ttarget) ){
+			ret = overlay_bind(vm, bc[i], &op[i]);
+		}
+		else{
+			if( mfd[i] != -1 ) close(mfd[i]);
+			ret = -1;
+		}
+		overlay_path_dtor(&op[i]);
 	}
-	chmod(target, prv);
-	if( uid || gid ) chown(dst, uid, gid);
-	return 0;
+	vm->current = bc[count-1];
+	return ret;
 }
 
 __private int vm_dir(configvm_s* vm){
 	dbg_info("dir %s (%lu:%lu::%lX)", vm->current->arg[0].s, vm->current->arg[2].u, vm->current->arg[3].u, vm->current->arg[1].u);
 	mk_dir(vm->current->arg[0].s, vm->current->arg[1].u);
-	if( vm->current->arg[2].u || vm->current->arg[3].u ) chown(vm->current->arg[0].s, vm->current->arg[2].u, vm->current->arg[3].u);
+	mountpoint_owner(vm, vm->current->arg[0].s, vm->current->arg[2].u, vm->current->arg[3].u);
 	return 0;
 }
 
@@ -112,9 +236,19 @@ __private int vm_change_root(configvm_s* vm){
 	return change_root(vm->current->arg[0].s);
 }
 
+//filter is compiled when config is built, listener of notify is passed to supervisor
 __private int vm_seccomp(configvm_s* vm){
-	syscall_end(&vm->filter, vm->current->arg[0].u);
-	return syscall_apply(vm->filter);
+	int notify = syscall_notify(vm->filter);
+	if( !notify || !vm->listener ){
+		if( notify ){
+			dbg_warning("seccomp notify without supervisor, notified syscall fail with ENOSYS");
+		}
+		return syscall_apply(vm->filter, 0) < 0 ? -1 : 0;
+	}
+	int fd = syscall_apply(vm->filter, SECCOMP_FILTER_FLAG_NEW_LISTENER);
+	if( fd < 0 ) return -1;
+	syscall_listener_send(vm->listener, fd, vm->filter);
+	return 0;
 }
 
 //[u0] uid [u1] gid
@@ -136,44 +270,113 @@ __private int vm_exec(configvm_s* vm){
 	return 1;
 }
 
-// [s0] destdir [s1] name
+// [s0] destdir [s1] name [u2] flags
 __private int vm_snapshot(configvm_s* vm){
-	__free char* dest = str_printf("%s/%s.snapshot", vm->current->arg[0].s, vm->current->arg[1].s);
-	__free analEnt_s* snap = hestia_analyze_list(vm->current->arg[0].s);
-	FILE* f = fopen(dest, "w");
-	if( !f ){
-		dbg_error("fail to open file: %s:: %m", dest);
-		return -1;
-	}
-	mforeach(snap, i){
-		fprintf(f, "[%s]%s\n", dtname(snap[i].type), snap[i].path);
-	}
-	fclose(f);
-	chmod(dest, 0755);
+	return snapshot_write(vm->current->arg[0].s, vm->current->arg[1].s, vm->current->arg[2].u);
+}
+
+//[s0] property [s1] value, run on host before clone
+__private int vm_cgroup(configvm_s* vm){
+	dbg_info("cgroup %s %s", vm->current->arg[0].s, vm->current->arg[1].s);
+	return cgroup_rule(vm->group, vm->current->arg[0].s, vm->current->arg[1].s, 0);
+}
+
+//[u0] wall seconds [u1] grace seconds, enforced by launcher
+__private int vm_timeout(configvm_s* vm){
+	vm->timeout = vm->current->arg[0].u;
+	vm->grace   = vm->current->arg[1].u;
+	return 0;
+}
+
+//[u0] cpu seconds of all process in cgroup, enforced by launcher
+__private int vm_cputime(configvm_s* vm){
+	vm->cputime = vm->current->arg[0].u;
 	return 0;
 }
 
-__private cbc_s* cbc_new(void){
+__private cop_s VMOP[] = {
+	{ vm_mount         , "mount"     , "sssusuuuu"  },
+	{ vm_overlay       , "overlay"   , "ssssusuuuus" },
+	{ vm_dir           , "dir"       , "suuu"      },
+	{ vm_script        , "script"    , "s"         },
+	{ vm_change_root   , "changeroot", "s"         },
+	{ vm_seccomp       , "seccomp"   , ""          },
+	{ vm_privilege_drop, "privilege" , "uu"        },
+	{ vm_chdir         , "chdir"     , "s"         },
+	{ vm_exec          , "exec"      , "a"         },
+	{ vm_snapshot      , "snapshot"  , "ssu"       },
+	{ vm_parallel      , "parallel"  , "u"         },
+	{ vm_cgroup        , "cgroup"    , "ss"        },
+	{ vm_timeout       , "timeout"   , "uu"        },
+	{ vm_cputime       , "cputime"   , "u"         },
+};
+
+const cop_s* config_vm_op(unsigned opcode){
+	if( opcode >= sizeof_vector(VMOP) ) return NULL;
+	return &VMOP[opcode];
+}
+
+int config_vm_opcode(eval_f fn){
+	for( unsigned i = 0; i < sizeof_vector(VMOP); ++i ){
+		if( VMOP[i].fn == fn ) return i;
+	}
+	return -1;
+}
+
+cbc_s* cbc_new(void){
 	cbc_s* bc = NEW(cbc_s);
 	ld_ctor(bc);
 	return bc;
 }
 
-__private configvm_s* vm_new(void){
+configvm_s* vm_new(void){
 	configvm_s* vm = NEW(configvm_s);
 	vm->current = NULL;
+	vm->root    = NULL;
 	vm->filter  = NULL;
+	vm->listener = NULL;
+	vm->trace    = NULL;
 	vm->flags   = 0;
+	vm->cache   = NULL;
+	vm->cachesize = 0;
 	vm->stage   = NULL;
 	vm->atexit  = NULL;
 	vm->onfail  = NULL;
+	vm->cgroup  = NULL;
+	vm->group   = NULL;
+	vm->timeout = 0;
+	vm->grace   = HESTIA_KILL_GRACE;
+	vm->cputime = 0;
 	return vm;
 }
 
+//with trace each op is an event, label is first one or two string argument
+__private int vm_step(configvm_s* vm){
+	if( !vm->trace ) return vm->current->fn(vm);
+	cbc_s* bc = vm->current;
+	const cop_s* op = config_vm_op(config_vm_opcode(bc->fn));
+	char label[HESTIA_TRACE_LABEL] = "";
+	if( op && op->arg[0] == 's' && op->arg[1] == 's' ) snprintf(label, sizeof label, "%s %s", bc->arg[0].s ? bc->arg[0].s : "", bc->arg[1].s ? bc->arg[1].s : "");
+	else if( op && op->arg[0] == 's' && bc->arg[0].s ) snprintf(label, sizeof label, "%s", bc->arg[0].s);
+	else if( op && op->arg[0] == 'a' && bc->arg[0].as ) snprintf(label, sizeof label, "%s", bc->arg[0].as[0]);
+	int id = trace_begin(vm->trace, op ? op->name : "?", label);
+	int ret = bc->fn(vm);
+	trace_end(vm->trace, id);
+	return ret;
+}
+
+//current is program counter, bytecode can move it forward
 __private int vm_run(configvm_s* vm, cbc_s* stage){
-	ldforeach(stage, it){
-		vm->current = it;
-		if( vm->current->fn(vm) ) return -1;
+	for( vm->current = stage; vm->current; vm->current = vm->current->next == stage ? NULL : vm->current->next ){
+		if( vm_step(vm) ) return -1;
+	}
+	return 0;
+}
+
+//run from begin to end, end is excluded, NULL run until the end of stage
+__private int vm_run_range(configvm_s* vm, cbc_s* begin, cbc_s* end){
+	for( vm->current = begin; vm->current && vm->current != end; vm->current = vm->current->next == vm->stage ? NULL : vm->current->next ){
+		if( vm_step(vm) ) return -1;
 	}
 	return 0;
 }
@@ -182,6 +385,44 @@ int config_vm_run(configvm_s* vm){
 	return vm_run(vm, vm->stage);
 }
 
+//run only mount stage, all bytecode before changeroot
+int config_vm_run_mount(configvm_s* vm){
+	return vm_run_range(vm, vm->stage, vm->root);
+}
+
+//run changeroot, seccomp, privilege drop, chdir and exec
+int config_vm_run_exec(configvm_s* vm){
+	return vm_run_range(vm, vm->root, NULL);
+}
+
+//user of privilege stage, sandbox app run with this id
+int config_vm_privilege(configvm_s* vm, uid_t* uid, gid_t* gid){
+	for( cbc_s* it = vm->stage; it; it = it->next == vm->stage ? NULL : it->next ){
+		if( it->fn != vm_privilege_drop ) continue;
+		*uid = it->arg[0].u;
+		*gid = it->arg[1].u;
+		return 0;
+	}
+	return -1;
+}
+
+void config_vm_exec_argv(configvm_s* vm, char** argv){
+	cbc_s* exec = vm->stage->prev;
+	iassert( exec->fn == vm_exec );
+	exec->arg[0].as = argv;
+}
+
+//create group of sandbox and write all limit, group is released with cgroup_delete(vm->group)
+//only wall timeout not required a group
+int config_vm_run_cgroup(configvm_s* vm, const char* name){
+	int required = 0;
+	ldforeach(vm->cgroup, it){
+		if( it->fn != vm_timeout ) required = 1;
+	}
+	if( required && !(vm->group=cgroup_new(name)) ) return -1;
+	return vm_run(vm, vm->cgroup);
+}
+
 int config_vm_atexit(configvm_s* vm, int ret){
 	return vm_run(vm, ret ? vm->onfail : vm->atexit );
 }
@@ -195,17 +436,35 @@ typedef struct configp{
 	cbc_s*      scriptAtExit;
 	cbc_s*      scriptOnFail;
 	cbc_s*      chdir;
+	cbc_s*      cgroup;
+	sysRule_s*  syscall;
 	unsigned    allowDeny;
+	unsigned    failAction;
 	unsigned    guid;
 	unsigned    ggid;
 	unsigned    uid;
 	unsigned    gid;
 	unsigned    prv;
+	char*       upper;
 	configvm_s* vm;
 	const char* scrArg;
 	option_s*   execArg;
+	cdep_s*     deps;
 }configp_s;
 
+//all file used for build config are dependency of cache
+__private void config_dep(configp_s* conf, const char* path){
+	unsigned i = mem_ipush(&conf->deps);
+	conf->deps[i].path = str_dup(path, 0);
+	config_file_trusted(path, &conf->deps[i].info);
+}
+
+__private char* config_load(configp_s* conf, const char* confname){
+	__free char* path = str_printf("%s/%s", HESTIA_CONFIG_PATH, confname);
+	config_dep(conf, path);
+	return mem_nullterm(load_file(path, 1));
+}
+
 typedef void(*parse_f)(configp_s* conf, unsigned count, char* token[MAX_TOKEN]);
 
 //	cmd arg,arg,arg -> [cmd,arg,arg,arg,...]
@@ -226,6 +485,16 @@ __private unsigned long token_unum(const char* token, int base){
 	return ret;
 }
 
+//tmpfs size, number with optional k m g or % suffix, it is copied as is in mount option
+__private char* token_size(char* token){
+	const char* s = token;
+	while( *s >= '0' && *s <= '9' ) ++s;
+	if( s == token ) die("upper: aspected size, give '%s'", token);
+	if( *s && strchr("kKmMgG%", *s) ) ++s;
+	if( *s ) die("upper: invalid size '%s'", token);
+	return token;
+}
+
 __private unsigned long token_id(const char* token, unsigned id){
 	if( !token  ) return id;
 	if( !*token ) return id;
@@ -256,8 +525,8 @@ __private const char* token_systype(const char* token){
 }
 
 __private unsigned token_mountflags(const char* token){
-	__private char* flagname = "sxdrtp";
-	__private unsigned flagvalue[] = { MS_NOSUID, MS_NOEXEC, MS_NODEV, MS_RDONLY, MS_STRICTATIME, MS_PRIVATE };
+	__private char* flagname = "sxdrtpivm";
+	__private unsigned flagvalue[] = { MS_NOSUID, MS_NOEXEC, MS_NODEV, MS_RDONLY, MS_STRICTATIME, MS_PRIVATE, 0, 0, 0 };
 	if( !token ) return 0;
 	unsigned ret = 0;
 	const char* f;
@@ -268,6 +537,21 @@ __private unsigned token_mountflags(const char* token){
 	return ret;
 }
 
+//i is not a mount flag, option idmap the mount to uid/gid
+__private unsigned token_idmap(const char* token){
+	return token && strchr(token, 'i') ? 1 : 0;
+}
+
+//i v m are not mount flag, are option of overlay
+__private unsigned token_overlay(const char* token){
+	if( !token ) return 0;
+	unsigned ret = 0;
+	if( strchr(token, 'i') ) ret |= OVERLAY_IDMAP;
+	if( strchr(token, 'v') ) ret |= OVERLAY_VOLATILE;
+	if( strchr(token, 'm') ) ret |= OVERLAY_METACOPY;
+	return ret;
+}
+
 __private unsigned sub_rwx(const char* p){
 	unsigned ret = 0;
 	if( *p == 'r' ) ret |= 0x4;
@@ -298,13 +582,10 @@ __private unsigned token_privilege(const char* token, unsigned prv){
 	return prv;
 }
 
-__private char* token_script(const char* token){
+__private char* token_script(configp_s* conf, const char* token){
 	if( !token || !*token ) die("aspected script name");
 	char* path = str_printf("%s/%s", HESTIA_SCRIPT_PATH, token);
-	struct stat info;
-	if( stat(path, &info) ) die("unable to get info on file '%s'::%m", path);
-	if( info.st_uid != 0 || info.st_gid != 0 ) die("config '%s' required root owner for uid and gid", path);
-	if( info.st_mode & S_IWOTH ) die("config '%s' can't share write privilege with others", path);
+	config_dep(conf, path);
 	return path;
 }
 
@@ -312,19 +593,17 @@ __private void build_file(configp_s* conf, const char* lines);
 
 __private void p_use(configp_s* conf, unsigned count, char* token[MAX_TOKEN]){
 	if( count != 2 ) die("use: invalid numbers of args, aspected 2 args give %u", count);
-	__free char* path = str_printf("%s/%s", HESTIA_CONFIG_PATH, token[1]);
-	struct stat info;
-	if( stat(path, &info) ) die("unable to get info on file '%s'::%m", path);
-	if( info.st_uid != 0 || info.st_gid != 0 ) die("config '%s' required root owner for uid and gid", path);
-	if( info.st_mode & S_IWOTH ) die("config '%s' can't share write privilege with others", path);
-	__free char* buf = mem_nullterm(load_file(path, 1));
+	__free char* buf = config_load(conf, token[1]);
 	uid_t    oldu = conf->uid;
 	gid_t    oldg = conf->gid;
 	unsigned oldp = conf->prv;
+	char*    oldt = mem_borrowed(conf->upper);
 	build_file(conf, buf);
 	conf->uid = oldu;
 	conf->gid = oldg;
 	conf->prv = oldp;
+	mem_free(conf->upper);
+	conf->upper = oldt;
 
 }
 
@@ -340,6 +619,16 @@ __private void p_prv(configp_s* conf, __unused unsigned count, char* token[MAX_T
 	conf->prv = token_privilege(token[1], conf->prv);
 }
 
+__private void p_upper(configp_s* conf, unsigned count, char* token[MAX_TOKEN]){
+	token_required(2, count, token);
+	mem_free(conf->upper);
+	conf->upper = NULL;
+	if( !strcmp(token[1], "disk") ) return;
+	if( strcmp(token[1], "tmpfs") ) die("upper: aspected disk or tmpfs, give '%s'", token[1]);
+	token_required(3, count, token);
+	conf->upper = mem_borrowed(token_size(token[2]));
+}
+
 __private void p_mount(configp_s* conf, unsigned count, char* token[MAX_TOKEN]){
 	token_required(3, count, token);
 	if( *token[2] == '.' || *token[2] == '/' || *token[2] == '~' ) die("config invalid destination '%s'", token[2]);
@@ -353,6 +642,7 @@ __private void p_mount(configp_s* conf, unsigned count, char* token[MAX_TOKEN]){
 	bc->arg[5].u = token_privilege(token[5], conf->prv);
 	bc->arg[6].u = token_id(token[6], conf->uid);
 	bc->arg[7].u = token_id(token[7], conf->gid);
+	bc->arg[8].u = 0;
 	ld_before(conf->mountpoint, bc);
 }
 
@@ -369,6 +659,7 @@ __private void p_bind(configp_s* conf, unsigned count, char* token[MAX_TOKEN]){
 	bc->arg[5].u = token_privilege(token[5], conf->prv);
 	bc->arg[6].u = token_id(token[6], conf->uid);
 	bc->arg[7].u = token_id(token[7], conf->gid);
+	bc->arg[8].u = token_idmap(token[3]);
 	ld_before(conf->mountpoint, bc);
 }
 
@@ -399,6 +690,8 @@ __private void p_overlay(configp_s* conf, unsigned count, char* token[MAX_TOKEN]
 	bc->arg[6].u = token_privilege(token[5], conf->prv);
 	bc->arg[7].u = token_id(token[6], conf->uid);
 	bc->arg[8].u = token_id(token[7], conf->gid);
+	bc->arg[9].u  = token_overlay(token[3]);
+	bc->arg[10].s = mem_borrowed(conf->upper);
 	ld_before(conf->mountpoint, bc);
 }
 
@@ -406,7 +699,7 @@ __private void p_script(configp_s* conf, unsigned count, char* token[MAX_TOKEN])
 	token_required(3, count, token);
 	cbc_s* bc = cbc_new();
 	bc->fn = vm_script;
-	__free char* script = token_script(token[2]);
+	__free char* script = token_script(conf, token[2]);
 	bc->arg[0].s = str_printf("%s %s %u %u %s", script, conf->destdir, conf->guid, conf->ggid, conf->scrArg ? conf->scrArg : "");
 	if( !strcmp(token[1], "mount") ){
 		ld_before(conf->mountpoint, bc);
@@ -431,19 +724,78 @@ __private void p_script(configp_s* conf, unsigned count, char* token[MAX_TOKEN])
 __private void p_syscall(configp_s* conf, unsigned count, char* token[MAX_TOKEN]){
 	token_required(2, count, token);
 	unsigned i = 1;
-	if( !conf->vm->filter ){
+	if( !conf->syscall ){
+		char* act = strchr(token[1], '=');
+		if( act ) *act++ = 0;
 		if( !strcmp(token[1], "allow") ) conf->allowDeny = 0;
 		else if( !strcmp(token[1], "deny") ) conf->allowDeny = 1;
 		else die("syscall: required allow/deny before use it");
-		conf->vm->filter = syscall_ctor();
+		long fail = act ? syscall_action(act) : SECCOMP_RET_KILL_PROCESS;
+		if( fail == -1 ) die("syscall: invalid action %s", act);
+		conf->failAction = fail;
+		conf->syscall = MANY(sysRule_s, 32);
 		i = 2;
 	}
+	unsigned const action = conf->allowDeny ? conf->failAction : SECCOMP_RET_ALLOW;
 	for(; i < count; ++i ){
-		if( syscall_add(&conf->vm->filter, token[i], conf->allowDeny) ) die("invalid systemcall %s", token[i]);
+		if( syscall_add(&conf->syscall, token[i], action) ) die("invalid systemcall %s", token[i]);
 		//dbg_info("syscall %c %s", (conf->allowDeny ? '-':'+'), token[i]);
 	}
 }
 
+__private void cgroup_push(configp_s* conf, cbc_s* bc){
+	if( conf->cgroup ) ld_before(conf->cgroup, bc);
+	else conf->cgroup = bc;
+}
+
+__private void p_cgroup(configp_s* conf, unsigned count, char* token[MAX_TOKEN]){
+	__private const char* PROPERTY[] = {
+		"cpu.max",
+		"cpu.weight",
+		"memory.max",
+		"memory.high",
+		"memory.swap.max",
+		"io.max",
+		"io.weight",
+		"pids.max",
+	};
+	token_required(3, count, token);
+	unsigned i = 0;
+	while( i < sizeof_vector(PROPERTY) && strcmp(PROPERTY[i], token[1]) ) ++i;
+	if( i == sizeof_vector(PROPERTY) ) die("cgroup: unknown property %s", token[1]);
+	cbc_s* bc = cbc_new();
+	bc->fn = vm_cgroup;
+	bc->arg[0].s = mem_borrowed(token[1]);
+	//value can have more fields, cpu.max 50000 100000
+	bc->arg[1].s = str_dup(token[2], 0);
+	for( unsigned t = 3; t < count; ++t ){
+		char* v = str_printf("%s %s", bc->arg[1].s, token[t]);
+		mem_free(bc->arg[1].s);
+		bc->arg[1].s = v;
+	}
+	//dbg_info("cgroup %s %s", bc->arg[0].s, bc->arg[1].s);
+	cgroup_push(conf, bc);
+}
+
+__private void p_timeout(configp_s* conf, unsigned count, char* token[MAX_TOKEN]){
+	token_required(2, count, token);
+	cbc_s* bc = cbc_new();
+	bc->fn = vm_timeout;
+	bc->arg[0].u = token_unum(token[1], 10);
+	bc->arg[1].u = count > 2 ? token_unum(token[2], 10) : HESTIA_KILL_GRACE;
+	if( !bc->arg[0].u ) die("timeout: required almost one second");
+	cgroup_push(conf, bc);
+}
+
+__private void p_cputime(configp_s* conf, unsigned count, char* token[MAX_TOKEN]){
+	token_required(2, count, token);
+	cbc_s* bc = cbc_new();
+	bc->fn = vm_cputime;
+	bc->arg[0].u = token_unum(token[1], 10);
+	if( !bc->arg[0].u ) die("cputime: required almost one second");
+	cgroup_push(conf, bc);
+}
+
 __private void p_chdir(configp_s* conf, unsigned count, char* token[MAX_TOKEN]){
 	token_required(2, count, token);
 	if( conf->chdir ) die("chdir: can change only one time chdir");	
@@ -460,6 +812,11 @@ __private void p_snapshot(configp_s* conf, unsigned count, char* token[MAX_TOKEN
 	bc->fn = vm_snapshot;
 	bc->arg[0].s = mem_borrowed(conf->destdir);
 	bc->arg[1].s = mem_borrowed(token[1]);
+	bc->arg[2].u = 0;
+	if( count > 2 ){
+		if( strcmp(token[2], "hash") ) die("snapshot unknown option '%s'", token[2]);
+		bc->arg[2].u = HESTIA_SNAPSHOT_HASH;
+	}
 	//dbg_info("snapshot %s", bc->arg[1].s);
 	ld_before(conf->mountpoint, bc);
 }
@@ -470,6 +827,7 @@ __private void parse_line(configp_s* conf, unsigned count, char* token[MAX_TOKEN
 		"uid",
 		"gid",
 		"prv",
+		"upper",
 		"mount",
 		"bind",
 		"dir",
@@ -478,12 +836,16 @@ __private void parse_line(configp_s* conf, unsigned count, char* token[MAX_TOKEN
 		"syscall",
 		"chdir",
 		"snapshot",
+		"cgroup",
+		"timeout",
+		"cputime",
 	};
 	__private parse_f CMDFN[] = {
 		p_use,
 		p_uid,
 		p_gid,
 		p_prv,
+		p_upper,
 		p_mount,
 		p_bind,
 		p_dir,
@@ -491,7 +853,10 @@ __private void parse_line(configp_s* conf, unsigned count, char* token[MAX_TOKEN
 		p_script,
 		p_syscall,
 		p_chdir,
-		p_snapshot
+		p_snapshot,
+		p_cgroup,
+		p_timeout,
+		p_cputime
 	};
 	
 	for( unsigned i = 0; i < sizeof_vector(CMDNAME); ++i ){
@@ -552,9 +917,62 @@ __private void build_file(configp_s* conf, const char* lines){
 	}
 }
 
+__private int path_nested(const char* a, const char* b){
+	size_t const len = strlen(b);
+	return !strncmp(a, b, len) && (a[len] == '/' || !a[len]);
+}
+
+__private void parallel_batch(cbc_s* first, unsigned count){
+	if( count < 2 ) return;
+	cbc_s* par = cbc_new();
+	par->fn = vm_parallel;
+	par->arg[0].u = count;
+	ld_before(first, par);
+}
+
+//consecutive overlay are grouped in batch, a batch end when a destination is nested in other destination of batch
+__private void build_parallel(configp_s* conf){
+	cbc_s* first = NULL;
+	unsigned count = 0;
+	ldforeach(conf->mountpoint, it){
+		int split = it->fn != vm_overlay;
+		if( !split && first ){
+			cbc_s* chk = first;
+			for( unsigned i = 0; i < count; ++i, chk = chk->next ){
+				if( path_nested(it->arg[1].s, chk->arg[1].s) || path_nested(chk->arg[1].s, it->arg[1].s) ){
+					split = 1;
+					break;
+				}
+			}
+		}
+		if( split ){
+			parallel_batch(first, count);
+			first = NULL;
+			count = 0;
+		}
+		if( it->fn == vm_overlay ){
+			if( !first ) first = it;
+			++count;
+		}
+	}
+	parallel_batch(first, count);
+}
+
+__private char** exec_argv(option_s* execArg){
+	char** argv = MANY(char*, execArg->set+2);
+	unsigned const nex = execArg->set;
+	for( unsigned i = 0; i < nex; ++i ){
+		argv[i] = (char*)execArg->value[i].str;
+	}
+	argv[nex] = NULL;
+	mem_header(argv)->len = nex;
+	return argv;
+}
+
 __private void build_link(configp_s* conf){
 	conf->vm->atexit = conf->scriptAtExit;
 	conf->vm->onfail = conf->scriptOnFail;
+	conf->vm->cgroup = conf->cgroup;
 	
 	cbc_s* changeroot = cbc_new();
 	changeroot->fn = vm_change_root;
@@ -567,20 +985,16 @@ __private void build_link(configp_s* conf){
 
 	cbc_s* exec = cbc_new();
 	exec->fn = vm_exec;
-	exec->arg[0].as = MANY(char*, conf->execArg->set+2);
-	unsigned const nex = conf->execArg->set;
-	for( unsigned i = 0; i < nex; ++i ){
-		exec->arg[0].as[i] = (char*)conf->execArg->value[i].str;
-	}
-	exec->arg[0].as[nex] = NULL;
-	mem_header(exec->arg[0].as)->len = nex;
+	exec->arg[0].as = exec_argv(conf->execArg);
 	
 	conf->vm->stage = conf->mountpoint;
+	conf->vm->root  = changeroot;
 	ld_before(conf->vm->stage, changeroot);
 	if( conf->scriptRoot ) ld_before(conf->vm->stage, conf->scriptRoot);
-	if( conf->vm->filter ){
+	if( conf->syscall ){
+		conf->vm->filter = syscall_compile(conf->syscall, conf->allowDeny ? SECCOMP_RET_ALLOW : conf->failAction);
+		mem_free(conf->syscall);
 		cbc_s* seccomp = cbc_new();
-		seccomp->arg[0].u = conf->allowDeny;
 		seccomp->fn = vm_seccomp;
 		ld_before(conf->vm->stage, seccomp);
 	}
@@ -589,7 +1003,43 @@ __private void build_link(configp_s* conf){
 	ld_before(conf->vm->stage, exec);
 }
 
+__private void deps_cleanup(void* pdeps){
+	cdep_s* deps = pdeps;
+	mforeach(deps, i){
+		mem_free(deps[i].path);
+	}
+}
+
+//all value used for expand path in bytecode
+__private char* cache_key(const char* confname, const char* destdir, uid_t uid, gid_t gid, const char* scriptArg){
+	char cwd[PATH_MAX];
+	const char* home = getenv("HOME");
+	if( !getcwd(cwd, PATH_MAX) ) *cwd = 0;
+	return str_printf("%s\n%s\n%u\n%u\n%s\n%s\n%s", confname, destdir, uid, gid, scriptArg ? scriptArg : "", cwd, home ? home : "");
+}
+
+//NULL if cache is missing or stale, vm can be released with config_cache_free
+configvm_s* config_vm_cached(const char* confname, char* destdir, uid_t uid, gid_t gid, const char* scriptArg, option_s* execArg){
+	__free char* key = cache_key(confname, destdir, uid, gid, scriptArg);
+	configvm_s* cached = config_cache_load(key);
+	if( !cached ) return NULL;
+	//same check of p_overlay, build report the error
+	for( cbc_s* it = cached->stage; it; it = it->next == cached->stage ? NULL : it->next ){
+		if( it->fn == vm_overlay && !dir_exists(it->arg[0].s) ){
+			dbg_info("cache overlay.src %s not exists", it->arg[0].s);
+			config_cache_free(cached);
+			return NULL;
+		}
+	}
+	config_vm_exec_argv(cached, exec_argv(execArg));
+	return cached;
+}
+
 configvm_s* config_vm_build(const char* confname, char* destdir, uid_t uid, gid_t gid, const char* scriptArg, option_s* execArg){
+	configvm_s* cached = config_vm_cached(confname, destdir, uid, gid, scriptArg, execArg);
+	if( cached ) return cached;
+	__free char* key = cache_key(confname, destdir, uid, gid, scriptArg);
+	
 	__free char* homedir =  path_home_from_uid(uid);
 	configp_s conf = {
 		.destdir = destdir,
@@ -602,13 +1052,18 @@ configvm_s* config_vm_build(const char* confname, char* destdir, uid_t uid, gid_
 		.prv     = 0,
 		.scrArg  = scriptArg,
 		.execArg = execArg,
+		.deps    = MANY(cdep_s, 8, deps_cleanup),
 		.vm      = vm_new(),
+		.syscall   = NULL,
 		.allowDeny = 0,
+		.failAction = SECCOMP_RET_KILL_PROCESS,
 		.chdir        = NULL,
+		.cgroup       = NULL,
 		.mountpoint   = NULL,
 		.scriptAtExit = NULL,
 		.scriptOnFail = NULL,
 		.scriptRoot   = NULL,
+		.upper        = NULL,
 	};
 	
 	conf.mountpoint = cbc_new();
@@ -621,10 +1076,17 @@ configvm_s* config_vm_build(const char* confname, char* destdir, uid_t uid, gid_
 	conf.mountpoint->arg[5].u = 0755;
 	conf.mountpoint->arg[6].u = 0;
 	conf.mountpoint->arg[7].u = 0;
+	conf.mountpoint->arg[8].u = 0;
 	
-	__free char* buf = config_load(confname);
+	//homedir is resolved from passwd
+	config_dep(&conf, "/etc/passwd");
+	__free char* buf = config_load(&conf, confname);
 	build_file(&conf, buf);
+	build_parallel(&conf);
 	build_link(&conf);
+	config_cache_save(conf.vm, key, conf.deps);
+	mem_free(conf.deps);
+	mem_free(conf.upper);
 	mem_free(conf.rootdir);
 	return conf.vm;
 }
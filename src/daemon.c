@@ -0,0 +1,379 @@
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <ctype.h>
+
+#include <notstd/core.h>
+#include <notstd/str.h>
+
+#include <hestia/config.h>
+#include <hestia/launcher.h>
+#include <hestia/mount.h>
+#include <hestia/daemon.h>
+#include <hestia/cache.h>
+#include <hestia/inutility.h>
+
+/*
+ * daemon keep compiled configvm_s in memory, client send request and stdin/stdout/stderr
+ * request: [u32 uid][u32 gid][u32 flags][u32 count] count * string nullterm
+ *          string[0] config, [1] destdir, [2] script arg, [3...] argv
+ * reply  : [int status]
+ * root peer can use any destdir, other peer only HESTIA_DAEMON_DESTDIR/uid/name, uid dir is owned by root
+ * and only daemon create inside it, client can't redirect mount or rm of daemon with a symlink.
+ * destdir name and script arg end in the shell command of script, name is only [A-Za-z0-9._-] and
+ * only root peer can pass a script arg, config name can't have / or start with . for any peer.
+ * daemon keep only vm loaded from cache, cache is written by the child that validate config,
+ * if cache can't be used each request compile config in its own child.
+ * SIGHUP flush all compiled config, SIGCHLD reap request child, both read from signalfd
+*/
+
+#define REQ_STR_CONF    0
+#define REQ_STR_DESTDIR 1
+#define REQ_STR_SCRARG  2
+#define REQ_STR_ARGV    3
+
+typedef struct hreq{
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t flags;
+	uint32_t count;
+}hreq_s;
+
+typedef struct dvm{
+	char*       conf;
+	char*       destdir;
+	char*       scrArg;
+	uid_t       uid;
+	gid_t       gid;
+	configvm_s* vm;
+}dvm_s;
+
+__private int msg_send(int fd, void* data, size_t size, int* fds, unsigned nfds){
+	struct iovec iov = { .iov_base = data, .iov_len = size };
+	char ctrl[CMSG_SPACE(sizeof(int) * 3)];
+	struct msghdr msg = {
+		.msg_iov     = &iov,
+		.msg_iovlen  = 1,
+		.msg_control = nfds ? ctrl : NULL,
+		.msg_controllen = nfds ? CMSG_SPACE(sizeof(int) * nfds) : 0
+	};
+	if( nfds ){
+		struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type  = SCM_RIGHTS;
+		cm->cmsg_len   = CMSG_LEN(sizeof(int) * nfds);
+		memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfds);
+	}
+	if( sendmsg(fd, &msg, MSG_NOSIGNAL) != (ssize_t)size ){
+		dbg_error("sendmsg: %m");
+		return -1;
+	}
+	return 0;
+}
+
+__private ssize_t msg_recv(int fd, void* data, size_t size, int* fds, unsigned nfds){
+	struct iovec iov = { .iov_base = data, .iov_len = size };
+	char ctrl[CMSG_SPACE(sizeof(int) * 3)];
+	struct msghdr msg = {
+		.msg_iov     = &iov,
+		.msg_iovlen  = 1,
+		.msg_control = ctrl,
+		.msg_controllen = sizeof ctrl
+	};
+	for( unsigned i = 0; i < nfds; ++i ) fds[i] = -1;
+	ssize_t nr = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	if( nr <= 0 ) return -1;
+	for( struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm) ){
+		if( cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS ) continue;
+		unsigned n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		int* cfd = (int*)CMSG_DATA(cm);
+		for( unsigned i = 0; i < n; ++i ){
+			if( i < nfds ) fds[i] = cfd[i];
+			else close(cfd[i]);
+		}
+	}
+	if( msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC) ){
+		dbg_error("message truncated");
+		for( unsigned i = 0; i < nfds; ++i ) if( fds[i] != -1 ) close(fds[i]);
+		return -1;
+	}
+	return nr;
+}
+
+__private int sock_addr(struct sockaddr_un* addr, const char* sockpath){
+	memset(addr, 0, sizeof *addr);
+	addr->sun_family = AF_UNIX;
+	if( strlen(sockpath) >= sizeof addr->sun_path ){
+		dbg_error("socket path too long: %s", sockpath);
+		return -1;
+	}
+	strcpy(addr->sun_path, sockpath);
+	return 0;
+}
+
+int hestia_remote(const char* sockpath, const char* confname, const char* destdir, uid_t uid, gid_t gid, const char* scriptArg, unsigned flags, char** argv, unsigned argc){
+	struct sockaddr_un addr;
+	if( sock_addr(&addr, sockpath) ) return -1;
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if( fd == -1 ) die("socket: %m");
+	if( connect(fd, (struct sockaddr*)&addr, sizeof addr) ) die("unable to connect to daemon %s: %m", sockpath);
+	
+	__free char* msg = MANY(char, HESTIA_DAEMON_MSG_MAX);
+	hreq_s* req = (hreq_s*)msg;
+	req->uid   = uid;
+	req->gid   = gid;
+	req->flags = flags;
+	req->count = REQ_STR_ARGV + argc;
+	size_t len = sizeof(hreq_s);
+	const char* str[REQ_STR_ARGV] = { confname, destdir, scriptArg ? scriptArg : "" };
+	for( unsigned i = 0; i < req->count; ++i ){
+		const char* s = i < REQ_STR_ARGV ? str[i] : argv[i-REQ_STR_ARGV];
+		size_t const sl = strlen(s) + 1;
+		if( len + sl > HESTIA_DAEMON_MSG_MAX ) die("request too long");
+		memcpy(&msg[len], s, sl);
+		len += sl;
+	}
+	
+	int stdfd[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	if( msg_send(fd, msg, len, stdfd, 3) ) die("unable to send request");
+	int status = -1;
+	if( recv(fd, &status, sizeof status, 0) != sizeof status ){
+		dbg_error("daemon not reply");
+	}
+	close(fd);
+	return status;
+}
+
+__private void dvm_flush(dvm_s* d){
+	mforeach(d, i){
+		mem_free(d[i].conf);
+		mem_free(d[i].destdir);
+		mem_free(d[i].scrArg);
+		config_cache_free(d[i].vm);
+	}
+	mem_header(d)->len = 0;
+}
+
+__private void dvm_cleanup(void* pd){
+	dvm_flush(pd);
+}
+
+//return -1 on invalid config, *vm is NULL if config is valid but not cached
+__private int dvm_get(dvm_s** cache, configvm_s** vm, const char* conf, const char* destdir, const char* scrArg, uid_t uid, gid_t gid){
+	mforeach(*cache, i){
+		dvm_s* d = &(*cache)[i];
+		if( d->uid == uid && d->gid == gid && !strcmp(d->conf, conf) && !strcmp(d->destdir, destdir) && !strcmp(d->scrArg, scrArg) ){
+			*vm = d->vm;
+			return 0;
+		}
+	}
+	
+	//config_vm_build die on invalid config, child compile and save cache, daemon load only the cache
+	pid_t pid = fork();
+	if( pid == -1 ) return -1;
+	option_s noexec = { .set = 0 };
+	if( !pid ){
+		config_vm_build(conf, (char*)destdir, uid, gid, *scrArg ? scrArg : NULL, &noexec);
+		_exit(0);
+	}
+	int status;
+	while( waitpid(pid, &status, 0) == -1 ){
+		if( errno != EINTR ) return -1;
+	}
+	if( !WIFEXITED(status) || WEXITSTATUS(status) ){
+		dbg_error("invalid config %s", conf);
+		return -1;
+	}
+	
+	*vm = config_vm_cached(conf, (char*)destdir, uid, gid, *scrArg ? scrArg : NULL, &noexec);
+	if( !*vm ){
+		dbg_warning("config %s is not cached, compiled for each request", conf);
+		return 0;
+	}
+	unsigned i = mem_ipush(cache);
+	dvm_s* d = &(*cache)[i];
+	d->conf    = str_dup(conf, 0);
+	d->destdir = str_dup(destdir, 0);
+	d->scrArg  = str_dup(scrArg, 0);
+	d->uid     = uid;
+	d->gid     = gid;
+	d->vm      = *vm;
+	dbg_info("compiled %s@%s (%u:%u)", conf, destdir, uid, gid);
+	return 0;
+}
+
+//only [A-Za-z0-9._-], name is copied in shell command of script
+__private int name_allow(const char* name){
+	if( !*name || !strcmp(name, ".") || !strcmp(name, "..") ) return 0;
+	for( ; *name; ++name ){
+		if( !isalnum((unsigned char)*name) && !strchr("._-", *name) ) return 0;
+	}
+	return 1;
+}
+
+//destdir of user is a direct child of its uid dir, no symlink or dot can escape it
+__private int destdir_allow(uid_t uid, const char* destdir){
+	__free char* base = str_printf("%s/%u", HESTIA_DAEMON_DESTDIR, uid);
+	size_t const len = strlen(base);
+	if( strncmp(destdir, base, len) || destdir[len] != '/' ) return 0;
+	if( !name_allow(&destdir[len+1]) ) return 0;
+	mk_dir(base, 0755);
+	struct stat st;
+	if( lstat(base, &st) || !S_ISDIR(st.st_mode) || st.st_uid != 0 || (st.st_mode & (S_IWGRP | S_IWOTH)) ){
+		dbg_error("%s is not owned by daemon", base);
+		return 0;
+	}
+	return 1;
+}
+
+//config is a name inside HESTIA_CONFIG_PATH
+__private int confname_allow(const char* conf){
+	return *conf && *conf != '.' && !strchr(conf, '/');
+}
+
+//root can ask all, user can ask only for itself in its destdir and without script arg
+__private int peer_allow(int fd, hreq_s* req, char** str){
+	if( !confname_allow(str[REQ_STR_CONF]) ) return 0;
+	struct ucred cred;
+	socklen_t len = sizeof cred;
+	if( getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) ) return 0;
+	if( cred.uid == 0 ) return 1;
+	if( cred.uid != req->uid || cred.gid != req->gid ) return 0;
+	if( *str[REQ_STR_SCRARG] ) return 0;
+	return destdir_allow(cred.uid, str[REQ_STR_DESTDIR]);
+}
+
+__private void request_exec(int fd, int srv, int sfd, configvm_s* vm, hreq_s* req, char** str, int* stdfd){
+	pid_t pid = fork();
+	if( pid ) return;
+	close(srv);
+	close(sfd);
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+	for( unsigned i = 0; i < 3; ++i ){
+		if( stdfd[i] == -1 ) continue;
+		dup2(stdfd[i], i);
+		close(stdfd[i]);
+	}
+	const char*    destdir = str[REQ_STR_DESTDIR];
+	unsigned const flags   = req->flags;
+	char**         argv    = &str[REQ_STR_ARGV];
+	if( !vm ){
+		option_s noexec = { .set = 0 };
+		vm = config_vm_build(str[REQ_STR_CONF], (char*)destdir, req->uid, req->gid, *str[REQ_STR_SCRARG] ? str[REQ_STR_SCRARG] : NULL, &noexec);
+	}
+	config_vm_exec_argv(vm, argv);
+	int ret = hestia_launch(destdir, vm, NULL);
+	if( !ret && !(flags & HESTIA_DAEMON_PRESERVE) ) hestia_umount(destdir);
+	send(fd, &ret, sizeof ret, MSG_NOSIGNAL);
+	_exit(0);
+}
+
+__private void request(int fd, int srv, int sfd, dvm_s** cache, char* msg){
+	int stdfd[3];
+	int ret = -1;
+	char* str[HESTIA_DAEMON_ARG_MAX];
+	ssize_t nr = msg_recv(fd, msg, HESTIA_DAEMON_MSG_MAX - 1, stdfd, 3);
+	if( nr < (ssize_t)sizeof(hreq_s) ) goto ONERR;
+	msg[nr] = 0;
+	hreq_s* req = (hreq_s*)msg;
+	if( req->count <= REQ_STR_ARGV ){
+		dbg_error("request without argv");
+		goto ONERR;
+	}
+	if( req->count >= sizeof_vector(str) ){
+		dbg_error("malformed request");
+		goto ONERR;
+	}
+	
+	char* s = &msg[sizeof(hreq_s)];
+	char* end = &msg[nr];
+	for( unsigned i = 0; i < req->count; ++i ){
+		if( s >= end ){
+			dbg_error("malformed request");
+			goto ONERR;
+		}
+		str[i] = s;
+		s += strlen(s) + 1;
+	}
+	str[req->count] = NULL;
+	if( !peer_allow(fd, req, str) ){
+		dbg_error("peer not allowed to request uid %u in %s with config %s", req->uid, str[REQ_STR_DESTDIR], str[REQ_STR_CONF]);
+		goto ONERR;
+	}
+	
+	configvm_s* vm;
+	if( dvm_get(cache, &vm, str[REQ_STR_CONF], str[REQ_STR_DESTDIR], str[REQ_STR_SCRARG], req->uid, req->gid) ) goto ONERR;
+	request_exec(fd, srv, sfd, vm, req, str, stdfd);
+	for( unsigned i = 0; i < 3; ++i ) if( stdfd[i] != -1 ) close(stdfd[i]);
+	return;
+ONERR:
+	for( unsigned i = 0; i < 3; ++i ) if( stdfd[i] != -1 ) close(stdfd[i]);
+	send(fd, &ret, sizeof ret, MSG_NOSIGNAL);
+}
+
+int hestia_daemon(const char* sockpath){
+	struct sockaddr_un addr;
+	if( sock_addr(&addr, sockpath) ) return -1;
+	int srv = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if( srv == -1 ) die("socket: %m");
+	unlink(sockpath);
+	if( bind(srv, (struct sockaddr*)&addr, sizeof addr) ) die("bind %s: %m", sockpath);
+	chmod(sockpath, 0660);
+	if( listen(srv, 64) ) die("listen: %m");
+	
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	int sfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+	if( sfd == -1 ) die("signalfd: %m");
+	
+	__free dvm_s* cache = MANY(dvm_s, 4, dvm_cleanup);
+	__free char* msg = MANY(char, HESTIA_DAEMON_MSG_MAX);
+	struct pollfd pfd[2] = {
+		{ .fd = srv, .events = POLLIN },
+		{ .fd = sfd, .events = POLLIN }
+	};
+	while( 1 ){
+		if( poll(pfd, 2, -1) == -1 ){
+			if( errno == EINTR ) continue;
+			dbg_error("poll: %m");
+			break;
+		}
+		if( pfd[1].revents ){
+			struct signalfd_siginfo si;
+			while( read(sfd, &si, sizeof si) == sizeof si ){
+				if( si.ssi_signo != SIGHUP ) continue;
+				dbg_info("flush compiled config");
+				dvm_flush(cache);
+			}
+			//request child reply directly to client, only need to reap
+			while( waitpid(-1, NULL, WNOHANG) > 0 );
+		}
+		if( !pfd[0].revents ) continue;
+		int fd = accept4(srv, NULL, NULL, SOCK_CLOEXEC);
+		if( fd == -1 ){
+			if( errno == EINTR || errno == EAGAIN ) continue;
+			dbg_error("accept: %m");
+			break;
+		}
+		struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+		request(fd, srv, sfd, &cache, msg);
+		close(fd);
+	}
+	close(sfd);
+	close(srv);
+	unlink(sockpath);
+	return -1;
+}
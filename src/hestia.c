@@ -8,6 +8,12 @@
 #include <hestia/launcher.h>
 #include <hestia/config.h>
 #include <hestia/analyzer.h>
+#include <hestia/pool.h>
+#include <hestia/daemon.h>
+#include <hestia/state.h>
+#include <hestia/snapshot.h>
+#include <hestia/system.h>
+#include <hestia/trace.h>
 
 /*
  *	sandbox need to exists outside sandbox itself
@@ -19,7 +25,7 @@
  *		 MOUNT   ✓
  *		 PID     ✓
  *		 TIME    wip
- *		 USER    need more documentation
+ *		 USER    ✓ rootless
  *		 UTS     need more documentation
  *
  *
@@ -35,18 +41,71 @@ option_s OPT[] = {
 	{'a', "--analyzer"    , "show important change"   , OPT_NOARG, 0, 0},
 	{'A', "--script-arg"  , "set script arguments"    , OPT_STR, 0, 0},
 	{'e', "--execute"     , "execute"                 , OPT_SLURP | OPT_STR, 0, 0},
+	{'p', "--pool"        , "warm sandbox, exec stdin", OPT_NUM, 0, 0},
+	{'D', "--daemon"      , "run daemon on socket"    , OPT_NOARG, 0, 0},
+	{'r', "--remote"      , "execute with daemon"     , OPT_NOARG, 0, 0},
+	{'s', "--socket"      , "daemon socket path"      , OPT_STR, 0, 0},
+	{'S', "--save"        , "save uppers as state"    , OPT_STR, 0, 0},
+	{'L', "--load"        , "start from saved state"  , OPT_STR, 0, 0},
+	{'x', "--diff"        , "compare two snapshot"    , OPT_STR | OPT_ARRAY, 0, 0},
+	{'k', "--snapshot"    , "hashed snapshot at end"  , OPT_STR, 0, 0},
+	{'X', "--export"      , "snapshot as text"        , OPT_STR, 0, 0},
+	{'q', "--query"       , "snapshot entry of path"  , OPT_STR | OPT_ARRAY, 0, 0},
+	{'t', "--seccomp-test", "action of [arch/]syscall", OPT_STR | OPT_ARRAY, 0, 0},
+	{'T', "--trace"       , "json timing of launch"   , OPT_STR, 0, 0},
+	{'R', "--rootless"    , "run in user namespace"   , OPT_NOARG, 0, 0},
 	{'h', "--help"        , "display this"            , OPT_END | OPT_NOARG, 0, 0}
 };
 
 void test(uid_t );
 
+__private void trace_report(trace_s* trace, const char* path){
+	if( !trace ) return;
+	FILE* f = strcmp(path, "-") ? fopen(path, "w") : stdout;
+	if( !f || trace_json(trace, f) ){
+		dbg_error("unable to write trace %s", path);
+	}
+	if( f && f != stdout ) fclose(f);
+	trace_free(trace);
+}
+
 int main(int argc, char** argv){
 	notstd_begin();
 	
 	__argv option_s* opt = argv_parse(OPT, argc, argv);
-	argv_default_num(opt, O_u, 1000);
-	argv_default_num(opt, O_g, 1000);
+	//rootless can map only caller, default sandbox user is caller itself
+	argv_default_num(opt, O_u, opt[O_R].set ? getuid() : 1000);
+	argv_default_num(opt, O_g, opt[O_R].set ? getgid() : 1000);
+	argv_default_str(opt, O_s, HESTIA_DAEMON_SOCKET);
 	if( opt[O_h].set ) argv_usage(opt, argv[0]);
+	
+	if( opt[O_D].set ) return hestia_daemon(opt[O_s].value->str) ? 1 : 0;
+
+	if( opt[O_x].set ){
+		if( opt[O_x].set != 2 ) die("diff required two snapshot");
+		__free char* dd = opt[O_d].set ? path_explode(opt[O_d].value->str) : NULL;
+		__free char* a  = snapshot_file(dd, opt[O_x].value[0].str);
+		__free char* b  = snapshot_file(dd, opt[O_x].value[1].str);
+		int ret = snapshot_diff(a, b, stdout);
+		if( ret < 0 ) die("unable to diff %s %s", a, b);
+		return ret ? 1 : 0;
+	}
+
+	if( opt[O_X].set ){
+		__free char* dd = opt[O_d].set ? path_explode(opt[O_d].value->str) : NULL;
+		__free char* f  = snapshot_file(dd, opt[O_X].value->str);
+		if( snapshot_export(f, stdout) ) die("unable to export %s", f);
+		return 0;
+	}
+
+	if( opt[O_q].set ){
+		if( opt[O_q].set != 2 ) die("query required snapshot and path");
+		__free char* dd = opt[O_d].set ? path_explode(opt[O_d].value->str) : NULL;
+		__free char* f  = snapshot_file(dd, opt[O_q].value[0].str);
+		int ret = snapshot_query(f, opt[O_q].value[1].str, stdout);
+		if( ret < 0 ) die("unable to query %s", f);
+		return ret ? 0 : 1;
+	}
 
 	if( !opt[O_d].set ) die("required destdir");
 	__free char* destdir   = path_explode(opt[O_d].value->str);
@@ -57,13 +116,50 @@ int main(int argc, char** argv){
 	}
 
 	if( !opt[O_c].set ) die("required config name");
-	configvm_s* cvm = config_vm_build("os", destdir, opt[O_u].value->ui, opt[O_g].value->ui, opt[O_A].value->str, &opt[O_e]);
 	
-	if( opt[O_e].set && hestia_launch(destdir, cvm)) return 1;
+	if( opt[O_r].set ){
+		if( !opt[O_e].set ) die("remote required execute");
+		if( opt[O_R].set ) die("remote can't be rootless");
+		__free const char** exargv = MANY(const char*, opt[O_e].set);
+		for( unsigned i = 0; i < opt[O_e].set; ++i ) exargv[i] = opt[O_e].value[i].str;
+		unsigned flags = opt[O_P].set ? HESTIA_DAEMON_PRESERVE : 0;
+		return hestia_remote(opt[O_s].value->str, opt[O_c].value->str, destdir, opt[O_u].value->ui, opt[O_g].value->ui, opt[O_A].value->str, flags, (char**)exargv, opt[O_e].set) ? 1 : 0;
+	}
+	
+	trace_s* trace = opt[O_T].set ? trace_new() : NULL;
+	int tid = trace_begin(trace, "config", opt[O_c].value->str);
+	configvm_s* cvm = config_vm_build(opt[O_c].value->str, destdir, opt[O_u].value->ui, opt[O_g].value->ui, opt[O_A].value->str, &opt[O_e]);
+	trace_end(trace, tid);
+	cvm->trace = trace;
+	if( opt[O_R].set ) cvm->flags |= HESTIA_VM_USERNS;
+
+	if( opt[O_t].set ){
+		if( !cvm->filter ) die("config %s not use syscall", opt[O_c].value->str);
+		for( unsigned i = 0; i < opt[O_t].set; ++i ){
+			if( syscall_test(cvm->filter, opt[O_t].value[i].str, stdout) ) die("invalid syscall %s", opt[O_t].value[i].str);
+		}
+		return 0;
+	}
+	
+	if( opt[O_R].set && opt[O_p].set ) die("pool can't be rootless");
+	if( opt[O_p].set && (cvm->cgroup || cvm->timeout || cvm->cputime) ) die("pool can't apply cgroup, timeout or cputime of config %s", opt[O_c].value->str);
+	if( opt[O_p].set ) return hestia_pool(destdir, cvm, opt[O_p].value->ui) ? 1 : 0;
+	
+	if( opt[O_e].set && hestia_launch(destdir, cvm, opt[O_L].set ? opt[O_L].value->str : NULL) ){
+		trace_report(trace, opt[O_T].value->str);
+		return 1;
+	}
+	if( opt[O_S].set && state_save(destdir, opt[O_S].value->str) ) die("unable to save state %s", opt[O_S].value->str);
+	if( opt[O_k].set && snapshot_write(destdir, opt[O_k].value->str, HESTIA_SNAPSHOT_HASH) ) die("unable to write snapshot %s", opt[O_k].value->str);
 	
 	if( opt[O_a].set ) hestia_analyze_root(destdir);
 	
-	if( !opt[O_P].set ) hestia_umount(destdir);
+	if( !opt[O_P].set ){
+		tid = trace_begin(trace, "teardown", destdir);
+		hestia_umount(destdir);
+		trace_end(trace, tid);
+	}
+	trace_report(trace, opt[O_T].value->str);
 	return 0;
 }
 
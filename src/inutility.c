@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <notstd/core.h>
 #include <notstd/str.h>
 
@@ -10,6 +11,9 @@
 #include <sys/stat.h>
 #include <readline/readline.h>
 
+#include <hestia/inutility.h>
+#include <hestia/teardown.h>
+
 char** split_h(const char* str){
 	char** ret = MANY(char*, 8);
 	const char* next = str;
@@ -138,50 +142,50 @@ char* path_explode(const char* path){
 }
 
 int dir_exists(const char* path){
-	DIR* d = opendir(path);
-	if( !d ) return 0;
-	closedir(d);
-	return 1;
+	struct stat st;
+	return !stat(path, &st) && S_ISDIR(st.st_mode);
 }
 
-void mk_dir(const char* path, unsigned privilege){
+//create all missing component relative to dirfd, each step is resolved from previous fd and not from a path
+//existing component follow symlink, a component created here is opened with O_NOFOLLOW and a link swapped in between mkdirat and openat can't redirect the walk
+__private int mk_dir_walk(const char* path, unsigned privilege){
+	int fd = open(*path == '/' ? "/" : ".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if( fd == -1 ) return -1;
 	unsigned len = 0;
 	unsigned next = 0;
 	const char* d;
-	__free char* mkpath = MANY(char, strlen(path) + 2);
-	unsigned l = 0;
-	mkpath[0] = 0;
-
+	char name[NAME_MAX+1];
 	while( *(d=str_tok(path, "/", 0, &len, &next)) ){
-		memcpy(&mkpath[l], d, len);
-		l += len;
-		mkpath[l++] = '/';
-		mkpath[l] = 0;
-		if( !dir_exists(mkpath) ){
-			if( mkdir(mkpath, privilege) ){
-				dbg_error("fail mkdir: %s", mkpath);
-			}
+		if( !len ) continue;
+		if( len > NAME_MAX ){
+			errno = ENAMETOOLONG;
+			break;
 		}
+		memcpy(name, d, len);
+		name[len] = 0;
+		int const created = !mkdirat(fd, name, privilege);
+		if( !created && errno != EEXIST ) break;
+		int sub = openat(fd, name, O_PATH | O_DIRECTORY | O_CLOEXEC | (created ? O_NOFOLLOW : 0));
+		close(fd);
+		if( (fd=sub) == -1 ) return -1;
 	}
+	int err = *d ? -1 : 0;
+	close(fd);
+	return err;
 }
 
-void rm(const char* path){
-	DIR* d = opendir(path);
-	if( !d ) return;
-	
-	struct dirent* ent;
-	while( (ent=readdir(d)) ){
-		if( !strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..") ) continue;
-		char* fpath = str_printf("%s/%s", path, ent->d_name);
-		if( ent->d_type == DT_DIR ){
-			rm(fpath);
-		}
-		else{
-			unlink(fpath);
-		}
-		mem_free(fpath);
+void mk_dir(const char* path, unsigned privilege){
+	if( !mkdir(path, privilege) || errno == EEXIST ) return;
+	if( errno != ENOENT || mk_dir_walk(path, privilege) ){
+		dbg_error("fail mkdir: %s", path);
 	}
-	closedir(d);
+}
+
+void rm(const char* path){
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if( fd == -1 ) return;
+	rm_at(fd);
+	close(fd);
 	rmdir(path);
 }
 
@@ -4,10 +4,16 @@
 #include <sys/wait.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/pidfd.h>
 #include <unistd.h>
-#include <sched.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <pwd.h>
 #include <grp.h>
+#include <pthread.h>
 
 #include <notstd/core.h>
 #include <notstd/str.h>
@@ -19,48 +25,420 @@
 #include <hestia/inutility.h>
 #include <hestia/mount.h>
 #include <hestia/system.h>
+#include <hestia/state.h>
+#include <hestia/trace.h>
+
+/*
+ * launcher
+ *	sandbox is a clone3 fork with pidfd, placed in its cgroup at creation
+ *	parent wait in epoll on pidfd and signalfd, every source of event is a tag in epoll data
+ *	signal are blocked before clone, child restore the mask, nothing arrived in between is lost
+ *	kernel without pidfd wait on SIGCHLD from signalfd and signal with kill
+ *	signal received by parent are forwarded to sandbox, second time sandbox is killed
+ *	init of pid namespace ignore signal without handler, only SIGKILL is sure
+ *
+ *	timeout is a timerfd on monotonic clock, cputime is checked every LAUNCH_CPUTIME_CHECK ms on cgroup cpu.stat
+ *	on limit all process of cgroup receive SIGTERM, same timerfd is rearmed with grace, on expire pid namespace is killed
+ *
+ *	rootless sandbox is also in new user namespace, caller is mapped as user of privilege stage
+ *	child wait on a pipe until parent write the map, only mapped id can own file inside sandbox
+*/
+
+#define LAUNCH_CPUTIME_CHECK 100
+
+typedef enum { LEV_PID, LEV_SIGNAL, LEV_TIMEOUT, LEV_CPUTIME } launchEvent_e;
+
+typedef struct launchWait{
+	configvm_s* vm;
+	pid_t       pid;
+	int         pidfd;
+	int         sfd;
+	int         tfd;
+	int         cfd;
+	unsigned    forwarded;
+	unsigned    stop;
+}launchWait_s;
 
 typedef struct overwriteArgs{
 	configvm_s*  vm;
 	const char*  destdir;
+	const char*  cgroup;
+	sigset_t*    sigmask;
+	int          sync;
 }overwriteArgs_s;
 
-__private int overwrite(void* parg){
-	overwriteArgs_s* arg = parg;
-	__free char* mountpointRoot = str_printf("%s/" HESTIA_ROOT, arg->destdir);
-	if( dir_exists(mountpointRoot) ) hestia_umount(arg->destdir);
+__private void overwrite(overwriteArgs_s* arg){
+	//launcher block signal before clone, sandbox start with mask of caller
+	if( arg->sigmask ) sigprocmask(SIG_SETMASK, arg->sigmask, NULL);
+	//in user namespace nothing can be done before parent write id map
+	if( arg->sync != -1 ){
+		char ok;
+		if( read(arg->sync, &ok, 1) != 1 ) _exit(1);
+		close(arg->sync);
+	}
+	//without CLONE_INTO_CGROUP child join cgroup before run anything of config
+	if( arg->cgroup && cgroup_apply(arg->cgroup, 0) ) _exit(1);
+	//sandbox mount never propagate to host, they are released with namespace
+	if( mount(NULL, "/", NULL, MS_REC | MS_SLAVE, NULL) ){
+		dbg_error("remount / slave: %m");
+		_exit(1);
+	}
 	config_vm_run(arg->vm);
 	dbg_error("exec fail: %m");
-	return 1;
+	//_exit terminate also worker of parallel overlay
+	_exit(1);
+}
+
+typedef struct supervisor{
+	seccompListener_s*  listener;
+	struct sock_filter* filter;
+	int                 pidfd;
+	pthread_t           thr;
+}supervisor_s;
+
+__private void* supervisor_thread(void* parg){
+	supervisor_s* sv = parg;
+	int fd = syscall_listener_take(sv->listener, sv->pidfd);
+	if( fd >= 0 ){
+		syscall_supervisor(fd, sv->filter);
+		close(fd);
+	}
+	return NULL;
+}
+
+//listener page is shared with sandbox, seccomp stage publish there the notify fd
+__private int supervisor_begin(supervisor_s* sv, configvm_s* vm){
+	sv->listener = NULL;
+	sv->pidfd    = -1;
+	if( !vm->filter || !syscall_notify(vm->filter) ) return 0;
+	sv->listener = mmap(NULL, sizeof(seccompListener_s), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if( sv->listener == MAP_FAILED ){
+		dbg_error("mmap listener: %m");
+		sv->listener = NULL;
+		return -1;
+	}
+	sv->listener->fd    = -1;
+	sv->listener->taken = 0;
+	sv->filter   = vm->filter;
+	vm->listener = sv->listener;
+	return 0;
+}
+
+//pidfd is owned by launcher
+__private void supervisor_start(supervisor_s* sv, int pidfd){
+	if( !sv->listener || pidfd == -1 ) return;
+	sv->pidfd = pidfd;
+	if( pthread_create(&sv->thr, NULL, supervisor_thread, sv) ){
+		dbg_error("supervisor thread fail");
+		sv->pidfd = -1;
+	}
+}
+
+__private void supervisor_end(supervisor_s* sv, configvm_s* vm){
+	if( !sv->listener ) return;
+	if( sv->pidfd != -1 ) pthread_join(sv->thr, NULL);
+	munmap(sv->listener, sizeof(seccompListener_s));
+	vm->listener = NULL;
+}
+
+//return pid in parent, child never return
+//child wait on sync until parent map caller as user of sandbox, on error sync is closed and child exit
+__private void sandbox_userns(configvm_s* vm, pid_t pid, int sync){
+	uid_t uid;
+	gid_t gid;
+	if( config_vm_privilege(vm, &uid, &gid) ){
+		dbg_error("rootless sandbox require privilege stage");
+	}
+	else if( userns_map(pid, uid, gid) ){
+		dbg_error("user namespace map fail");
+	}
+	else if( write(sync, "", 1) != 1 ){
+		dbg_error("sync sandbox: %m");
+	}
+	close(sync);
+}
+
+__private pid_t sandbox_clone(overwriteArgs_s* arg, int* pidfd){
+	int const userns = arg->vm->flags & HESTIA_VM_USERNS;
+	int cfd = -1;
+	int sync[2] = { -1, -1 };
+	if( userns && pipe2(sync, O_CLOEXEC) ) return -1;
+	if( arg->vm->group && (cfd=cgroup_open(arg->vm->group)) == -1 ) goto ONERR;
+	arg->sync = sync[0];
+	pid_t pid = sandbox_fork(pidfd, cfd, userns);
+	//kernel before 5.7 not support CLONE_INTO_CGROUP
+	if( pid == -1 && cfd != -1 && (errno == EINVAL || errno == E2BIG) ){
+		dbg_warning("clone into cgroup not available, child join cgroup itself");
+		arg->cgroup = arg->vm->group;
+		pid = sandbox_fork(pidfd, -1, userns);
+	}
+	if( !pid ){
+		if( sync[1] != -1 ) close(sync[1]);
+		overwrite(arg);
+	}
+	if( cfd != -1 ) close(cfd);
+	if( sync[0] != -1 ) close(sync[0]);
+	//failed map is reaped as a failed sandbox
+	if( pid != -1 && userns ) sandbox_userns(arg->vm, pid, sync[1]);
+	else if( sync[1] != -1 ) close(sync[1]);
+	return pid;
+ONERR:
+	if( sync[0] != -1 ) close(sync[0]);
+	if( sync[1] != -1 ) close(sync[1]);
+	return -1;
+}
+
+__private void sandbox_cgroup_end(configvm_s* vm){
+	if( vm->group && cgroup_delete(vm->group) ) mem_free(vm->group);
+	vm->group = NULL;
+}
+
+__private int epoll_watch(int efd, int fd, launchEvent_e tag){
+	struct epoll_event ev = { .events = EPOLLIN, .data.u32 = tag };
+	if( epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev) ){
+		dbg_error("epoll add: %m");
+		return -1;
+	}
+	return 0;
+}
+
+//exit code of sandbox, 128+signal if killed, -1 on error, -2 if nohang and sandbox is alive
+__private int sandbox_reap(int pidfd, pid_t pid, int nohang){
+	siginfo_t info = {0};
+	int const err = pidfd != -1 ? waitid(P_PIDFD, pidfd, &info, WEXITED | nohang) : waitid(P_PID, pid, &info, WEXITED | nohang);
+	if( err ){
+		dbg_error("waitid fail: %m");
+		return -1;
+	}
+	if( !info.si_pid ) return -2;
+	return info.si_code == CLD_EXITED ? info.si_status : 128 + info.si_status;
+}
+
+__private void sandbox_kill(launchWait_s* lw, int sig){
+	if( (lw->pidfd != -1 ? pidfd_send_signal(lw->pidfd, sig, NULL, 0) : kill(lw->pid, sig)) ){
+		dbg_error("signal sandbox: %m");
+	}
 }
 
-int hestia_launch(const char* destdir, configvm_s* vm){
+//return 1 on SIGCHLD, sandbox can be ended
+__private int sandbox_signal(launchWait_s* lw){
+	struct signalfd_siginfo si;
+	if( read(lw->sfd, &si, sizeof si) != sizeof si ) return 0;
+	if( si.ssi_signo == SIGCHLD ) return 1;
+	int sig = lw->forwarded++ ? SIGKILL : (int)si.ssi_signo;
+	dbg_info("signal %u, send %d to sandbox", si.ssi_signo, sig);
+	sandbox_kill(lw, sig);
+	return 0;
+}
+
+//ms, periodic if interval
+__private int timer_arm(int tfd, unsigned long ms, int interval){
+	struct itimerspec its = {
+		.it_value.tv_sec  = ms / 1000,
+		.it_value.tv_nsec = (ms % 1000) * 1000000
+	};
+	if( interval ) its.it_interval = its.it_value;
+	return timerfd_settime(tfd, 0, &its, NULL);
+}
+
+__private int timer_new(unsigned long ms, int interval){
+	int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if( tfd == -1 || timer_arm(tfd, ms, interval) ){
+		dbg_error("timerfd: %m");
+		if( tfd != -1 ) close(tfd);
+		return -1;
+	}
+	return tfd;
+}
+
+//first time terminate all process and wait grace, next time kill pid namespace
+__private void sandbox_stop(launchWait_s* lw, const char* why){
+	if( lw->stop++ || !lw->vm->grace ){
+		fprintf(stderr, "hestia: %s, kill sandbox\n", why);
+		sandbox_kill(lw, SIGKILL);
+		return;
+	}
+	fprintf(stderr, "hestia: %s, terminate sandbox\n", why);
+	if( !lw->vm->group || !cgroup_signal(lw->vm->group, SIGTERM) ){
+		sandbox_kill(lw, SIGTERM);
+	}
+	if( lw->tfd == -1 || timer_arm(lw->tfd, lw->vm->grace * 1000UL, 0) ){
+		sandbox_kill(lw, SIGKILL);
+	}
+}
+
+__private void sandbox_timeout(launchWait_s* lw){
+	uint64_t exp;
+	if( read(lw->tfd, &exp, sizeof exp) != sizeof exp ) return;
+	sandbox_stop(lw, lw->stop ? "grace expired" : "timeout");
+}
+
+__private void sandbox_cputime(launchWait_s* lw){
+	uint64_t exp;
+	if( read(lw->cfd, &exp, sizeof exp) != sizeof exp || lw->stop ) return;
+	long usage = cgroup_cpu_usage(lw->vm->group);
+	if( usage >= 0 && (unsigned long)usage >= lw->vm->cputime * 1000000UL ) sandbox_stop(lw, "cputime");
+}
+
+__private int sandbox_events(launchWait_s* lw, int efd){
+	if( (lw->pidfd != -1 && epoll_watch(efd, lw->pidfd, LEV_PID)) || epoll_watch(efd, lw->sfd, LEV_SIGNAL) ) return -1;
+	if( lw->vm->timeout ){
+		if( (lw->tfd=timer_new(lw->vm->timeout * 1000UL, 0)) == -1 || epoll_watch(efd, lw->tfd, LEV_TIMEOUT) ) return -1;
+	}
+	if( lw->vm->cputime ){
+		if( !lw->vm->group ){
+			dbg_error("cputime without cgroup");
+			return -1;
+		}
+		if( (lw->cfd=timer_new(LAUNCH_CPUTIME_CHECK, 1)) == -1 || epoll_watch(efd, lw->cfd, LEV_CPUTIME) ) return -1;
+	}
+	//grace timer is the timeout timer
+	if( lw->vm->cputime && lw->tfd == -1 ){
+		if( (lw->tfd=timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) == -1 || epoll_watch(efd, lw->tfd, LEV_TIMEOUT) ) return -1;
+	}
+	return 0;
+}
+
+//signal forwarded to sandbox, blocked before clone and before supervisor thread inherit the mask
+//SIGCHLD is read only without pidfd
+__private void sandbox_sigmask(sigset_t* mask, sigset_t* old){
+	sigemptyset(mask);
+	sigaddset(mask, SIGINT);
+	sigaddset(mask, SIGTERM);
+	sigaddset(mask, SIGHUP);
+	sigaddset(mask, SIGQUIT);
+	sigaddset(mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, mask, old);
+}
+
+//block until sandbox end
+__private int sandbox_wait(configvm_s* vm, pid_t pid, int pidfd, sigset_t* mask){
+	if( pidfd != -1 ) sigdelset(mask, SIGCHLD);
+	launchWait_s lw = {
+		.vm        = vm,
+		.pid       = pid,
+		.pidfd     = pidfd,
+		.sfd       = signalfd(-1, mask, SFD_CLOEXEC),
+		.tfd       = -1,
+		.cfd       = -1,
+		.forwarded = 0,
+		.stop      = 0
+	};
+	int ret = -1;
+	int efd = epoll_create1(EPOLL_CLOEXEC);
+	if( lw.sfd == -1 || efd == -1 ){
+		dbg_error("launcher events: %m");
+		goto ONERR;
+	}
+	if( sandbox_events(&lw, efd) ) goto ONERR;
+
+	struct epoll_event ev[4];
+	while( ret == -1 ){
+		int nev = epoll_wait(efd, ev, sizeof_vector(ev), -1);
+		if( nev == -1 ){
+			if( errno == EINTR ) continue;
+			dbg_error("epoll wait: %m");
+			goto ONERR;
+		}
+		for( int i = 0; i < nev; ++i ){
+			switch( (launchEvent_e)ev[i].data.u32 ){
+				case LEV_PID:
+					if( (ret=sandbox_reap(pidfd, pid, 0)) == -1 ) goto ONERR;
+				break;
+
+				case LEV_SIGNAL:
+					if( sandbox_signal(&lw) ){
+						int st = sandbox_reap(pidfd, pid, WNOHANG);
+						if( st == -1 ) goto ONERR;
+						if( st != -2 ) ret = st;
+					}
+				break;
+
+				case LEV_TIMEOUT: sandbox_timeout(&lw); break;
+				case LEV_CPUTIME: sandbox_cputime(&lw); break;
+			}
+		}
+	}
+	goto END;
+ONERR:
+	//sandbox can't stay orphan of launcher
+	sandbox_kill(&lw, SIGKILL);
+	sandbox_reap(pidfd, pid, 0);
+END:
+	if( efd != -1 ) close(efd);
+	if( lw.sfd != -1 ) close(lw.sfd);
+	if( lw.tfd != -1 ) close(lw.tfd);
+	if( lw.cfd != -1 ) close(lw.cfd);
+	return ret;
+}
+
+int hestia_launch(const char* destdir, configvm_s* vm, const char* state){
 	overwriteArgs_s arg = {
 		.destdir = destdir,
-		.vm = vm
+		.vm = vm,
+		.cgroup = NULL,
+		.sigmask = NULL,
+		.sync = -1
 	};
-	void* newStack = mmap(NULL, SUBSTACKSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
-	pid_t pid = clone(overwrite, newStack + SUBSTACKSIZE, CLONE_NEWNS | CLONE_NEWPID | SIGCHLD, &arg);
+	//leftover of previous run is cleaned on host, reaper can't live in sandbox pid namespace
+	__free char* mountpointRoot = str_printf("%s/" HESTIA_ROOT, destdir);
+	if( dir_exists(mountpointRoot) ) hestia_umount(destdir);
+	if( state && state_load(destdir, state) ){
+		dbg_error("load state %s fail", state);
+		return -1;
+	}
+	const char* base = strrchr(destdir, '/');
+	__free char* cgname = str_printf("%s.%d", base && base[1] ? base + 1 : destdir, getpid());
+	int tid = vm->cgroup ? trace_begin(vm->trace, "cgroup", cgname) : -1;
+	int cgerr = config_vm_run_cgroup(vm, cgname);
+	trace_end(vm->trace, tid);
+	if( cgerr ){
+		dbg_error("cgroup %s fail", cgname);
+		sandbox_cgroup_end(vm);
+		return -1;
+	}
+	supervisor_s sv;
+	if( supervisor_begin(&sv, vm) ){
+		sandbox_cgroup_end(vm);
+		return -1;
+	}
+	int pidfd = -1;
+	sigset_t mask;
+	sigset_t old;
+	sandbox_sigmask(&mask, &old);
+	arg.sigmask = &old;
+	tid = trace_begin(vm->trace, "launch", destdir);
+	pid_t pid = sandbox_clone(&arg, &pidfd);
 	if( pid == -1 ){
 		dbg_error("clone fail: %m");
+		sigprocmask(SIG_SETMASK, &old, NULL);
+		trace_end(vm->trace, tid);
+		supervisor_end(&sv, vm);
+		sandbox_cgroup_end(vm);
 		goto ONERR;
 	}
-	int status;
-	if( waitpid(pid, &status, 0) == -1 ){
-		dbg_error("waitpid fail: %m");
-		goto ONERR;
-	}
-	if( WEXITSTATUS(status) ){
-		dbg_error("execd app return error");
+	supervisor_start(&sv, pidfd);
+	int status = sandbox_wait(vm, pid, pidfd, &mask);
+	//exec of app never end
+	trace_close(vm->trace);
+	supervisor_end(&sv, vm);
+	sigprocmask(SIG_SETMASK, &old, NULL);
+	if( pidfd != -1 ) close(pidfd);
+	sandbox_cgroup_end(vm);
+	if( status ){
+		dbg_error("execd app return error %d", status);
 		goto ONERR;
 	}
+	tid = trace_begin(vm->trace, "atexit", NULL);
 	config_vm_atexit(vm, 0);
-	munmap(newStack, SUBSTACKSIZE);
+	trace_end(vm->trace, tid);
 	return 0;
 ONERR:
+	tid = trace_begin(vm->trace, "onfail", NULL);
 	config_vm_atexit(vm, -1);
+	trace_end(vm->trace, tid);
+	tid = trace_begin(vm->trace, "teardown", destdir);
 	hestia_umount(destdir);
-	munmap(newStack, SUBSTACKSIZE);
+	trace_end(vm->trace, tid);
 	return -1;
 }
-
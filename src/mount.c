@@ -1,16 +1,264 @@
+#define _GNU_SOURCE
 #include <notstd/core.h>
 #include <notstd/str.h>
 
 #include <hestia/inutility.h>
 #include <hestia/config.h>
 #include <hestia/mount.h>
+#include <hestia/teardown.h>
+#include <hestia/system.h>
 
 #include <sys/mount.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
 #include <mntent.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <pwd.h>
 
+/*
+ * mount backend
+ *	new api: fsopen/fsconfig/fsmount or open_tree(OPEN_TREE_CLONE), attribute and propagation are set
+ *	on detached mount with mount_setattr and then attached with one move_mount
+ *	legacy : mount(2), bind need a second remount for apply flags
+ *	new api is probed on first use, ENOSYS switch to legacy for all next mount
+*/
+
+#define MS_PROPAGATION (MS_SHARED | MS_PRIVATE | MS_SLAVE | MS_UNBINDABLE)
+
+__private int MOUNTAPI = -1;
+
+__private void mount_attr_flags(struct mount_attr* attr, unsigned long flags){
+	memset(attr, 0, sizeof *attr);
+	if( flags & MS_RDONLY ) attr->attr_set |= MOUNT_ATTR_RDONLY;
+	if( flags & MS_NOSUID ) attr->attr_set |= MOUNT_ATTR_NOSUID;
+	if( flags & MS_NODEV  ) attr->attr_set |= MOUNT_ATTR_NODEV;
+	if( flags & MS_NOEXEC ) attr->attr_set |= MOUNT_ATTR_NOEXEC;
+	if( flags & MS_STRICTATIME ){
+		attr->attr_clr |= MOUNT_ATTR__ATIME;
+		attr->attr_set |= MOUNT_ATTR_STRICTATIME;
+	}
+	attr->propagation = flags & MS_PROPAGATION;
+}
+
+//mode is comma separated, key=value or flag
+__private int fs_config(int fd, const char* src, const char* data){
+	if( src && fsconfig(fd, FSCONFIG_SET_STRING, "source", src, 0) ){
+		dbg_error("fsconfig source %s::%m", src);
+		return -1;
+	}
+	if( !data || !*data ) return 0;
+	__free char* opt = str_dup(data, 0);
+	char* next = opt;
+	while( next && *next ){
+		char* kv = next;
+		next = strchr(next, ',');
+		if( next ) *next++ = 0;
+		if( !*kv ) continue;
+		char* v = strchr(kv, '=');
+		int ret;
+		if( v ){
+			*v++ = 0;
+			ret = fsconfig(fd, FSCONFIG_SET_STRING, kv, v, 0);
+		}
+		else{
+			ret = fsconfig(fd, FSCONFIG_SET_FLAG, kv, NULL, 0);
+		}
+		if( ret ){
+			dbg_error("fsconfig %s::%m", kv);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+__private int api_check(int fd){
+	if( fd == -1 && errno == ENOSYS ){
+		dbg_warning("new mount api not supported, use legacy mount");
+		MOUNTAPI = 0;
+	}
+	else if( MOUNTAPI == -1 ){
+		MOUNTAPI = 1;
+	}
+	return fd;
+}
+
+int mount_api_available(void){
+	if( MOUNTAPI == -1 ){
+		int fd = api_check(fsopen("tmpfs", FSOPEN_CLOEXEC));
+		if( fd != -1 ) close(fd);
+	}
+	return MOUNTAPI;
+}
+
+int mount_detached(const char* src, const char* type, unsigned long flags, const char* data){
+	if( !MOUNTAPI ){
+		errno = ENOSYS;
+		return -1;
+	}
+	struct mount_attr attr;
+	mount_attr_flags(&attr, flags);
+	int mfd;
+	
+	if( flags & MS_BIND ){
+		unsigned const rec = flags & MS_REC ? AT_RECURSIVE : 0;
+		mfd = api_check(open_tree(AT_FDCWD, src, OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | rec));
+		if( mfd == -1 ){
+			dbg_error("open_tree %s::%m", src);
+			return -1;
+		}
+		if( (attr.attr_set || attr.attr_clr || attr.propagation) && mount_setattr(mfd, "", AT_EMPTY_PATH | rec, &attr, sizeof attr) ){
+			dbg_error("mount_setattr %s::%m", src);
+			close(mfd);
+			return -1;
+		}
+		return mfd;
+	}
+	
+	int fd = api_check(fsopen(type, FSOPEN_CLOEXEC));
+	if( fd == -1 ){
+		dbg_error("fsopen %s::%m", type);
+		return -1;
+	}
+	if( fs_config(fd, src, data) || fsconfig(fd, FSCONFIG_CMD_CREATE, NULL, NULL, 0) ){
+		dbg_error("fsconfig create %s::%m", type);
+		close(fd);
+		return -1;
+	}
+	mfd = fsmount(fd, FSMOUNT_CLOEXEC, attr.attr_set);
+	close(fd);
+	if( mfd == -1 ){
+		dbg_error("fsmount %s::%m", type);
+		return -1;
+	}
+	if( attr.propagation ){
+		attr.attr_set = attr.attr_clr = 0;
+		if( mount_setattr(mfd, "", AT_EMPTY_PATH, &attr, sizeof attr) ){
+			dbg_error("mount_setattr propagation %s::%m", type);
+			close(mfd);
+			return -1;
+		}
+	}
+	return mfd;
+}
+
+int mount_attach(int mfd, const char* dst){
+	int ret = move_mount(mfd, "", AT_FDCWD, dst, MOVE_MOUNT_F_EMPTY_PATH);
+	if( ret ){
+		dbg_error("move_mount %s::%m", dst);
+	}
+	close(mfd);
+	return ret;
+}
+
+__private int mount_legacy(const char* src, const char* dst, const char* type, unsigned long flags, const char* data){
+	if( !(flags & MS_BIND) ){
+		if( mount(src, dst, type, flags, data) ){
+			dbg_error("mount.error src:'%s' '%s'::%s %lX [%s]::%m", src, dst, type, flags, data);
+			return -1;
+		}
+		return 0;
+	}
+	if( mount(src, dst, type, MS_BIND | (flags & MS_REC), data) ){
+		dbg_error("mount.error src:'%s' '%s'::%s %lX [%s]::%m", src, dst, type, flags, data);
+		return -1;
+	}
+	unsigned long const prop = flags & MS_PROPAGATION;
+	unsigned long const attr = flags & ~(MS_PROPAGATION | MS_BIND | MS_REC);
+	if( prop && mount(NULL, dst, NULL, prop | (flags & MS_REC), NULL) ){
+		dbg_error("remount.error propagation '%s' %lX::%m", dst, prop);
+	}
+	if( attr && mount(NULL, dst, NULL, MS_REMOUNT | MS_BIND | attr, NULL) ){
+		dbg_error("remount.error '%s' %lX::%m", dst, attr);
+	}
+	return 0;
+}
+
+int hestia_mount(const char* src, const char* dst, const char* type, unsigned long flags, const char* data){
+	if( MOUNTAPI ){
+		int mfd = mount_detached(src, type, flags, data);
+		if( mfd != -1 ) return mount_attach(mfd, dst);
+		if( MOUNTAPI ) return -1;
+	}
+	return mount_legacy(src, dst, type, flags, data);
+}
+
+//bind src on dst, owner of src is seen as uid/gid and uid/gid as owner of src, only new api can set idmap
+int hestia_mount_idmap(const char* src, const char* dst, unsigned long flags, uid_t uid, gid_t gid){
+	if( !mount_api_available() ){
+		dbg_error("idmap %s require new mount api", src);
+		errno = ENOSYS;
+		return -1;
+	}
+	struct stat st;
+	if( stat(src, &st) ){
+		dbg_error("stat %s::%m", src);
+		return -1;
+	}
+	int ufd = userns_idmap(st.st_uid, uid, st.st_gid, gid);
+	if( ufd == -1 ) return -1;
+	int mfd = mount_detached(src, "bind", flags | MS_BIND, NULL);
+	if( mfd == -1 ){
+		close(ufd);
+		return -1;
+	}
+	struct mount_attr attr = {
+		.attr_set  = MOUNT_ATTR_IDMAP,
+		.userns_fd = ufd
+	};
+	unsigned const rec = flags & MS_REC ? AT_RECURSIVE : 0;
+	int ret = mount_setattr(mfd, "", AT_EMPTY_PATH | rec, &attr, sizeof attr);
+	close(ufd);
+	if( ret ){
+		dbg_error("mount_setattr idmap %s::%m", src);
+		close(mfd);
+		return -1;
+	}
+	return mount_attach(mfd, dst);
+}
+
+/*
+ * teardown
+ *	launcher set / as slave before mount, sandbox mount die with its namespace and never propagate to host,
+ *	on host can remain only mount of old sandbox or mount created outside hestia.
+ *	all mount of a sandbox are inside a mount rooted in a direct entry of destdir: root is bind on itself
+ *	before any other mount, merge, lower and tmpfs of overlay are entries of destdir.
+ *	each entry that is a mount root is detached with MNT_DETACH that umount recursively all its subtree,
+ *	cost depends only on entries of destdir and never on mount of host.
+ *	kernel without STATX_ATTR_MOUNT_ROOT fallback to scan /proc/mounts
+*/
+
+//1 mount root, 0 not, -1 kernel can't tell
+__private int mount_root(int dfd, const char* name){
+	struct statx stx;
+	if( statx(dfd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, 0, &stx) ) return 0;
+	if( !(stx.stx_attributes_mask & STATX_ATTR_MOUNT_ROOT) ) return -1;
+	return stx.stx_attributes & STATX_ATTR_MOUNT_ROOT ? 1 : 0;
+}
+
+//return NULL if kernel can't tell mount root
+__private char** mount_list_fast(const char* destdir){
+	DIR* d = opendir(destdir);
+	if( !d ) return NULL;
+	char** lst = MANY(char*, 8);
+	struct dirent* ent;
+	while( (ent=readdir(d)) ){
+		if( ent->d_type != DT_DIR || !strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..") ) continue;
+		int r = mount_root(dirfd(d), ent->d_name);
+		if( r < 0 ){
+			mforeach(lst, i) mem_free(lst[i]);
+			mem_free(lst);
+			closedir(d);
+			return NULL;
+		}
+		if( !r ) continue;
+		unsigned ni = mem_ipush(&lst);
+		lst[ni] = str_printf("%s/%s", destdir, ent->d_name);
+	}
+	closedir(d);
+	return lst;
+}
+
 __private int mount_cmp(const void* A, const void* B){
 	return strcmp(B, A);
 }
@@ -34,29 +282,48 @@ __private char** mount_list(const char* match){
 __private void overlay_rmdir(const char* destdir){
 	DIR* d = opendir(destdir);
 	if( !d ) die("unable to open destdir");
+	char** lst = MANY(char*, 8);
 	struct dirent* ent;
 	while( (ent=readdir(d)) ){
 		char* name = strrchr(ent->d_name, '.');
 		if( !name ) continue;
-		if( !strcmp(name, ".upper") || !strcmp(name, ".work") || !strcmp(name, ".merge") ){
-			__free char* path = str_printf("%s/%s", destdir, ent->d_name);
-			dbg_info("overlay.rm %s", path);
-			rm(path);
+		if( !strcmp(name, ".upper") || !strcmp(name, ".work") || !strcmp(name, ".merge") || !strcmp(name, ".lower") || !strcmp(name, ".tmpfs") ){
+			unsigned ni = mem_ipush(&lst);
+			lst[ni] = str_printf("%s/%s", destdir, ent->d_name);
 		}
 	}
 	closedir(d);
+	//rename after readdir, directory is not changed while is read
+	mforeach(lst, i){
+		dbg_info("overlay.rm %s", lst[i]);
+		teardown_bury(destdir, lst[i]);
+		mem_free(lst[i]);
+	}
+	mem_free(lst);
 }
 
 int hestia_umount(const char* destdir){
-	char** lstmnt = mount_list(destdir);
-	mforeach(lstmnt, i){
-		dbg_info("umount %s", lstmnt[i]);
-		umount(lstmnt[i]);
-		rm(lstmnt[i]);
-		mem_free(lstmnt[i]);
+	char** lstmnt = mount_list_fast(destdir);
+	if( lstmnt ){
+		mforeach(lstmnt, i){
+			dbg_info("umount.detach %s", lstmnt[i]);
+			umount2(lstmnt[i], MNT_DETACH);
+			teardown_bury(destdir, lstmnt[i]);
+			mem_free(lstmnt[i]);
+		}
+	}
+	else{
+		lstmnt = mount_list(destdir);
+		mforeach(lstmnt, i){
+			dbg_info("umount %s", lstmnt[i]);
+			umount(lstmnt[i]);
+			rm(lstmnt[i]);
+			mem_free(lstmnt[i]);
+		}
 	}
 	mem_free(lstmnt);
 	overlay_rmdir(destdir);
+	teardown_reap(destdir);
 	return 0;
 }
 
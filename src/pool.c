@@ -0,0 +1,396 @@
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/mount.h>
+#include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <poll.h>
+
+#include <notstd/core.h>
+#include <notstd/str.h>
+
+#include <hestia/launcher.h>
+#include <hestia/config.h>
+#include <hestia/inutility.h>
+#include <hestia/pool.h>
+#include <hestia/system.h>
+#include <hestia/teardown.h>
+
+/*
+ * pool of warm sandbox
+ *	supervisor create count slot, all slot use same configvm_s
+ *	slot is init of its own pid and mount namespace, it never mount the sandbox itself,
+ *	each job run in a runner: a child that unshare mount namespace, bind a fresh directory
+ *	slotdir/N over destdir, so the path compiled in bytecode are valid, and run the mount stage.
+ *	runner is built before the command arrives: when a command is passed to the ready runner,
+ *	slot start to build next runner while the job run, mount stage is never on path of a job
+ *	if the job take more time than the mount stage.
+ *	runner fork the job that unshare mount namespace again and run exec stage, runner wait it and run atexit.
+ *	each job start from a pristine stack, tmpfs, dir and upper of a previous job are never seen.
+ *	status is sent to supervisor as soon as runner exit, then its directory is buried and reaped in background.
+ *	orphan are reaped by slot on SIGCHLD read from signalfd
+ *	cgroup, timeout and cputime are limit of a single launch, pool refuse config that use them
+ *
+ *	supervisor      slot                   runner                 job
+ *	                fork ----------------> unshare, mount stage
+ *	cmd ----------> send ----------------> split
+ *	                fork next runner       fork ----------------> unshare
+ *	                                                              changeroot, seccomp, drop, exec
+ *	                                       wait, atexit <-------- exit
+ *	wait <--------- status <-------------- exit
+ *	                bury runner dir
+*/
+
+//exit of runner when mount stage fail, slot is broken
+#define POOL_RUNNER_BROKEN 2
+
+typedef struct poolSlot{
+	pid_t    pid;
+	int      fd;
+	int      busy;
+	char*    dir;
+}poolSlot_s;
+
+typedef struct poolArgs{
+	configvm_s* vm;
+	const char* destdir;
+	const char* slotdir;
+	int         fd;
+	int         peer;
+	int         sfd;
+}poolArgs_s;
+
+typedef struct poolRunner{
+	pid_t pid;
+	int   fd;
+	char* dir;
+}poolRunner_s;
+
+__private int runner_job(configvm_s* vm, char* cmd){
+	__free char** argv = split_h(cmd);
+	unsigned const argc = mem_header(argv)->len;
+	argv[mem_ipush(&argv)] = NULL;
+	mem_header(argv)->len = argc;
+	
+	pid_t pid = fork();
+	if( pid == -1 ){
+		dbg_error("fork fail: %m");
+		return -1;
+	}
+	if( !pid ){
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+		if( unshare(CLONE_NEWNS) ){
+			dbg_error("unshare fail: %m");
+			_exit(1);
+		}
+		config_vm_exec_argv(vm, argv);
+		config_vm_run_exec(vm);
+		_exit(1);
+	}
+	
+	int status;
+	while( waitpid(pid, &status, 0) == -1 ){
+		if( errno != EINTR ){
+			dbg_error("waitpid fail: %m");
+			return -1;
+		}
+	}
+	int ret = WIFEXITED(status) && !WEXITSTATUS(status) ? 0 : -1;
+	config_vm_atexit(vm, ret);
+	return ret;
+}
+
+//build stack in own namespace and wait command, socket closed without command is end of pool
+__private int runner_run(poolArgs_s* arg, const char* dir, int fd){
+	if( unshare(CLONE_NEWNS) ){
+		dbg_error("runner unshare fail: %m");
+		return POOL_RUNNER_BROKEN;
+	}
+	mk_dir(dir, 0755);
+	if( mount(dir, arg->destdir, "bind", MS_BIND, NULL) ){
+		dbg_error("bind runner %s -> %s fail: %m", dir, arg->destdir);
+		return POOL_RUNNER_BROKEN;
+	}
+	if( config_vm_run_mount(arg->vm) ){
+		dbg_error("runner mount stage fail");
+		return POOL_RUNNER_BROKEN;
+	}
+	__free char* cmd = MANY(char, HESTIA_POOL_CMD_MAX);
+	ssize_t nr;
+	while( (nr=recv(fd, cmd, HESTIA_POOL_CMD_MAX - 1, 0)) == -1 && errno == EINTR );
+	if( nr <= 0 ) return 0;
+	cmd[nr] = 0;
+	mem_header(cmd)->len = nr;
+	return runner_job(arg->vm, cmd) ? 1 : 0;
+}
+
+//runner is exited, its directory is removed in background
+__private void runner_dtor(poolRunner_s* r, const char* slotdir){
+	if( r->fd != -1 ) close(r->fd);
+	r->fd  = -1;
+	r->pid = -1;
+	if( !r->dir ) return;
+	teardown_bury(slotdir, r->dir);
+	teardown_reap(slotdir);
+	mem_free(r->dir);
+	r->dir = NULL;
+}
+
+//runner without fd is not ready
+__private int runner_ctor(poolRunner_s* r, poolArgs_s* arg, unsigned id){
+	int sk[2];
+	r->pid = -1;
+	r->fd  = -1;
+	r->dir = str_printf("%s/%u", arg->slotdir, id);
+	if( socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sk) ){
+		dbg_error("socketpair fail: %m");
+		runner_dtor(r, arg->slotdir);
+		return -1;
+	}
+	r->pid = fork();
+	if( !r->pid ){
+		close(sk[0]);
+		close(arg->fd);
+		close(arg->sfd);
+		_exit(runner_run(arg, r->dir, sk[1]));
+	}
+	close(sk[1]);
+	if( r->pid == -1 ){
+		dbg_error("fork runner fail: %m");
+		close(sk[0]);
+		runner_dtor(r, arg->slotdir);
+		return -1;
+	}
+	r->fd = sk[0];
+	return 0;
+}
+
+__private int runner_status(int status){
+	if( !WIFEXITED(status) ) return -1;
+	switch( WEXITSTATUS(status) ){
+		case 0: return 0;
+		case POOL_RUNNER_BROKEN: return -2;
+		default: return -1;
+	}
+}
+
+__private int slot_run(poolArgs_s* arg){
+	close(arg->peer);
+	int null = open("/dev/null", O_RDONLY);
+	if( null != -1 ){
+		dup2(null, STDIN_FILENO);
+		close(null);
+	}
+	if( mount(NULL, "/", NULL, MS_PRIVATE | MS_REC, NULL) ){
+		dbg_error("remount / private failed: %m");
+		return 1;
+	}
+	mk_dir(arg->slotdir, 0755);
+	mk_dir(arg->destdir, 0755);
+	
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	arg->sfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+	if( arg->sfd == -1 ){
+		dbg_error("signalfd fail: %m");
+		return 1;
+	}
+	
+	unsigned id = 0;
+	poolRunner_s ready = { .pid = -1, .fd = -1, .dir = NULL };
+	poolRunner_s job   = { .pid = -1, .fd = -1, .dir = NULL };
+	int end = 0;
+	runner_ctor(&ready, arg, id++);
+	__free char* cmd = MANY(char, HESTIA_POOL_CMD_MAX);
+	struct pollfd pfd[2] = {
+		{ .fd = arg->fd , .events = POLLIN },
+		{ .fd = arg->sfd, .events = POLLIN }
+	};
+	while( 1 ){
+		//wait status of job before next command
+		pfd[0].fd = job.dir ? -1 : arg->fd;
+		if( poll(pfd, 2, -1) == -1 ){
+			if( errno == EINTR ) continue;
+			dbg_error("slot poll fail: %m");
+			break;
+		}
+		if( pfd[1].revents ){
+			struct signalfd_siginfo si;
+			while( read(arg->sfd, &si, sizeof si) == sizeof si );
+			pid_t w;
+			int status;
+			while( (w=waitpid(-1, &status, WNOHANG)) > 0 ){
+				if( w == job.pid ){
+					int ret = runner_status(status);
+					if( send(arg->fd, &ret, sizeof ret, MSG_NOSIGNAL) != sizeof ret || ret == -2 ) end = 1;
+					runner_dtor(&job, arg->slotdir);
+				}
+				else if( w == ready.pid ){
+					//a runner without command exit only when mount stage fail, next command is refused
+					runner_dtor(&ready, arg->slotdir);
+				}
+			}
+			if( end ) break;
+		}
+		if( !pfd[0].revents ) continue;
+		ssize_t nr = recv(arg->fd, cmd, HESTIA_POOL_CMD_MAX, MSG_TRUNC);
+		if( nr <= 0 ) break;
+		int ret = -1;
+		if( nr >= HESTIA_POOL_CMD_MAX ){
+			dbg_error("command of %zd bytes exceed %u", nr, HESTIA_POOL_CMD_MAX - 1);
+		}
+		else if( ready.fd == -1 || send(ready.fd, cmd, nr, MSG_NOSIGNAL) != nr ){
+			dbg_error("slot runner not ready");
+			ret = -2;
+		}
+		else{
+			job = ready;
+			close(job.fd);
+			job.fd = -1;
+			runner_ctor(&ready, arg, id++);
+			continue;
+		}
+		if( send(arg->fd, &ret, sizeof ret, MSG_NOSIGNAL) != sizeof ret || ret == -2 ) break;
+	}
+	//runner without command exit on close, namespace and its mount die with slot
+	if( ready.fd != -1 ) close(ready.fd);
+	close(arg->sfd);
+	return 0;
+}
+
+__private int slot_ctor(poolSlot_s* slot, const char* destdir, configvm_s* vm, unsigned id){
+	int sk[2];
+	slot->busy  = 0;
+	slot->pid   = -1;
+	slot->fd    = -1;
+	slot->dir   = str_printf("%s." HESTIA_POOL_EXT ".%u", destdir, id);
+	if( socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sk) ){
+		dbg_error("socketpair fail: %m");
+		return -1;
+	}
+	poolArgs_s arg = {
+		.vm      = vm,
+		.destdir = destdir,
+		.slotdir = slot->dir,
+		.fd      = sk[1],
+		.peer    = sk[0],
+		.sfd     = -1
+	};
+	//_exit terminate also worker of parallel overlay
+	slot->pid = sandbox_fork(NULL, -1, 0);
+	if( !slot->pid ) _exit(slot_run(&arg));
+	close(sk[1]);
+	if( slot->pid == -1 ){
+		dbg_error("clone fail: %m");
+		close(sk[0]);
+		return -1;
+	}
+	slot->fd = sk[0];
+	return 0;
+}
+
+//all slot need to be closed before call dtor, each slot inherit fd of previous slot
+__private void slot_close(poolSlot_s* slot){
+	if( slot->fd != -1 ) close(slot->fd);
+	slot->fd = -1;
+}
+
+__private void slot_dtor(poolSlot_s* slot){
+	if( slot->pid != -1 ) waitpid(slot->pid, NULL, 0);
+	//slot namespace is dead, on host remain only the directory
+	rm(slot->dir);
+	mem_free(slot->dir);
+}
+
+//wait almost one busy slot return status, return -1 if any job fail
+__private int pool_wait(poolSlot_s* slot, unsigned count){
+	__free struct pollfd* pfd = MANY(struct pollfd, count);
+	unsigned npfd = 0;
+	int ret = 0;
+	for( unsigned i = 0; i < count; ++i ){
+		if( !slot[i].busy ) continue;
+		pfd[npfd].fd      = slot[i].fd;
+		pfd[npfd].events  = POLLIN;
+		pfd[npfd].revents = 0;
+		++npfd;
+	}
+	if( !npfd ) return 0;
+	while( poll(pfd, npfd, -1) == -1 ){
+		if( errno != EINTR ) die("pool poll fail: %m");
+	}
+	for( unsigned i = 0, p = 0; i < count; ++i ){
+		if( !slot[i].busy ) continue;
+		if( pfd[p++].revents ){
+			int status = -1;
+			if( recv(slot[i].fd, &status, sizeof status, 0) != sizeof status || status == -2 ){
+				dbg_error("slot %u is dead", i);
+				close(slot[i].fd);
+				slot[i].fd = -1;
+			}
+			slot[i].busy = 0;
+			if( status ) ret = -1;
+		}
+	}
+	return ret;
+}
+
+int hestia_pool(const char* destdir, configvm_s* vm, unsigned count){
+	if( !count ) die("pool required almost one slot");
+	__free poolSlot_s* slot = MANY(poolSlot_s, count);
+	int ret = 0;
+	for( unsigned i = 0; i < count; ++i ){
+		if( slot_ctor(&slot[i], destdir, vm, i) ) die("unable to create pool slot %u", i);
+	}
+	
+	char* line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	while( (len=getline(&line, &size, stdin)) > 0 ){
+		str_chomp(line);
+		const char* cmd = str_skip_h(line);
+		if( !*cmd ) continue;
+		if( strlen(cmd) >= HESTIA_POOL_CMD_MAX ){
+			fprintf(stderr, "hestia: pool command exceed %u bytes, skip\n", HESTIA_POOL_CMD_MAX - 1);
+			ret = -1;
+			continue;
+		}
+		
+		unsigned i;
+		while( 1 ){
+			unsigned alive = 0;
+			for( i = 0; i < count && (slot[i].busy || slot[i].fd == -1); ++i ){
+				if( slot[i].fd != -1 ) ++alive;
+			}
+			if( i < count ) break;
+			if( !alive ) die("all pool slot are dead");
+			if( pool_wait(slot, count) ) ret = -1;
+		}
+		if( send(slot[i].fd, cmd, strlen(cmd), MSG_NOSIGNAL) == -1 ){
+			dbg_error("send to slot %u fail: %m", i);
+			ret = -1;
+			continue;
+		}
+		slot[i].busy = 1;
+	}
+	free(line);
+	
+	for( unsigned i = 0; i < count; ++i ){
+		while( slot[i].busy ){
+			if( pool_wait(slot, count) ) ret = -1;
+		}
+	}
+	for( unsigned i = 0; i < count; ++i ){
+		slot_close(&slot[i]);
+	}
+	for( unsigned i = 0; i < count; ++i ){
+		slot_dtor(&slot[i]);
+	}
+	return ret;
+}
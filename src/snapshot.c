@@ -0,0 +1,386 @@
+#include <notstd/core.h>
+#include <notstd/str.h>
+#include <notstd/hashalg.h>
+
+#include <hestia/inutility.h>
+#include <hestia/analyzer.h>
+#include <hestia/snapshot.h>
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#define DIFF_TYPE    0x01
+#define DIFF_MODE    0x02
+#define DIFF_OWNER   0x04
+#define DIFF_SIZE    0x08
+#define DIFF_MTIME   0x10
+#define DIFF_CONTENT 0x20
+
+#define SNAPSHOT_READ 65536
+
+typedef struct snapCtx{
+	snapshot_s* prev;
+	unsigned   skip;
+	unsigned   flags;
+}snapCtx_s;
+
+//'/' is less than any other char, order is same of a depth first walk sorted by name
+int snapshot_path_cmp(const char* a, const char* b){
+	while( *a && *a == *b ){
+		++a;
+		++b;
+	}
+	unsigned const ca = !*a ? 0 : *a == '/' ? 1 : (unsigned char)*a + 1;
+	unsigned const cb = !*b ? 0 : *b == '/' ? 1 : (unsigned char)*b + 1;
+	return (int)ca - (int)cb;
+}
+
+//name without / is a snapshot in destdir
+char* snapshot_file(const char* destdir, const char* name){
+	if( !destdir || strchr(name, '/') ) return path_explode(name);
+	return str_printf("%s/%s." HESTIA_SNAPSHOT_EXT, destdir, name);
+}
+
+snapshot_s* snapshot_open(const char* fname){
+	int fd = open(fname, O_RDONLY | O_CLOEXEC);
+	if( fd == -1 ) return NULL;
+	struct stat st;
+	if( fstat(fd, &st) || (size_t)st.st_size < sizeof(snapHeader_s) ){
+		dbg_warning("%s is not a snapshot", fname);
+		close(fd);
+		return NULL;
+	}
+	size_t const size = st.st_size;
+	void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if( map == MAP_FAILED ){
+		dbg_error("mmap %s: %m", fname);
+		return NULL;
+	}
+	const snapHeader_s* hdr = map;
+	if( hdr->magic != HESTIA_SNAPSHOT_MAGIC || hdr->version != HESTIA_SNAPSHOT_VERSION || !hdr->restart
+		|| hdr->rec > size || hdr->count > (size - hdr->rec) / sizeof(snapRec_s) || hdr->rec % sizeof(uint64_t)
+		|| hdr->path > size || hdr->pathsize > size - hdr->path
+	){
+		dbg_warning("%s is not a snapshot version %u", fname, HESTIA_SNAPSHOT_VERSION);
+		munmap(map, size);
+		return NULL;
+	}
+	snapshot_s* snap = NEW(snapshot_s);
+	snap->map  = map;
+	snap->size = size;
+	snap->hdr  = hdr;
+	snap->rec  = (const snapRec_s*)((const char*)map + hdr->rec);
+	snap->path = (const char*)map + hdr->path;
+	return snap;
+}
+
+void snapshot_close(snapshot_s* snap){
+	if( !snap ) return;
+	munmap(snap->map, snap->size);
+	mem_free(snap);
+}
+
+//path can be rebuilt only from previous restart
+void snapshot_cursor(snapCursor_s* cur, const snapshot_s* snap, unsigned index){
+	cur->snap    = snap;
+	cur->next    = index - index % snap->hdr->restart;
+	cur->len     = 0;
+	cur->path[0] = 0;
+	while( cur->next < index && snapshot_next(cur) );
+}
+
+const snapRec_s* snapshot_next(snapCursor_s* cur){
+	const snapshot_s* snap = cur->snap;
+	if( cur->next >= snap->hdr->count ) return NULL;
+	const snapRec_s* rec = &snap->rec[cur->next];
+	uint64_t const off = rec->path;
+	uint16_t shared;
+	uint16_t len;
+	if( off + 2 * sizeof(uint16_t) > snap->hdr->pathsize ) goto ONERR;
+	memcpy(&shared, &snap->path[off], sizeof shared);
+	memcpy(&len, &snap->path[off + sizeof shared], sizeof len);
+	if( (cur->next % snap->hdr->restart && shared > cur->len) || (!(cur->next % snap->hdr->restart) && shared) ) goto ONERR;
+	if( off + 2 * sizeof(uint16_t) + len > snap->hdr->pathsize || shared + len >= PATH_MAX ) goto ONERR;
+	memcpy(&cur->path[shared], &snap->path[off + 2 * sizeof(uint16_t)], len);
+	cur->len = shared + len;
+	cur->path[cur->len] = 0;
+	++cur->next;
+	return rec;
+ONERR:
+	dbg_error("corrupted snapshot record %u", cur->next);
+	cur->next = snap->hdr->count;
+	return NULL;
+}
+
+//binary search last restart with path less or equal, then scan at most one restart
+const snapRec_s* snapshot_find(const snapshot_s* snap, const char* path){
+	unsigned const count   = snap->hdr->count;
+	unsigned const restart = snap->hdr->restart;
+	if( !count ) return NULL;
+	snapCursor_s cur;
+	unsigned lo = 0;
+	unsigned hi = (count - 1) / restart + 1;
+	while( lo + 1 < hi ){
+		unsigned mid = lo + (hi - lo) / 2;
+		snapshot_cursor(&cur, snap, mid * restart);
+		if( !snapshot_next(&cur) ) return NULL;
+		if( snapshot_path_cmp(cur.path, path) <= 0 ) lo = mid;
+		else hi = mid;
+	}
+	snapshot_cursor(&cur, snap, lo * restart);
+	const snapRec_s* rec;
+	for( unsigned i = 0; i < restart && (rec=snapshot_next(&cur)); ++i ){
+		int c = snapshot_path_cmp(cur.path, path);
+		if( !c ) return rec;
+		if( c > 0 ) break;
+	}
+	return NULL;
+}
+
+//read and not mmap, a file truncated while hashed return 0 instead of SIGBUS
+__private uint64_t file_hash(int dirfd, const char* name, size_t size){
+	if( !size ) return hash_fasthash("", 0);
+	int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if( fd == -1 ) return 0;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	__free char* buf = MANY(char, SNAPSHOT_READ);
+	uint64_t h = hash_fasthash_init(size);
+	size_t left = size;
+	size_t fill = 0;
+	while( left ){
+		size_t want = SNAPSHOT_READ - fill;
+		if( want > left ) want = left;
+		ssize_t nr = read(fd, &buf[fill], want);
+		if( nr < 0 && errno == EINTR ) continue;
+		if( nr <= 0 ) break;
+		fill += nr;
+		left -= nr;
+		if( fill == SNAPSHOT_READ ){
+			h = hash_fasthash_update(h, buf, fill);
+			fill = 0;
+		}
+	}
+	close(fd);
+	return left ? 0 : hash_fasthash_final(h, buf, fill);
+}
+
+//called from analyzer worker, hash is computed in parallel
+//write raw [record][u16 len][path], snapshot_write build the index
+__private void snap_emit(FILE* out, int dirfd, const char* name, __unused unsigned type, const char* path, void* pctx){
+	snapCtx_s* ctx = pctx;
+	struct stat st;
+	if( fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) ){
+		dbg_error("stat %s: %m", path);
+		return;
+	}
+	const char* rel = path + ctx->skip;
+	snapRec_s rec = {
+		.size  = st.st_size,
+		.mtime = st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec,
+		.ino   = st.st_ino,
+		.hash  = 0,
+		.mode  = st.st_mode & 07777,
+		.uid   = st.st_uid,
+		.gid   = st.st_gid,
+		.type  = IFTODT(st.st_mode)
+	};
+	if( (ctx->flags & HESTIA_SNAPSHOT_HASH) && S_ISREG(st.st_mode) ){
+		const snapRec_s* old = ctx->prev ? snapshot_find(ctx->prev, rel) : NULL;
+		if( old && old->hash && old->size == rec.size && old->mtime == rec.mtime && old->ino == rec.ino ){
+			rec.hash = old->hash;
+		}
+		else{
+			rec.hash = file_hash(dirfd, name, st.st_size);
+		}
+	}
+	uint16_t const len = strlen(rel);
+	fwrite(&rec, sizeof rec, 1, out);
+	fwrite(&len, sizeof len, 1, out);
+	fwrite(rel, 1, len, out);
+}
+
+__private unsigned prefix_len(const char* a, unsigned la, const char* b, unsigned lb){
+	unsigned i = 0;
+	while( i < la && i < lb && a[i] == b[i] ) ++i;
+	return i;
+}
+
+//raw entry are already sorted, build record array and compressed path table
+__private int snap_index(FILE* f, const char* raw, size_t size){
+	snapHeader_s hdr = {
+		.magic   = HESTIA_SNAPSHOT_MAGIC,
+		.version = HESTIA_SNAPSHOT_VERSION,
+		.count   = 0,
+		.restart = HESTIA_SNAPSHOT_RESTART,
+		.rec     = sizeof(snapHeader_s)
+	};
+	__free snapRec_s* rec = MANY(snapRec_s, 64);
+	__free char* table    = MANY(char, size + 1);
+	const char* prev      = NULL;
+	uint16_t prevlen      = 0;
+	for( size_t p = 0; p + sizeof(snapRec_s) + sizeof(uint16_t) <= size; ){
+		unsigned const i = mem_ipush(&rec);
+		uint16_t len;
+		memcpy(&rec[i], &raw[p], sizeof(snapRec_s));
+		p += sizeof(snapRec_s);
+		memcpy(&len, &raw[p], sizeof len);
+		p += sizeof len;
+		const char* path = &raw[p];
+		p += len;
+		uint16_t const shared = i % HESTIA_SNAPSHOT_RESTART ? prefix_len(prev, prevlen, path, len) : 0;
+		uint16_t const suffix = len - shared;
+		unsigned const at     = mem_header(table)->len;
+		table = mem_upsize(table, 2 * sizeof(uint16_t) + suffix);
+		memcpy(&table[at], &shared, sizeof shared);
+		memcpy(&table[at + sizeof shared], &suffix, sizeof suffix);
+		memcpy(&table[at + 2 * sizeof(uint16_t)], &path[shared], suffix);
+		mem_header(table)->len += 2 * sizeof(uint16_t) + suffix;
+		rec[i].path     = at;
+		rec[i].reserved = 0;
+		prev    = path;
+		prevlen = len;
+	}
+	hdr.count    = mem_header(rec)->len;
+	hdr.path     = hdr.rec + sizeof(snapRec_s) * hdr.count;
+	hdr.pathsize = mem_header(table)->len;
+	if( fwrite(&hdr, sizeof hdr, 1, f) != 1 ) return -1;
+	if( hdr.count && fwrite(rec, sizeof(snapRec_s), hdr.count, f) != hdr.count ) return -1;
+	if( hdr.pathsize && fwrite(table, 1, hdr.pathsize, f) != hdr.pathsize ) return -1;
+	return 0;
+}
+
+int snapshot_write(const char* destdir, const char* name, unsigned flags){
+	__free char* fname = snapshot_file(destdir, name);
+	__free char* tmp   = str_printf("%s.tmp", fname);
+	snapCtx_s ctx = {
+		.prev  = flags & HESTIA_SNAPSHOT_HASH ? snapshot_open(fname) : NULL,
+		.skip  = strlen(destdir) + 1,
+		.flags = flags
+	};
+	int ret = -1;
+	char*  raw     = NULL;
+	size_t rawsize = 0;
+	FILE* ms = open_memstream(&raw, &rawsize);
+	if( !ms ){
+		dbg_error("memstream: %m");
+		goto ONERR;
+	}
+	hestia_analyze_walk(destdir, ms, snap_emit, &ctx);
+	fclose(ms);
+	FILE* f = fopen(tmp, "w");
+	if( !f ){
+		dbg_error("fail to open file: %s:: %m", tmp);
+		goto ONERR;
+	}
+	int err = snap_index(f, raw, rawsize);
+	if( fclose(f) || err || rename(tmp, fname) ){
+		dbg_error("fail to write snapshot %s:: %m", fname);
+		unlink(tmp);
+		goto ONERR;
+	}
+	chmod(fname, 0644);
+	ret = 0;
+ONERR:
+	free(raw);
+	snapshot_close(ctx.prev);
+	return ret;
+}
+
+__private void rec_print(FILE* out, const snapRec_s* rec, const char* path){
+	fprintf(out, "[%s] %o %u %u %" PRIu64 " %" PRIu64 " %" PRIu64 " %016" PRIx64 " %s\n",
+		dtname(rec->type), rec->mode, rec->uid, rec->gid, rec->size, rec->mtime, rec->ino, rec->hash, path
+	);
+}
+
+int snapshot_export(const char* fname, FILE* out){
+	snapshot_s* snap = snapshot_open(fname);
+	if( !snap ) return -1;
+	snapCursor_s cur;
+	snapshot_cursor(&cur, snap, 0);
+	const snapRec_s* rec;
+	while( (rec=snapshot_next(&cur)) ) rec_print(out, rec, cur.path);
+	snapshot_close(snap);
+	return 0;
+}
+
+//return 1 if path is in snapshot
+int snapshot_query(const char* fname, const char* path, FILE* out){
+	snapshot_s* snap = snapshot_open(fname);
+	if( !snap ) return -1;
+	const snapRec_s* rec = snapshot_find(snap, path);
+	if( rec ) rec_print(out, rec, path);
+	snapshot_close(snap);
+	return rec ? 1 : 0;
+}
+
+__private unsigned diff_field(const snapRec_s* a, const snapRec_s* b){
+	unsigned df = 0;
+	if( a->type != b->type ) df |= DIFF_TYPE;
+	if( a->mode != b->mode ) df |= DIFF_MODE;
+	if( a->uid != b->uid || a->gid != b->gid ) df |= DIFF_OWNER;
+	if( a->size != b->size ) df |= DIFF_SIZE;
+	if( a->hash && b->hash ){
+		if( a->hash != b->hash ) df |= DIFF_CONTENT;
+	}
+	else if( a->mtime != b->mtime ){
+		df |= DIFF_MTIME;
+	}
+	return df;
+}
+
+__private void diff_print(FILE* out, const char* path, unsigned df){
+	__private const char* DIFFNAME[] = { "type", "mode", "owner", "size", "mtime", "content" };
+	fprintf(out, "~ %s", path);
+	for( unsigned i = 0; i < sizeof_vector(DIFFNAME); ++i ){
+		if( df & (1U << i) ) fprintf(out, " %s", DIFFNAME[i]);
+	}
+	fputc('\n', out);
+}
+
+//merge of two sorted snapshot, return count of change or -1 on error
+int snapshot_diff(const char* a, const char* b, FILE* out){
+	snapshot_s* sa = snapshot_open(a);
+	if( !sa ) return -1;
+	snapshot_s* sb = snapshot_open(b);
+	if( !sb ){
+		snapshot_close(sa);
+		return -1;
+	}
+	__free snapCursor_s* ca = NEW(snapCursor_s);
+	__free snapCursor_s* cb = NEW(snapCursor_s);
+	snapshot_cursor(ca, sa, 0);
+	snapshot_cursor(cb, sb, 0);
+	const snapRec_s* ra = snapshot_next(ca);
+	const snapRec_s* rb = snapshot_next(cb);
+	int count = 0;
+	while( ra || rb ){
+		int c = !ra ? 1 : !rb ? -1 : snapshot_path_cmp(ca->path, cb->path);
+		if( c < 0 ){
+			fprintf(out, "- %s\n", ca->path);
+			ra = snapshot_next(ca);
+			++count;
+		}
+		else if( c > 0 ){
+			fprintf(out, "+ %s\n", cb->path);
+			rb = snapshot_next(cb);
+			++count;
+		}
+		else{
+			unsigned df = diff_field(ra, rb);
+			if( df ){
+				diff_print(out, cb->path, df);
+				++count;
+			}
+			ra = snapshot_next(ca);
+			rb = snapshot_next(cb);
+		}
+	}
+	snapshot_close(sa);
+	snapshot_close(sb);
+	return count;
+}
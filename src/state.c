@@ -0,0 +1,312 @@
+#define _GNU_SOURCE
+#include <notstd/core.h>
+#include <notstd/str.h>
+
+#include <hestia/inutility.h>
+#include <hestia/teardown.h>
+#include <hestia/state.h>
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/xattr.h>
+#include <linux/btrfs.h>
+#include <linux/magic.h>
+#include <linux/limits.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#define STATE_DENTS          32768
+#define BTRFS_SUBVOLUME_INO  256
+
+__private int is_btrfs(const char* path){
+	struct statfs sf;
+	return !statfs(path, &sf) && sf.f_type == BTRFS_SUPER_MAGIC;
+}
+
+__private int is_subvolume(const char* path, struct stat* st){
+	return st->st_ino == BTRFS_SUBVOLUME_INO && is_btrfs(path);
+}
+
+__private int name_valid(const char* name){
+	if( !*name || *name == '.' || strchr(name, '/') ){
+		dbg_error("invalid state name '%s'", name);
+		return 0;
+	}
+	return 1;
+}
+
+//split path in parent fd and name, return -1 on error
+__private int parent_open(const char* path, const char** name){
+	const char* sep = strrchr(path, '/');
+	if( !sep ){
+		*name = path;
+		return open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+	*name = sep + 1;
+	__free char* parent = sep == path ? str_dup("/", 0) : str_dup(path, sep - path);
+	return open(parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+//on btrfs upper is a subvolume, state can be snapshotted instead of copied
+void state_upper_mkdir(const char* path, unsigned privilege){
+	if( dir_exists(path) ) return;
+	const char* sep = strrchr(path, '/');
+	if( sep && sep != path ){
+		__free char* parent = str_dup(path, sep - path);
+		mk_dir(parent, privilege);
+		if( is_btrfs(parent) ){
+			struct btrfs_ioctl_vol_args args = {0};
+			strncpy(args.name, sep + 1, BTRFS_PATH_NAME_MAX);
+			int fd = open(parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if( fd != -1 ){
+				int err = ioctl(fd, BTRFS_IOC_SUBVOL_CREATE, &args);
+				close(fd);
+				if( !err ){
+					chmod(path, privilege);
+					return;
+				}
+			}
+			dbg_warning("subvolume %s: %m", path);
+		}
+	}
+	mk_dir(path, privilege);
+}
+
+__private int xattr_copy(int sfd, int dfd){
+	ssize_t size = flistxattr(sfd, NULL, 0);
+	if( size <= 0 ) return size < 0 && errno != ENOTSUP ? -1 : 0;
+	__free char* names = MANY(char, size);
+	__free char* value = MANY(char, XATTR_SIZE_MAX);
+	if( (size=flistxattr(sfd, names, size)) < 0 ) return -1;
+	int err = 0;
+	for( ssize_t i = 0; i < size; i += strlen(&names[i]) + 1 ){
+		ssize_t nv = fgetxattr(sfd, &names[i], value, XATTR_SIZE_MAX);
+		if( nv < 0 || fsetxattr(dfd, &names[i], value, nv, 0) ){
+			dbg_warning("xattr %s: %m", &names[i]);
+			err = -1;
+		}
+	}
+	return err;
+}
+
+__private int file_copy(int sfd, int dfd, off_t size){
+	if( !ioctl(dfd, FICLONE, sfd) ) return 0;
+	while( size > 0 ){
+		ssize_t nw = copy_file_range(sfd, NULL, dfd, NULL, size, 0);
+		if( nw < 0 ) return -1;
+		if( !nw ) break;
+		size -= nw;
+	}
+	return 0;
+}
+
+//chown before chmod, chown clear suid
+__private void meta_copy(int dfd, const char* name, struct stat* st){
+	if( fchownat(dfd, name, st->st_uid, st->st_gid, AT_SYMLINK_NOFOLLOW) ){
+		dbg_warning("chown %s: %m", name);
+	}
+	if( !S_ISLNK(st->st_mode) && fchmodat(dfd, name, st->st_mode & 07777, 0) ){
+		dbg_warning("chmod %s: %m", name);
+	}
+	struct timespec ts[2] = { st->st_atim, st->st_mtim };
+	utimensat(dfd, name, ts, AT_SYMLINK_NOFOLLOW);
+}
+
+__private int tree_copy(int sfd, int dfd);
+
+__private int ent_copy(int sfd, int dfd, const char* name){
+	struct stat st;
+	if( fstatat(sfd, name, &st, AT_SYMLINK_NOFOLLOW) ) return -1;
+	int err = 0;
+	switch( st.st_mode & S_IFMT ){
+		case S_IFDIR:{
+			if( mkdirat(dfd, name, 0700) ) return -1;
+			int s = openat(sfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			int d = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if( s == -1 || d == -1 ) err = -1;
+			else err = xattr_copy(s, d) | tree_copy(s, d);
+			if( s != -1 ) close(s);
+			if( d != -1 ) close(d);
+		}
+		break;
+
+		case S_IFREG:{
+			int s = openat(sfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+			if( s == -1 ) return -1;
+			int d = openat(dfd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+			if( d == -1 ){
+				close(s);
+				return -1;
+			}
+			err = file_copy(s, d, st.st_size) | xattr_copy(s, d);
+			close(s);
+			close(d);
+		}
+		break;
+
+		case S_IFLNK:{
+			char lnk[PATH_MAX];
+			ssize_t nr = readlinkat(sfd, name, lnk, PATH_MAX - 1);
+			if( nr < 0 ) return -1;
+			lnk[nr] = 0;
+			if( symlinkat(lnk, dfd, name) ) return -1;
+		}
+		break;
+
+		default:
+			//overlay whiteout is a char device 0:0
+			if( mknodat(dfd, name, st.st_mode, st.st_rdev) ) return -1;
+		break;
+	}
+	meta_copy(dfd, name, &st);
+	return err;
+}
+
+__private int tree_copy(int sfd, int dfd){
+	__free char* buf = MANY(char, STATE_DENTS);
+	int err = 0;
+	ssize_t nr;
+	while( (nr=getdents64(sfd, buf, STATE_DENTS)) > 0 ){
+		for( ssize_t off = 0; off < nr; ){
+			struct dirent64* ent = (struct dirent64*)&buf[off];
+			off += ent->d_reclen;
+			if( !strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..") ) continue;
+			if( ent_copy(sfd, dfd, ent->d_name) ){
+				dbg_error("copy %s: %m", ent->d_name);
+				err = -1;
+			}
+		}
+	}
+	return nr < 0 ? -1 : err;
+}
+
+__private int subvolume_snapshot(const char* src, const char* dst){
+	const char* name;
+	int pfd = parent_open(dst, &name);
+	if( pfd == -1 ) return -1;
+	int sfd = open(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if( sfd == -1 ){
+		close(pfd);
+		return -1;
+	}
+	struct btrfs_ioctl_vol_args_v2 args = { .fd = sfd };
+	strncpy(args.name, name, BTRFS_SUBVOL_NAME_MAX);
+	int err = ioctl(pfd, BTRFS_IOC_SNAP_CREATE_V2, &args);
+	close(sfd);
+	close(pfd);
+	return err;
+}
+
+int state_clone(const char* src, const char* dst){
+	struct stat st;
+	if( stat(src, &st) || !S_ISDIR(st.st_mode) ){
+		dbg_error("clone %s: not a directory", src);
+		return -1;
+	}
+	if( is_subvolume(src, &st) ){
+		if( !subvolume_snapshot(src, dst) ){
+			dbg_info("snapshot %s -> %s", src, dst);
+			return 0;
+		}
+		dbg_warning("snapshot %s: %m", src);
+	}
+	dbg_info("clone %s -> %s", src, dst);
+	const char* name;
+	int pfd = parent_open(dst, &name);
+	if( pfd == -1 ) return -1;
+	int err = -1;
+	if( mkdirat(pfd, name, 0700) ){
+		dbg_error("mkdir %s: %m", dst);
+		goto ONERR;
+	}
+	int sfd = open(src, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	int dfd = openat(pfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if( sfd != -1 && dfd != -1 ) err = xattr_copy(sfd, dfd) | tree_copy(sfd, dfd);
+	if( sfd != -1 ) close(sfd);
+	if( dfd != -1 ) close(dfd);
+	meta_copy(pfd, name, &st);
+ONERR:
+	close(pfd);
+	return err;
+}
+
+__private char** upper_list(const char* path){
+	DIR* d = opendir(path);
+	if( !d ) return NULL;
+	char** lst = MANY(char*, 8);
+	struct dirent* ent;
+	while( (ent=readdir(d)) ){
+		const char* ext = strrchr(ent->d_name, '.');
+		if( !ext || ent->d_name[0] == '.' || strcmp(ext, ".upper") ) continue;
+		unsigned ni = mem_ipush(&lst);
+		lst[ni] = str_dup(ent->d_name, 0);
+	}
+	closedir(d);
+	return lst;
+}
+
+__private void upper_list_free(char** lst){
+	mforeach(lst, i) mem_free(lst[i]);
+	mem_free(lst);
+}
+
+int state_save(const char* destdir, const char* name){
+	if( !name_valid(name) ) return -1;
+	__free char* statedir = str_printf("%s/" HESTIA_STATE_DIR, destdir);
+	__free char* state    = str_printf("%s/%s", statedir, name);
+	__free char* tmp      = str_printf("%s/.%s.%d", statedir, name, getpid());
+	mk_dir(statedir, 0700);
+	if( mkdir(tmp, 0700) ){
+		dbg_error("mkdir %s: %m", tmp);
+		return -1;
+	}
+	char** lst = upper_list(destdir);
+	if( !lst ){
+		dbg_error("unable to open %s: %m", destdir);
+		rm(tmp);
+		return -1;
+	}
+	int err = 0;
+	mforeach(lst, i){
+		__free char* src = str_printf("%s/%s", destdir, lst[i]);
+		__free char* dst = str_printf("%s/%s", tmp, lst[i]);
+		if( state_clone(src, dst) ) err = -1;
+	}
+	upper_list_free(lst);
+	//old state, if any, is swapped in tmp and buried
+	if( !err && renameat2(AT_FDCWD, tmp, AT_FDCWD, state, RENAME_EXCHANGE) ){
+		if( errno != ENOENT || rename(tmp, state) ){
+			dbg_error("rename state %s: %m", state);
+			err = -1;
+		}
+	}
+	if( dir_exists(tmp) ) teardown_bury(destdir, tmp);
+	teardown_reap(destdir);
+	if( !err ){
+		dbg_info("state %s saved", state);
+	}
+	return err;
+}
+
+int state_load(const char* destdir, const char* name){
+	if( !name_valid(name) ) return -1;
+	__free char* state = str_printf("%s/" HESTIA_STATE_DIR "/%s", destdir, name);
+	char** lst = upper_list(state);
+	if( !lst ){
+		dbg_error("state %s not exists", name);
+		return -1;
+	}
+	int err = 0;
+	mforeach(lst, i){
+		__free char* src = str_printf("%s/%s", state, lst[i]);
+		__free char* dst = str_printf("%s/%s", destdir, lst[i]);
+		if( dir_exists(dst) ) teardown_bury(destdir, dst);
+		if( state_clone(src, dst) ) err = -1;
+	}
+	upper_list_free(lst);
+	teardown_reap(destdir);
+	return err;
+}
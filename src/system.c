@@ -1,131 +1,953 @@
+#define _GNU_SOURCE
 #include <notstd/core.h>
 #include <notstd/str.h>
+#include <notstd/delay.h>
 
 #include <hestia/inutility.h>
 #include <hestia/system.h>
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <limits.h>
 #include <pwd.h>
 #include <grp.h>
 #include <linux/seccomp.h>
 #include <linux/filter.h>
 #include <linux/audit.h>
 #include <sys/prctl.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/syscall.h>
 #include <sys/mount.h>
-#include <sys/syscall.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <linux/sched.h>
+#include <linux/futex.h>
 
 #define CODE_BPF_STMT(code, k) ((struct sock_filter){ code, 0, 0, k })
 #define CODE_BPF_JUMP(code, k, jt, jf) ((struct sock_filter){ code, jt, jf, k })
 
 #define _LD(VAL)  CODE_BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS,  VAL)
-#define _JNE(VAL) CODE_BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, VAL, 0, 1)
-#define _JEQ(VAL) CODE_BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, VAL, 1, 0)
 #define _RET(VAL) CODE_BPF_STMT(BPF_RET | BPF_K, VAL)
 
-extern char* SYSTEMCALLNAME[];
-extern const unsigned SYSTEMCALLNAMECOUNT;
+__private int name_cmp(const void* key, const void* ent){
+	return strcmp(key, ((const sysName_s*)ent)->name);
+}
+
+__private int arch_nr(const sysArch_s* arch, const char* name){
+	if( !arch->nindex ) return -1;
+	const sysName_s* n = bsearch(name, arch->index, arch->nindex, sizeof(sysName_s), name_cmp);
+	return n ? (int)(n->nr | arch->bit) : -1;
+}
 
 __private long syscall_name_to_nr(const char* name){
-	for( unsigned i = 0; i < SYSTEMCALLNAMECOUNT; ++i ){
-		if( !SYSTEMCALLNAME[i] ) continue;
-		if( !strcmp(SYSTEMCALLNAME[i], name) ) return i;
+	return arch_nr(SYSTEMCALLARCH, name);
+}
+
+/*
+ * filter compiler
+ *	rule are sorted by syscall number, rule without condition and with same action are merged in range
+ *	range are split in a balanced tree of JGE, a leaf is a short linear check
+ *	or a bitmap when many range with same action are in a 32 window
+ *	a leaf jump to own RET or to block of argument check, all jump are forward and short
+ *	tree jump use JA when left subtree is too big, cost for each syscall of jailed process is O(log n)
+ *
+ *	block of argument check test each rule of syscall in config order, first rule match return its action
+ *	argument are 64 bit, each condition compare low and high word
+ *
+ *	filter dispatch on audit arch, each arch of SYSTEMCALLARCH has own tree with rule translated by name
+ *	@group is expanded with table of each arch, member that exists only in an arch (setuid32) are not lost
+ *	rule for syscall not exists in an arch are dropped, unknown arch is killed
+ *	on x86_64 nr with __X32_SYSCALL_BIT go in x32 tree, without x32 table are killed
+ *	a rule on name apply also to its compat variant of the arch, name32 name64 name_time64 and SYSCALLALIAS
+ *	a rule on a subcall of socketcall apply to socketcall with arg0 == subcall
+ *	ipc mask version in high bits of arg0, a restrictive rule on its subcall apply to whole ipc, a permissive to arg0 == subcall
+ *	argument of variant with other layout and of multiplexer can't be checked,
+ *	there a restrictive rule with condition lose the condition and a permissive rule with condition is dropped
+*/
+
+#define SECCOMP_LEAF_RANGE  4
+#define SECCOMP_BITMAP_BITS 32
+#define SECCOMP_BITMAP_COST 8
+#define SECCOMP_COND_SIZE   4
+#define SECCOMP_GROUP_DEEP  4
+
+#define _JCMP(OP, VAL, JT, JF) CODE_BPF_JUMP(BPF_JMP | OP | BPF_K, VAL, JT, JF)
+#define _JA(VAL)  CODE_BPF_STMT(BPF_JMP | BPF_JA, VAL)
+#define _SUB(VAL) CODE_BPF_STMT(BPF_ALU | BPF_SUB | BPF_K, VAL)
+#define _AND(VAL) CODE_BPF_STMT(BPF_ALU | BPF_AND | BPF_K, VAL)
+#define _LSHX()   CODE_BPF_STMT(BPF_ALU | BPF_LSH | BPF_X, 0)
+#define _TAX()    CODE_BPF_STMT(BPF_MISC | BPF_TAX, 0)
+#define _LDI(VAL) CODE_BPF_STMT(BPF_LD | BPF_IMM, VAL)
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#	define ARG_LO(I) (offsetof(struct seccomp_data, args[I]))
+#	define ARG_HI(I) (offsetof(struct seccomp_data, args[I]) + sizeof(uint32_t))
+#else
+#	define ARG_LO(I) (offsetof(struct seccomp_data, args[I]) + sizeof(uint32_t))
+#	define ARG_HI(I) (offsetof(struct seccomp_data, args[I]))
+#endif
+
+//rule is NULL for a merged range, otherwise all rule of a single syscall
+typedef struct sysRange{
+	unsigned         lo;
+	unsigned         hi;
+	unsigned         action;
+	const sysRule_s* rule;
+	unsigned         nrule;
+}sysRange_s;
+
+int syscall_nr(const char* name){
+	return syscall_name_to_nr(name);
+}
+
+__private unsigned errno_value(const char* name){
+	if( *name >= '0' && *name <= '9' ) return strtoul(name, NULL, 0) & SECCOMP_RET_DATA;
+	for( unsigned i = 1; i < 4096; ++i ){
+		const char* en = strerrorname_np(i);
+		if( en && !strcmp(en, name) ) return i;
 	}
+	return 0;
+}
+
+//kill, allow, notify, notify:allow, notify:EACCES, errno, errno:EPERM, errno:1, return -1 if not valid
+//data of notify is the supervisor answer, 0 is EPERM, SECCOMP_NOTIFY_CONTINUE log and let syscall run
+long syscall_action(const char* name){
+	if( !strcmp(name, "kill") ) return SECCOMP_RET_KILL_PROCESS;
+	if( !strcmp(name, "allow") ) return SECCOMP_RET_ALLOW;
+	if( !strcmp(name, "notify") ) return SECCOMP_RET_USER_NOTIF;
+	if( !strcmp(name, "notify:allow") ) return SECCOMP_RET_USER_NOTIF | SECCOMP_NOTIFY_CONTINUE;
+	if( !strncmp(name, "notify:", 7) ){
+		unsigned err = errno_value(&name[7]);
+		if( err && err < 4096 ) return SECCOMP_RET_USER_NOTIF | err;
+	}
+	if( !strcmp(name, "errno") ) return SECCOMP_RET_ERRNO | EPERM;
+	if( !strncmp(name, "errno:", 6) ){
+		unsigned err = errno_value(&name[6]);
+		if( err ) return SECCOMP_RET_ERRNO | err;
+	}
+	dbg_error("invalid seccomp action %s", name);
 	return -1;
 }
 
-struct sock_filter* syscall_ctor(void){
-	struct sock_filter* filter = MANY(struct sock_filter, 16);
-	unsigned isys = 0;
-	filter[isys++] = _LD(offsetof(struct seccomp_data, arch));
-	filter[isys++] = _JNE(offsetof(struct seccomp_data, arch));
-	filter[isys++] = _RET(SECCOMP_RET_KILL);
-	filter[isys++] = _LD(offsetof(struct seccomp_data, nr));
-	mem_header(filter)->len = isys;
-	return filter;
+__private int rule_cond(sysCond_s* cond, const char** pr){
+	const char* r = *pr;
+	char* end;
+	cond->arg = strtoul(r, &end, 10);
+	if( end == r || cond->arg > 5 ) return -1;
+	r = end;
+	if( !strncmp(r, "==", 2) ){
+		cond->op = SECCOMP_COND_EQ;
+		r += 2;
+	}
+	else if( !strncmp(r, "!=", 2) ){
+		cond->op = SECCOMP_COND_NE;
+		r += 2;
+	}
+	else if( *r == '&' ){
+		cond->op = SECCOMP_COND_SET;
+		++r;
+	}
+	else{
+		return -1;
+	}
+	errno = 0;
+	cond->value = strtoull(r, &end, 0);
+	if( errno || end == r ) return -1;
+	*pr = end;
+	return 0;
+}
+
+/*
+ * group of syscall, @name expand to all member that exists in the arch of tree
+ * a member can be another group
+*/
+typedef struct sysGroup{
+	const char* name;
+	const char* member;
+}sysGroup_s;
+
+__private const sysGroup_s SYSCALLGROUP[] = {
+	{ "@basic-io",      "_llseek close close_range dup dup2 dup3 lseek pread64 preadv preadv2 pwrite64 pwritev pwritev2 read readv write writev" },
+	{ "@clock",         "adjtimex clock_adjtime clock_adjtime64 clock_settime clock_settime64 settimeofday stime" },
+	{ "@cpu-emulation", "modify_ldt subpage_prot switch_endian vm86 vm86old" },
+	{ "@debug",         "lookup_dcookie perf_event_open pidfd_getfd ptrace rtas s390_runtime_instr sys_debug_setcontext" },
+	{ "@file-system",   "access chdir chmod close creat faccessat faccessat2 fallocate fchdir fchmod fchmodat fcntl fcntl64 fgetxattr flistxattr fremovexattr fsetxattr fstat fstat64 fstatat64 fstatfs fstatfs64 ftruncate ftruncate64 futimesat getcwd getdents getdents64 getxattr inotify_add_watch inotify_init inotify_init1 inotify_rm_watch lgetxattr link linkat listxattr llistxattr lremovexattr lsetxattr lstat lstat64 mkdir mkdirat mknod mknodat newfstatat oldfstat oldlstat oldstat open openat openat2 readlink readlinkat removexattr rename renameat renameat2 rmdir setxattr stat stat64 statfs statfs64 statx symlink symlinkat truncate truncate64 unlink unlinkat utime utimensat utimensat_time64 utimes" },
+	{ "@io-event",      "_newselect epoll_create epoll_create1 epoll_ctl epoll_ctl_old epoll_pwait epoll_pwait2 epoll_wait epoll_wait_old eventfd eventfd2 poll ppoll ppoll_time64 pselect6 pselect6_time64 select" },
+	{ "@ipc",           "ipc memfd_create mq_getsetattr mq_notify mq_open mq_timedreceive mq_timedreceive_time64 mq_timedsend mq_timedsend_time64 mq_unlink msgctl msgget msgrcv msgsnd pipe pipe2 process_madvise process_vm_readv process_vm_writev semctl semget semop semtimedop semtimedop_time64 shmat shmctl shmdt shmget" },
+	{ "@keyring",       "add_key keyctl request_key" },
+	{ "@module",        "delete_module finit_module init_module" },
+	{ "@mount",         "chroot fsconfig fsmount fsopen fspick mount mount_setattr move_mount open_tree pivot_root umount umount2" },
+	{ "@network-io",    "accept accept4 bind connect getpeername getsockname getsockopt listen recv recvfrom recvmmsg recvmmsg_time64 recvmsg send sendmmsg sendmsg sendto setsockopt shutdown socket socketcall socketpair" },
+	{ "@obsolete",      "_sysctl afs_syscall bdflush break create_module ftime get_kernel_syms getpmsg gtty idle lock mpx prof profil putpmsg query_module security sgetmask ssetmask stty sysfs tuxcall ulimit uselib ustat vserver" },
+	{ "@privileged",    "@clock @module @mount @raw-io @reboot @swap acct bpf chown chown32 fchown fchown32 fchownat lchown lchown32 quotactl setdomainname setfsgid setfsgid32 setfsuid setfsuid32 setgid setgid32 setgroups setgroups32 sethostname setregid setregid32 setresgid setresgid32 setresuid setresuid32 setreuid setreuid32 setuid setuid32 vhangup" },
+	{ "@process",       "capget clone clone3 execve execveat fork getrusage kill pidfd_open pidfd_send_signal prctl rt_sigqueueinfo rt_tgsigqueueinfo setns swapcontext tgkill times tkill unshare vfork wait4 waitid waitpid" },
+	{ "@raw-io",        "ioperm iopl pciconfig_iobase pciconfig_read pciconfig_write s390_pci_mmio_read s390_pci_mmio_write" },
+	{ "@reboot",        "kexec_file_load kexec_load reboot" },
+	{ "@resources",     "ioprio_set mbind migrate_pages move_pages nice sched_setaffinity sched_setattr sched_setparam sched_setscheduler set_mempolicy set_mempolicy_home_node setpriority setrlimit" },
+	{ "@swap",          "swapoff swapon" },
+};
+
+__private const sysGroup_s* group_find(const char* name){
+	for( unsigned i = 0; i < sizeof(SYSCALLGROUP) / sizeof(SYSCALLGROUP[0]); ++i ){
+		if( !strcmp(SYSCALLGROUP[i].name, name) ) return &SYSCALLGROUP[i];
+	}
+	return NULL;
 }
 
-int syscall_add(struct sock_filter** filter, const char* name, unsigned allowDeny){
+//variant of syscall on arch with other abi, same is 1 if argument has same layout
+typedef struct sysAlias{
+	const char* name;
+	const char* alt;
+	unsigned    same;
+}sysAlias_s;
+
+__private const sysAlias_s SYSCALLSUFFIX[] = {
+	{ NULL, "32",      1 },
+	{ NULL, "_time64", 1 },
+	{ NULL, "64",      1 },
+};
+
+//suffix variant with 64 bit argument split in two register or with an extra argument
+__private const char* SYSCALLSPLIT[] = { "truncate64", "ftruncate64", "statfs64", "fstatfs64" };
+
+__private const sysAlias_s SYSCALLALIAS[] = {
+	{ "lseek",      "_llseek",    0 },
+	{ "mmap",       "mmap2",      0 },
+	{ "newfstatat", "fstatat64",  1 },
+	{ "select",     "_newselect", 1 },
+};
+
+//index is the subcall number passed in arg0, linux/net.h and linux/ipc.h
+__private const char* SOCKETCALL[] = {
+	[1]  = "socket",      [2]  = "bind",        [3]  = "connect",    [4]  = "listen",
+	[5]  = "accept",      [6]  = "getsockname", [7]  = "getpeername",[8]  = "socketpair",
+	[9]  = "send",        [10] = "recv",        [11] = "sendto",     [12] = "recvfrom",
+	[13] = "shutdown",    [14] = "setsockopt",  [15] = "getsockopt", [16] = "sendmsg",
+	[17] = "recvmsg",     [18] = "accept4",     [19] = "recvmmsg",   [20] = "sendmmsg",
+};
+
+__private const char* IPCCALL[] = {
+	[1]  = "semop",  [2]  = "semget", [3]  = "semctl", [4]  = "semtimedop",
+	[11] = "msgsnd", [12] = "msgrcv", [13] = "msgget", [14] = "msgctl",
+	[21] = "shmat",  [22] = "shmdt",  [23] = "shmget", [24] = "shmctl",
+};
+
+//action that let syscall run
+__private int action_permissive(unsigned action){
+	unsigned const act = action & SECCOMP_RET_ACTION_FULL;
+	if( act == SECCOMP_RET_ALLOW || act == SECCOMP_RET_LOG ) return 1;
+	return act == SECCOMP_RET_USER_NOTIF && (action & SECCOMP_RET_DATA) == SECCOMP_NOTIFY_CONTINUE;
+}
+
+//push proto as nr, same is 0 when argument of nr can't be checked, return count of pushed
+__private unsigned rule_push(sysRule_s** rule, int nr, const sysRule_s* proto, unsigned same){
+	if( nr < 0 ) return 0;
+	if( !same && proto->ncond && action_permissive(proto->action) ) return 0;
+	unsigned const i = mem_ipush(rule);
+	(*rule)[i]       = *proto;
+	(*rule)[i].nr    = nr;
+	(*rule)[i].group = 0;
+	if( !same ) (*rule)[i].ncond = 0;
+	return 1;
+}
+
+//rule on a subcall of multiplexer, arg0 is the subcall
+__private unsigned rule_mux(sysRule_s** rule, int nr, unsigned sub, const sysRule_s* proto){
+	if( nr < 0 || (proto->ncond && action_permissive(proto->action)) ) return 0;
+	unsigned const i = mem_ipush(rule);
+	(*rule)[i]       = *proto;
+	(*rule)[i].nr    = nr;
+	(*rule)[i].group = 0;
+	(*rule)[i].ncond = 1;
+	(*rule)[i].cond[0] = (sysCond_s){ .arg = 0, .op = SECCOMP_COND_EQ, .value = sub };
+	return 1;
+}
+
+//push proto for name, its variant and multiplexer of arch, return count of pushed
+__private unsigned rule_arch(sysRule_s** rule, const sysArch_s* arch, const char* name, const sysRule_s* proto){
+	unsigned count = rule_push(rule, arch_nr(arch, name), proto, 1);
+	for( unsigned i = 0; i < sizeof_vector(SYSCALLSUFFIX); ++i ){
+		__free char* alt = str_printf("%s%s", name, SYSCALLSUFFIX[i].alt);
+		unsigned same = SYSCALLSUFFIX[i].same;
+		for( unsigned s = 0; same && s < sizeof_vector(SYSCALLSPLIT); ++s ) same = strcmp(SYSCALLSPLIT[s], alt);
+		count += rule_push(rule, arch_nr(arch, alt), proto, same);
+	}
+	for( unsigned i = 0; i < sizeof_vector(SYSCALLALIAS); ++i ){
+		if( !strcmp(SYSCALLALIAS[i].name, name) ) count += rule_push(rule, arch_nr(arch, SYSCALLALIAS[i].alt), proto, SYSCALLALIAS[i].same);
+	}
+	for( unsigned i = 1; i < sizeof_vector(SOCKETCALL); ++i ){
+		if( !strcmp(SOCKETCALL[i], name) ) count += rule_mux(rule, arch_nr(arch, "socketcall"), i, proto);
+	}
+	for( unsigned i = 1; i < sizeof_vector(IPCCALL); ++i ){
+		if( !IPCCALL[i] || strcmp(IPCCALL[i], name) ) continue;
+		int nr = arch_nr(arch, "ipc");
+		count += action_permissive(proto->action) ? rule_mux(rule, nr, i, proto) : rule_push(rule, nr, proto, 0);
+	}
+	return count;
+}
+
+//push a copy of proto for each member of g that exists in arch, return count of pushed
+__private unsigned group_add(sysRule_s** rule, const sysArch_s* arch, const sysGroup_s* g, const sysRule_s* proto, unsigned deep){
+	unsigned count = 0;
+	const char* m = g->member;
+	while( *m ){
+		const char* e = m;
+		while( *e && *e != ' ' ) ++e;
+		__free char* name = str_dup(m, e - m);
+		m = *e ? e + 1 : e;
+		if( *name == '@' ){
+			const sysGroup_s* sub = group_find(name);
+			if( sub && deep < SECCOMP_GROUP_DEEP ) count += group_add(rule, arch, sub, proto, deep + 1);
+			continue;
+		}
+		count += rule_arch(rule, arch, name, proto);
+	}
+	return count;
+}
+
+//@group[=action]
+__private int syscall_group(sysRule_s** rule, const char* token, unsigned action){
+	const char* r = token;
+	while( *r && *r != '=' ) ++r;
+	__free char* name = str_dup(token, r - token);
+	const sysGroup_s* g = group_find(name);
+	if( !g ){
+		dbg_error("syscall group %s not exists", name);
+		return -1;
+	}
+	if( *r == '=' ){
+		long act = syscall_action(r + 1);
+		if( act == -1 ) return -1;
+		action = act;
+	}
+	unsigned const i = mem_ipush(rule);
+	sysRule_s* ru = &(*rule)[i];
+	ru->nr     = 0;
+	ru->id     = i;
+	ru->action = action;
+	ru->group  = g - SYSCALLGROUP + 1;
+	ru->ncond  = 0;
+	return 0;
+}
+
+//name[:arg op value]...[=action], action is the default action of the rule if not set
+//@group[=action] expand the group
+int syscall_add(sysRule_s** rule, const char* token, unsigned action){
+	if( *token == '@' ) return syscall_group(rule, token, action);
+	const char* r = token;
+	while( *r && *r != ':' && *r != '=' ) ++r;
+	__free char* name = str_dup(token, r - token);
 	long nr = syscall_name_to_nr(name);
 	if( nr == -1 ){
 		dbg_error("syscall %s not exists", name);
 		return -1;
 	}
-	*filter = mem_upsize(*filter, 2);
-	unsigned isys = mem_header(*filter)->len;
-	if( allowDeny ){
-		(*filter)[isys++] = _JNE(nr);
-		(*filter)[isys++] = _RET(SECCOMP_RET_KILL_PROCESS);
+	unsigned const i = mem_ipush(rule);
+	sysRule_s* ru = &(*rule)[i];
+	ru->nr     = nr;
+	ru->id     = i;
+	ru->action = action;
+	ru->group  = 0;
+	ru->ncond  = 0;
+	while( *r == ':' ){
+		++r;
+		if( ru->ncond >= SECCOMP_COND_MAX || rule_cond(&ru->cond[ru->ncond++], &r) ) goto ONERR;
 	}
-	else{
-		(*filter)[isys++] = _JEQ(nr);
-		(*filter)[isys++] = _RET(SECCOMP_RET_ALLOW);
+	if( *r == '=' ){
+		long act = syscall_action(r + 1);
+		if( act == -1 ) goto ONERR;
+		ru->action = act;
+	}
+	else if( *r ){
+		goto ONERR;
 	}
-	mem_header(*filter)->len = isys;
 	return 0;
+ONERR:
+	dbg_error("invalid syscall rule %s", token);
+	--mem_header(*rule)->len;
+	return -1;
+}
+
+__private int rule_cmp(const void* a, const void* b){
+	const sysRule_s* ra = a;
+	const sysRule_s* rb = b;
+	if( ra->nr != rb->nr ) return ra->nr < rb->nr ? -1 : 1;
+	return ra->id < rb->id ? -1 : ra->id > rb->id ? 1 : 0;
+}
+
+//rule after an unconditional rule of same syscall are never reached
+__private sysRange_s* range_merge(sysRule_s* rule){
+	unsigned const count = mem_header(rule)->len;
+	sysRange_s* range = MANY(sysRange_s, count + 1);
+	qsort(rule, count, sizeof(sysRule_s), rule_cmp);
+	for( unsigned i = 0; i < count; ){
+		unsigned n = i + 1;
+		while( n < count && rule[n].nr == rule[i].nr ) ++n;
+		unsigned const last = mem_header(range)->len;
+		if( !rule[i].ncond ){
+			if( last && !range[last-1].rule && range[last-1].action == rule[i].action && range[last-1].hi + 1 == rule[i].nr ){
+				range[last-1].hi = rule[i].nr;
+			}
+			else{
+				unsigned r = mem_ipush(&range);
+				range[r] = (sysRange_s){ .lo = rule[i].nr, .hi = rule[i].nr, .action = rule[i].action, .rule = NULL, .nrule = 0 };
+			}
+		}
+		else{
+			unsigned nrule = 0;
+			while( i + nrule < n && rule[i + nrule].ncond ) ++nrule;
+			if( i + nrule < n ) ++nrule;
+			unsigned r = mem_ipush(&range);
+			range[r] = (sysRange_s){ .lo = rule[i].nr, .hi = rule[i].nr, .action = 0, .rule = &rule[i], .nrule = nrule };
+		}
+		i = n;
+	}
+	return range;
+}
+
+__private void bpf_push(struct sock_filter** prog, struct sock_filter ins){
+	unsigned i = mem_ipush(prog);
+	(*prog)[i] = ins;
+}
+
+__private void bpf_append(struct sock_filter** prog, struct sock_filter* src){
+	unsigned const n = mem_header(src)->len;
+	*prog = mem_upsize(*prog, n);
+	memcpy(&(*prog)[mem_header(*prog)->len], src, sizeof(struct sock_filter) * n);
+	mem_header(*prog)->len += n;
+}
+
+__private unsigned rule_size(const sysRule_s* rule){
+	return rule->ncond * SECCOMP_COND_SIZE + 1;
+}
+
+__private unsigned block_size(const sysRange_s* range){
+	if( !range->rule ) return 1;
+	unsigned size = 1;
+	for( unsigned i = 0; i < range->nrule; ++i ) size += rule_size(&range->rule[i]);
+	return size;
+}
+
+//each condition is [ld lo][jmp][ld hi][jmp], fail jump to next rule
+__private void block_rule(struct sock_filter** prog, const sysRule_s* rule){
+	unsigned const size = rule_size(rule);
+	for( unsigned i = 0; i < rule->ncond; ++i ){
+		const sysCond_s* c = &rule->cond[i];
+		unsigned const base  = i * SECCOMP_COND_SIZE;
+		uint32_t const lo    = c->value & 0xFFFFFFFF;
+		uint32_t const hi    = c->value >> 32;
+		unsigned const fail1 = size - (base + 2);
+		unsigned const fail2 = size - (base + 4);
+		bpf_push(prog, _LD(ARG_LO(c->arg)));
+		switch( c->op ){
+			case SECCOMP_COND_EQ:  bpf_push(prog, _JCMP(BPF_JEQ , lo, 0, fail1)); break;
+			case SECCOMP_COND_NE:  bpf_push(prog, _JCMP(BPF_JEQ , lo, 0, 2)); break;
+			case SECCOMP_COND_SET: bpf_push(prog, _JCMP(BPF_JSET, lo, 2, 0)); break;
+		}
+		bpf_push(prog, _LD(ARG_HI(c->arg)));
+		switch( c->op ){
+			case SECCOMP_COND_EQ:  bpf_push(prog, _JCMP(BPF_JEQ , hi, 0, fail2)); break;
+			case SECCOMP_COND_NE:  bpf_push(prog, _JCMP(BPF_JEQ , hi, fail2, 0)); break;
+			case SECCOMP_COND_SET: bpf_push(prog, _JCMP(BPF_JSET, hi, 0, fail2)); break;
+		}
+	}
+	bpf_push(prog, _RET(rule->action));
+}
+
+__private void block(struct sock_filter** prog, const sysRange_s* range, unsigned def){
+	if( range->rule ){
+		for( unsigned i = 0; i < range->nrule; ++i ) block_rule(prog, &range->rule[i]);
+		bpf_push(prog, _RET(def));
+	}
+	else{
+		bpf_push(prog, _RET(range->action));
+	}
+}
+
+__private unsigned leaf_check(const sysRange_s* range, unsigned count){
+	unsigned check = 0;
+	for( unsigned i = 0; i < count; ++i ) check += range[i].lo == range[i].hi ? 1 : 2;
+	return check;
+}
+
+__private unsigned leaf_size(const sysRange_s* range, unsigned count){
+	unsigned size = leaf_check(range, count) + 1;
+	for( unsigned i = 0; i < count; ++i ) size += block_size(&range[i]);
+	return size;
+}
+
+__private int leaf_bitmap_able(const sysRange_s* range, unsigned count){
+	if( range[count-1].hi - range[0].lo >= SECCOMP_BITMAP_BITS || leaf_check(range, count) <= SECCOMP_BITMAP_COST ) return 0;
+	for( unsigned i = 0; i < count; ++i ){
+		if( range[i].rule || range[i].action != range[0].action ) return 0;
+	}
+	return 1;
+}
+
+//A = nr - base, match if A < 32 && (1 << A) & mask
+__private void leaf_bitmap(struct sock_filter** prog, const sysRange_s* range, unsigned count, unsigned def){
+	unsigned const base = range[0].lo;
+	uint32_t mask = 0;
+	for( unsigned i = 0; i < count; ++i ){
+		for( unsigned n = range[i].lo; n <= range[i].hi; ++n ) mask |= 1U << (n - base);
+	}
+	bpf_push(prog, _SUB(base));
+	bpf_push(prog, _JCMP(BPF_JGE, SECCOMP_BITMAP_BITS, 5, 0));
+	bpf_push(prog, _TAX());
+	bpf_push(prog, _LDI(1));
+	bpf_push(prog, _LSHX());
+	bpf_push(prog, _AND(mask));
+	bpf_push(prog, _JCMP(BPF_JEQ, 0, 0, 1));
+	bpf_push(prog, _RET(def));
+	bpf_push(prog, _RET(range[0].action));
+}
+
+//checks, RET def, one block for each range
+__private void leaf_linear(struct sock_filter** prog, const sysRange_s* range, unsigned count, unsigned def){
+	unsigned const check = leaf_check(range, count);
+	unsigned pc = 0;
+	unsigned target = check + 1;
+	for( unsigned i = 0; i < count; ++i ){
+		if( range[i].lo == range[i].hi ){
+			bpf_push(prog, _JCMP(BPF_JEQ, range[i].lo, target - (pc + 1), 0));
+			pc += 1;
+		}
+		else{
+			bpf_push(prog, _JCMP(BPF_JGT, range[i].hi, 1, 0));
+			bpf_push(prog, _JCMP(BPF_JGE, range[i].lo, target - (pc + 2), 0));
+			pc += 2;
+		}
+		target += block_size(&range[i]);
+	}
+	bpf_push(prog, _RET(def));
+	for( unsigned i = 0; i < count; ++i ) block(prog, &range[i], def);
+}
+
+__private struct sock_filter* tree_build(const sysRange_s* range, unsigned count, unsigned def){
+	struct sock_filter* prog = MANY(struct sock_filter, 16);
+	if( !count ){
+		bpf_push(&prog, _RET(def));
+		return prog;
+	}
+	if( leaf_bitmap_able(range, count) ){
+		leaf_bitmap(&prog, range, count, def);
+		return prog;
+	}
+	if( count == 1 || (count <= SECCOMP_LEAF_RANGE && leaf_size(range, count) <= UINT8_MAX) ){
+		leaf_linear(&prog, range, count, def);
+		return prog;
+	}
+	unsigned const mid = count / 2;
+	__free struct sock_filter* lo = tree_build(range, mid, def);
+	__free struct sock_filter* hi = tree_build(&range[mid], count - mid, def);
+	unsigned const nlo = mem_header(lo)->len;
+	if( nlo <= UINT8_MAX ){
+		bpf_push(&prog, _JCMP(BPF_JGE, range[mid].lo, nlo, 0));
+	}
+	else{
+		bpf_push(&prog, _JCMP(BPF_JGE, range[mid].lo, 0, 1));
+		bpf_push(&prog, _JA(nlo));
+	}
+	bpf_append(&prog, lo);
+	bpf_append(&prog, hi);
+	return prog;
+}
+
+//tree of an arch, native nr of rule is translated with name, group is expanded with table of arch
+__private struct sock_filter* arch_tree(const sysArch_s* arch, sysRule_s* rule, unsigned def){
+	if( !arch->count ){
+		struct sock_filter* prog = MANY(struct sock_filter, 1);
+		bpf_push(&prog, _RET(SECCOMP_RET_KILL_PROCESS));
+		return prog;
+	}
+	__free sysRule_s* tr = MANY(sysRule_s, mem_header(rule)->len + 1);
+	mforeach(rule, i){
+		if( rule[i].group ){
+			if( !group_add(&tr, arch, &SYSCALLGROUP[rule[i].group - 1], &rule[i], 0) ){
+				dbg_warning("syscall group %s is empty on %s", SYSCALLGROUP[rule[i].group - 1].name, arch->name);
+			}
+			continue;
+		}
+		rule_arch(&tr, arch, SYSTEMCALLNAME[rule[i].nr], &rule[i]);
+	}
+	__free sysRange_s* range = range_merge(tr);
+	return tree_build(range, mem_header(range)->len, def);
+}
+
+//LD nr, arch with a bit are selected with JGE bit, last is arch without bit
+__private struct sock_filter* arch_block(unsigned audit, sysRule_s* rule, unsigned def){
+	struct sock_filter* prog = MANY(struct sock_filter, 16);
+	__free struct sock_filter* main = NULL;
+	bpf_push(&prog, _LD(offsetof(struct seccomp_data, nr)));
+	for( unsigned a = 0; a < SYSTEMCALLARCHCOUNT; ++a ){
+		if( SYSTEMCALLARCH[a].audit != audit ) continue;
+		if( !SYSTEMCALLARCH[a].bit ){
+			main = arch_tree(&SYSTEMCALLARCH[a], rule, def);
+			continue;
+		}
+		__free struct sock_filter* sub = arch_tree(&SYSTEMCALLARCH[a], rule, def);
+		bpf_push(&prog, _JCMP(BPF_JGE, SYSTEMCALLARCH[a].bit, 1, 0));
+		bpf_push(&prog, _JA(mem_header(sub)->len));
+		bpf_append(&prog, sub);
+	}
+	if( main ){
+		bpf_append(&prog, main);
+	}
+	else{
+		bpf_push(&prog, _RET(SECCOMP_RET_KILL_PROCESS));
+	}
+	return prog;
+}
+
+//def is action of syscall without rule
+struct sock_filter* syscall_compile(sysRule_s* rule, unsigned def){
+	struct sock_filter* filter = MANY(struct sock_filter, 64);
+	bpf_push(&filter, _LD(offsetof(struct seccomp_data, arch)));
+	for( unsigned a = 0; a < SYSTEMCALLARCHCOUNT; ++a ){
+		unsigned const audit = SYSTEMCALLARCH[a].audit;
+		unsigned done = 0;
+		for( unsigned b = 0; b < a && !done; ++b ) done = SYSTEMCALLARCH[b].audit == audit;
+		if( done ) continue;
+		__free struct sock_filter* block = arch_block(audit, rule, def);
+		bpf_push(&filter, _JCMP(BPF_JEQ, audit, 1, 0));
+		bpf_push(&filter, _JA(mem_header(block)->len));
+		bpf_append(&filter, block);
+	}
+	bpf_push(&filter, _RET(SECCOMP_RET_KILL_PROCESS));
+	dbg_info("seccomp %u rule, %u instruction", mem_header(rule)->len, mem_header(filter)->len);
+	return filter;
 }
 
-void syscall_end(struct sock_filter** filter, int allowDeny){
-	unsigned last = mem_ipush(filter);
-	(*filter)[last] = allowDeny ? _RET(SECCOMP_RET_ALLOW) : _RET(SECCOMP_RET_KILL_PROCESS);
+int syscall_notify(struct sock_filter* filter){
+	mforeach(filter, i){
+		if( filter[i].code == (BPF_RET | BPF_K) && (filter[i].k & SECCOMP_RET_ACTION_FULL) == SECCOMP_RET_USER_NOTIF ) return 1;
+	}
+	return 0;
 }
 
-int syscall_apply(struct sock_filter* filter){
+//return listener fd with SECCOMP_FILTER_FLAG_NEW_LISTENER, 0 without, -1 on error
+int syscall_apply(struct sock_filter* filter, unsigned flags){
 	struct sock_fprog prog = {
 		.len    = mem_header(filter)->len,
 		.filter = filter,
 	};
-	if( prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog) ){
-		dbg_error("prctl(SECCOMP): %m");
+	int ret = syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, flags, &prog);
+	if( ret < 0 ){
+		dbg_error("seccomp: %m");
 		return -1;
 	}
-	return 0;
+	return ret;
 }
 
-int systemcall_deny(char** sys, unsigned const count){
-	__free struct sock_filter* filter = MANY(struct sock_filter, 4 + count*2 + 1);
-	unsigned isys = 0;
-	filter[isys++] = _LD(offsetof(struct seccomp_data, arch));
-	filter[isys++] = _JNE(offsetof(struct seccomp_data, arch));
-	filter[isys++] = _RET(SECCOMP_RET_KILL);
-	filter[isys++] = _LD(offsetof(struct seccomp_data, nr));
-	for( unsigned i = 0; i < count; ++i ){
-		long nr = syscall_name_to_nr(sys[i]);
-		if( nr == -1 ){
-			dbg_error("unknow systemcall  %s", sys[i]);
-			return -1;
+//futex is called in sandbox only if filter allow it, otherwise supervisor wake on SECCOMP_LISTENER_WAIT and sandbox spin
+__private int futex_allowed(struct sock_filter* filter, int* addr, int op){
+	struct seccomp_data data = { .nr = SYS_futex, .arch = HESTIA_AUDIT_ARCH, .args = { (uintptr_t)addr, op } };
+	return (syscall_eval(filter, &data) & SECCOMP_RET_ACTION_FULL) == SECCOMP_RET_ALLOW;
+}
+
+//called in sandbox after filter is applied, jailed process can do only syscall allowed by filter here
+//wait until supervisor has taken own copy of fd, listener is CLOEXEC and is released with exec
+void syscall_listener_send(seccompListener_s* l, int fd, struct sock_filter* filter){
+	__atomic_store_n(&l->fd, fd, __ATOMIC_RELEASE);
+	if( futex_allowed(filter, &l->fd, FUTEX_WAKE) ) syscall(SYS_futex, &l->fd, FUTEX_WAKE, 1, NULL, NULL, 0);
+	if( futex_allowed(filter, &l->taken, FUTEX_WAIT) ){
+		struct timespec ts = { .tv_sec = SECCOMP_LISTENER_TIMEOUT };
+		while( !__atomic_load_n(&l->taken, __ATOMIC_ACQUIRE) ){
+			if( syscall(SYS_futex, &l->taken, FUTEX_WAIT, 0, &ts, NULL, 0) && errno == ETIMEDOUT ) break;
 		}
-		dbg_info("deny %s", sys[i]);
-		filter[isys++] = _JNE(nr);
-		filter[isys++] = _RET(SECCOMP_RET_KILL_PROCESS);
+		return;
 	}
-	filter[isys++] = _RET(SECCOMP_RET_ALLOW);
-	
-	struct sock_fprog prog = {
-		.len    = isys,
-		.filter = filter,
-	};
+	struct timespec st;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &st);
+	while( !__atomic_load_n(&l->taken, __ATOMIC_ACQUIRE) ){
+		//vdso, not trapped by seccomp
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if( now.tv_sec - st.tv_sec > SECCOMP_LISTENER_TIMEOUT ) break;
+		cpu_relax();
+	}
+}
+
+//called from supervisor, return a copy of listener or -1 if process end before apply the filter
+//sleep on futex of fd, timeout is only for check end of process or a sandbox that can't wake
+int syscall_listener_take(seccompListener_s* l, int pidfd){
+	int fd;
+	while( (fd=__atomic_load_n(&l->fd, __ATOMIC_ACQUIRE)) < 0 ){
+		struct pollfd pfd = { .fd = pidfd, .events = POLLIN };
+		if( poll(&pfd, 1, 0) > 0 ) return -1;
+		struct timespec ts = { .tv_nsec = SECCOMP_LISTENER_WAIT * 1000000L };
+		syscall(SYS_futex, &l->fd, FUTEX_WAIT, -1, &ts, NULL, 0);
+	}
+	int ret = syscall(SYS_pidfd_getfd, pidfd, fd, 0);
+	if( ret < 0 ){
+		dbg_error("pidfd_getfd: %m");
+	}
+	__atomic_store_n(&l->taken, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &l->taken, FUTEX_WAKE, 1, NULL, NULL, 0);
+	return ret;
+}
+
+//answer to each notified syscall with the notify action of rule, filter is evaluated again on data of notify
+//return when all process of filter are gone
+void syscall_supervisor(int fd, struct sock_filter* filter){
+	struct seccomp_notif_sizes sz;
+	if( syscall(SYS_seccomp, SECCOMP_GET_NOTIF_SIZES, 0, &sz) ){
+		dbg_error("seccomp notify sizes: %m");
+		return;
+	}
+	__free char* breq  = MANY(char, sz.seccomp_notif > sizeof(struct seccomp_notif) ? sz.seccomp_notif : sizeof(struct seccomp_notif));
+	__free char* bresp = MANY(char, sz.seccomp_notif_resp > sizeof(struct seccomp_notif_resp) ? sz.seccomp_notif_resp : sizeof(struct seccomp_notif_resp));
+	struct seccomp_notif*      req  = (struct seccomp_notif*)breq;
+	struct seccomp_notif_resp* resp = (struct seccomp_notif_resp*)bresp;
+	while( 1 ){
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		if( poll(&pfd, 1, -1) < 0 ){
+			if( errno == EINTR ) continue;
+			break;
+		}
+		if( pfd.revents & (POLLHUP | POLLERR) ) break;
+		memset(req, 0, sz.seccomp_notif);
+		if( ioctl(fd, SECCOMP_IOCTL_NOTIF_RECV, req) ){
+			//ENOENT, target is gone before answer
+			if( errno == EINTR || errno == ENOENT ) continue;
+			break;
+		}
+		unsigned action = syscall_eval(filter, &req->data);
+		//not a notify of this filter, answer as plain notify
+		if( (action & SECCOMP_RET_ACTION_FULL) != SECCOMP_RET_USER_NOTIF ) action = SECCOMP_RET_USER_NOTIF;
+		unsigned data = action & SECCOMP_RET_DATA;
+		memset(resp, 0, sz.seccomp_notif_resp);
+		resp->id = req->id;
+		if( data == SECCOMP_NOTIFY_CONTINUE ){
+			resp->flags = SECCOMP_USER_NOTIF_FLAG_CONTINUE;
+		}
+		else{
+			resp->error = -(int)(data ? data : EPERM);
+		}
+		char buf[64];
+		const char* name = req->data.nr >= 0 && (unsigned)req->data.nr < SYSTEMCALLNAMECOUNT && SYSTEMCALLNAME[req->data.nr] ? SYSTEMCALLNAME[req->data.nr] : "?";
+		fprintf(stderr, "hestia: seccomp notify pid %u %s(0x%llx, 0x%llx, 0x%llx, 0x%llx, 0x%llx, 0x%llx) %s\n",
+			req->pid, name,
+			req->data.args[0], req->data.args[1], req->data.args[2],
+			req->data.args[3], req->data.args[4], req->data.args[5],
+			syscall_action_name(action, buf, sizeof buf)
+		);
+		if( ioctl(fd, SECCOMP_IOCTL_NOTIF_SEND, resp) && errno != ENOENT ){
+			dbg_error("seccomp notify send: %m");
+		}
+	}
+}
+
+/*
+ * local interpreter of classic bpf as seccomp run it, used for check a filter without apply it
+ * invalid instruction or jump out of program return SECCOMP_RET_KILL_PROCESS
+*/
+unsigned syscall_eval(struct sock_filter* filter, const struct seccomp_data* data){
+	unsigned const len = mem_header(filter)->len;
+	uint32_t A = 0;
+	uint32_t X = 0;
+	uint32_t M[BPF_MEMWORDS] = {0};
+	for( unsigned pc = 0; pc < len; ++pc ){
+		const struct sock_filter* i = &filter[pc];
+		uint32_t const src = BPF_SRC(i->code) == BPF_X ? X : i->k;
+		switch( BPF_CLASS(i->code) ){
+			case BPF_LD:
+				switch( BPF_MODE(i->code) ){
+					case BPF_ABS:
+						if( BPF_SIZE(i->code) != BPF_W || i->k % sizeof(uint32_t) || i->k + sizeof(uint32_t) > sizeof(struct seccomp_data) ) goto ONERR;
+						memcpy(&A, (const char*)data + i->k, sizeof A);
+					break;
+					case BPF_IMM: A = i->k; break;
+					case BPF_MEM: if( i->k >= BPF_MEMWORDS ) goto ONERR; A = M[i->k]; break;
+					case BPF_LEN: A = sizeof(struct seccomp_data); break;
+					default: goto ONERR;
+				}
+			break;
+			case BPF_LDX:
+				switch( BPF_MODE(i->code) ){
+					case BPF_IMM: X = i->k; break;
+					case BPF_MEM: if( i->k >= BPF_MEMWORDS ) goto ONERR; X = M[i->k]; break;
+					case BPF_LEN: X = sizeof(struct seccomp_data); break;
+					default: goto ONERR;
+				}
+			break;
+			case BPF_ST:  if( i->k >= BPF_MEMWORDS ) goto ONERR; M[i->k] = A; break;
+			case BPF_STX: if( i->k >= BPF_MEMWORDS ) goto ONERR; M[i->k] = X; break;
+			case BPF_ALU:
+				switch( BPF_OP(i->code) ){
+					case BPF_ADD: A += src; break;
+					case BPF_SUB: A -= src; break;
+					case BPF_MUL: A *= src; break;
+					case BPF_DIV: if( !src ) return 0; A /= src; break;
+					case BPF_MOD: if( !src ) return 0; A %= src; break;
+					case BPF_OR:  A |= src; break;
+					case BPF_AND: A &= src; break;
+					case BPF_XOR: A ^= src; break;
+					case BPF_LSH: A = src < 32 ? A << src : 0; break;
+					case BPF_RSH: A = src < 32 ? A >> src : 0; break;
+					case BPF_NEG: A = -A; break;
+					default: goto ONERR;
+				}
+			break;
+			case BPF_JMP:{
+				unsigned jmp;
+				switch( BPF_OP(i->code) ){
+					case BPF_JA:   jmp = i->k; break;
+					case BPF_JEQ:  jmp = A == src ? i->jt : i->jf; break;
+					case BPF_JGT:  jmp = A >  src ? i->jt : i->jf; break;
+					case BPF_JGE:  jmp = A >= src ? i->jt : i->jf; break;
+					case BPF_JSET: jmp = A &  src ? i->jt : i->jf; break;
+					default: goto ONERR;
+				}
+				if( jmp >= len - pc - 1 ) goto ONERR;
+				pc += jmp;
+			}
+			break;
+			case BPF_RET: return BPF_RVAL(i->code) == BPF_A ? A : i->k;
+			case BPF_MISC:
+				if( BPF_MISCOP(i->code) == BPF_TAX ) X = A;
+				else A = X;
+			break;
+		}
+	}
+ONERR:
+	dbg_error("invalid bpf program");
+	return SECCOMP_RET_KILL_PROCESS;
+}
+
+const char* syscall_action_name(unsigned action, char* buf, size_t size){
+	switch( action & SECCOMP_RET_ACTION_FULL ){
+		case SECCOMP_RET_KILL_PROCESS: return "kill";
+		case SECCOMP_RET_KILL_THREAD:  return "kill_thread";
+		case SECCOMP_RET_TRAP:         return "trap";
+		case SECCOMP_RET_USER_NOTIF:{
+			unsigned data = action & SECCOMP_RET_DATA;
+			if( !data ) return "notify";
+			if( data == SECCOMP_NOTIFY_CONTINUE ) return "notify:allow";
+			const char* en = strerrorname_np(data);
+			if( en ) snprintf(buf, size, "notify:%s", en);
+			else snprintf(buf, size, "notify:%u", data);
+			return buf;
+		}
+		case SECCOMP_RET_TRACE:        return "trace";
+		case SECCOMP_RET_LOG:          return "log";
+		case SECCOMP_RET_ALLOW:        return "allow";
+		case SECCOMP_RET_ERRNO:{
+			const char* en = strerrorname_np(action & SECCOMP_RET_DATA);
+			if( en ) snprintf(buf, size, "errno:%s", en);
+			else snprintf(buf, size, "errno:%u", action & SECCOMP_RET_DATA);
+			return buf;
+		}
+	}
+	return "invalid";
+}
 
-	if( prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog) ){
-		dbg_error("prctl(SECCOMP): %m");
+//spec is [arch/]name[:arg]..., print action of filter for it, return -1 if spec is not valid
+int syscall_test(struct sock_filter* filter, const char* spec, FILE* out){
+	const sysArch_s* arch = SYSTEMCALLARCH;
+	const char* sep = strchr(spec, '/');
+	if( sep ){
+		arch = NULL;
+		for( unsigned a = 0; a < SYSTEMCALLARCHCOUNT; ++a ){
+			if( strlen(SYSTEMCALLARCH[a].name) == (size_t)(sep - spec) && !strncmp(SYSTEMCALLARCH[a].name, spec, sep - spec) ){
+				arch = &SYSTEMCALLARCH[a];
+				break;
+			}
+		}
+		if( !arch ){
+			dbg_error("unknown arch in %s", spec);
+			return -1;
+		}
+		spec = sep + 1;
+	}
+	const char* end = strchr(spec, ':');
+	__free char* name = end ? str_dup(spec, end - spec) : str_dup(spec, 0);
+	int nr = arch_nr(arch, name);
+	if( nr < 0 ){
+		dbg_error("syscall %s not exists in %s", name, arch->name);
 		return -1;
 	}
+	struct seccomp_data data = { .nr = nr, .arch = arch->audit };
+	for( unsigned i = 0; end && i < 6; ++i ){
+		char* next;
+		data.args[i] = strtoull(end + 1, &next, 0);
+		end = *next == ':' ? next : NULL;
+	}
+	char buf[64];
+	fprintf(out, "%s/%s(%llx, %llx, %llx, %llx, %llx, %llx) %s\n", arch->name, name,
+		data.args[0], data.args[1], data.args[2], data.args[3], data.args[4], data.args[5],
+		syscall_action_name(syscall_eval(filter, &data), buf, sizeof buf)
+	);
 	return 0;
 }
 
-//sudo mount -t cgroup2 none /sys/fs/cgroup
-//cat /sys/fs/cgroup/cgroup.controllers
+int systemcall_deny(char** sys, unsigned const count){
+	__free sysRule_s* rule = MANY(sysRule_s, count + 1);
+	for( unsigned i = 0; i < count; ++i ){
+		if( syscall_add(&rule, sys[i], SECCOMP_RET_KILL_PROCESS) ) return -1;
+		dbg_info("deny %s", sys[i]);
+	}
+	__free struct sock_filter* filter = syscall_compile(rule, SECCOMP_RET_ALLOW);
+	return syscall_apply(filter, 0) < 0 ? -1 : 0;
+}
+
+/*
+ * cgroup v2
+ *	each sandbox has own group HESTIA_CGROUP_DIR/name under the cgroup2 mount
+ *	HESTIA_CGROUP_DIR has no process, controller can be enabled in its subtree
+ *	group is removed when sandbox end, leftover process are killed with cgroup.kill
+*/
+
+#define CGROUP_RMDIR_RETRY 50
 
-//mkdir /sys/fs/cgroup/disable_disks
-//echo '+devices' > /sys/fs/cgroup/disable_disks/cgroup.subtree_control
-//
-//echo "b 8:* rwm" > /sys/fs/cgroup/disable_disks/devices.deny
-//echo <PID> > /sys/fs/cgroup/disable_disks/cgroup.procs
-//rmdir altrimenti non cancella
+//mountpoint of cgroup2, on hybrid system is not /sys/fs/cgroup
+__private char* cgroup_root(void){
+	FILE* f = fopen("/proc/self/mounts", "r");
+	if( !f ) return NULL;
+	char* root = NULL;
+	char line[PATH_MAX * 2];
+	while( !root && fgets(line, sizeof line, f) ){
+		char dst[PATH_MAX];
+		char type[64];
+		if( sscanf(line, "%*s %4095s %63s", dst, type) == 2 && !strcmp(type, "cgroup2") ) root = str_dup(dst, 0);
+	}
+	fclose(f);
+	return root;
+}
+
+__private void cgroup_controller(const char* group){
+	__private const char* CONTROLLER[] = { "+cpu", "+memory", "+io", "+pids" };
+	for( unsigned i = 0; i < sizeof_vector(CONTROLLER); ++i ){
+		if( cgroup_rule(group, "cgroup.subtree_control", CONTROLLER[i], 0) ){
+			dbg_warning("controller %s not available in %s", &CONTROLLER[i][1], group);
+		}
+	}
+}
 
 char* cgroup_new(const char* name){
-	char* group = str_printf("/sys/fs/cgroup/%s", name);
-	if( !dir_exists(group) ) mk_dir(group, 755);
+	__free char* root = cgroup_root();
+	if( !root ){
+		dbg_error("cgroup2 is not mounted");
+		return NULL;
+	}
+	__free char* parent = str_printf("%s/%s", root, HESTIA_CGROUP_DIR);
+	if( !dir_exists(parent) ){
+		if( mkdir(parent, 0755) && errno != EEXIST ){
+			dbg_error("mkdir %s: %m", parent);
+			return NULL;
+		}
+		cgroup_controller(root);
+		cgroup_controller(parent);
+	}
+	char* group = str_printf("%s/%s", parent, name);
+	if( mkdir(group, 0755) && errno != EEXIST ){
+		dbg_error("mkdir %s: %m", group);
+		mem_free(group);
+		return NULL;
+	}
 	return group;
 }
 
@@ -135,9 +957,16 @@ int cgroup_delete(char* group){
 		mem_free(group);
 		return 0;
 	}
-	if( rmdir(group) ){
-		dbg_error("fail to delete cgroup: %m");
-		return -1;
+	//sandbox init is dead, only orphan of a not empty group can stay
+	__free char* kill = str_printf("%s/cgroup.kill", group);
+	if( !access(kill, F_OK) ) cgroup_rule(group, "cgroup.kill", "1", 0);
+	unsigned retry = CGROUP_RMDIR_RETRY;
+	while( rmdir(group) ){
+		if( errno != EBUSY || !--retry ){
+			dbg_error("fail to delete cgroup %s: %m", group);
+			return -1;
+		}
+		delay_ms(10);
 	}
 	mem_free(group);
 	return 0;
@@ -146,13 +975,15 @@ int cgroup_delete(char* group){
 int cgroup_rule(const char* group, const char* dest, const char* rule, int add){
 	__free char* dev = str_printf("%s/%s", group, dest);
 	const char* mode = add ? "a" : "w";
-	FILE* f = fopen(dest, mode);
+	FILE* f = fopen(dev, mode);
 	if( !f ){
-		dbg_error("on open file %s:: %m", dest);
+		dbg_error("on open file %s:: %m", dev);
 		return -1;
 	}
+	//cgroup file report error on write, stdio buffer hide it until close
+	setvbuf(f, NULL, _IONBF, 0);
 	if( fprintf(f, "%s\n", rule) < 0 ){
-		dbg_error("write new rule %s: %m", rule);
+		dbg_error("write %s in %s: %m", rule, dev);
 		fclose(f);
 		return -1;
 	}
@@ -160,12 +991,192 @@ int cgroup_rule(const char* group, const char* dest, const char* rule, int add){
 	return 0;
 }
 
+//pid 0 is the caller
 int cgroup_apply(const char* group, unsigned pid){
 	char spid[64];
 	sprintf(spid, "%u", pid);
 	return cgroup_rule(group, "cgroup.procs", spid, 1);
 }
 
+//send sig to each process of group, return count of signaled
+unsigned cgroup_signal(const char* group, int sig){
+	__free char* procs = str_printf("%s/cgroup.procs", group);
+	FILE* f = fopen(procs, "r");
+	if( !f ){
+		dbg_error("open %s: %m", procs);
+		return 0;
+	}
+	unsigned count = 0;
+	int pid;
+	while( fscanf(f, "%d", &pid) == 1 ){
+		if( !kill(pid, sig) ) ++count;
+	}
+	fclose(f);
+	return count;
+}
+
+//cpu time of all process of group in usec, user + system, -1 on error
+long cgroup_cpu_usage(const char* group){
+	__free char* stat = str_printf("%s/cpu.stat", group);
+	FILE* f = fopen(stat, "r");
+	if( !f ) return -1;
+	long usage = -1;
+	char key[64];
+	long value;
+	while( fscanf(f, "%63s %ld", key, &value) == 2 ){
+		if( !strcmp(key, "usage_usec") ){
+			usage = value;
+			break;
+		}
+	}
+	fclose(f);
+	return usage;
+}
+
+//fd for clone3 CLONE_INTO_CGROUP
+int cgroup_open(const char* group){
+	int fd = open(group, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if( fd == -1 ){
+		dbg_error("open cgroup %s: %m", group);
+	}
+	return fd;
+}
+
+//clone3 without stack is a fork in new mount and pid namespace, return 0 in child
+//pidfd is set if not NULL, with cgroup != -1 child start inside the group
+//with userns child is also in new user namespace, it has not id until parent call userns_map
+//kernel before 5.3 has not clone3, cgroup fail with EINVAL as without CLONE_INTO_CGROUP and child is a clone
+//pidfd is opened after clone, before 5.3 it is -1 and caller wait pid
+pid_t sandbox_fork(int* pidfd, int cgroup, int userns){
+	struct clone_args ca = {
+		.flags       = CLONE_NEWNS | CLONE_NEWPID | (userns ? CLONE_NEWUSER : 0),
+		.exit_signal = SIGCHLD
+	};
+	if( pidfd ){
+		ca.flags |= CLONE_PIDFD;
+		ca.pidfd  = (uintptr_t)pidfd;
+	}
+	if( cgroup != -1 ){
+		ca.flags |= CLONE_INTO_CGROUP;
+		ca.cgroup = cgroup;
+	}
+	pid_t pid = syscall(SYS_clone3, &ca, sizeof ca);
+	if( pid != -1 || errno != ENOSYS ) return pid;
+	if( cgroup != -1 ){
+		errno = EINVAL;
+		return -1;
+	}
+	dbg_warning("clone3 not available, fallback to clone");
+	unsigned long const flags = (ca.flags & ~CLONE_PIDFD) | SIGCHLD;
+#ifdef __s390x__
+	pid = syscall(SYS_clone, NULL, flags, NULL, NULL, 0);
+#else
+	pid = syscall(SYS_clone, flags, NULL, NULL, NULL, 0);
+#endif
+	if( pid > 0 && pidfd && (*pidfd=syscall(SYS_pidfd_open, pid, 0)) == -1 ){
+		dbg_warning("pidfd_open: %m");
+	}
+	return pid;
+}
+
+__private int proc_write(pid_t pid, const char* name, const char* value){
+	__free char* path = str_printf("/proc/%d/%s", pid, name);
+	int fd = open(path, O_WRONLY | O_CLOEXEC);
+	if( fd == -1 ){
+		dbg_error("open %s: %m", path);
+		return -1;
+	}
+	ssize_t const len = strlen(value);
+	ssize_t const nw  = write(fd, value, len);
+	close(fd);
+	if( nw != len ){
+		dbg_error("write %s: %m", path);
+		return -1;
+	}
+	return 0;
+}
+
+//unprivileged process can map only itself, caller is uid:gid inside user namespace of pid
+int userns_map(pid_t pid, uid_t uid, gid_t gid){
+	__free char* umap = str_printf("%u %u 1", uid, getuid());
+	__free char* gmap = str_printf("%u %u 1", gid, getgid());
+	if( proc_write(pid, "setgroups", "deny") ) return -1;
+	if( proc_write(pid, "uid_map", umap) ) return -1;
+	if( proc_write(pid, "gid_map", gmap) ) return -1;
+	return 0;
+}
+
+//on disk from is seen as to and to as from, all other id are identity, id -1 can't be mapped
+__private char* idmap_swap(unsigned from, unsigned to){
+	if( from == to ) return str_printf("0 0 %u", UINT_MAX);
+	unsigned const lo = from < to ? from : to;
+	unsigned const hi = from < to ? to : from;
+	char* map = str_printf("%u %u 1\n%u %u 1", from, to, to, from);
+	if( lo ){
+		char* m = str_printf("%s\n0 0 %u", map, lo);
+		mem_free(map);
+		map = m;
+	}
+	if( hi - lo > 1 ){
+		char* m = str_printf("%s\n%u %u %u", map, lo + 1, lo + 1, hi - lo - 1);
+		mem_free(map);
+		map = m;
+	}
+	if( hi < UINT_MAX - 1 ){
+		char* m = str_printf("%s\n%u %u %u", map, hi + 1, hi + 1, UINT_MAX - 1 - hi);
+		mem_free(map);
+		map = m;
+	}
+	return map;
+}
+
+//user namespace used as idmap of mount, a child is created only to own the namespace
+//child tell its pid as seen from /proc, sandbox can be in a pid namespace different from /proc
+int userns_idmap(uid_t ufrom, uid_t uto, gid_t gfrom, gid_t gto){
+	int sync[2];
+	if( pipe2(sync, O_CLOEXEC) ){
+		dbg_error("pipe: %m");
+		return -1;
+	}
+	struct clone_args ca = {
+		.flags       = CLONE_NEWUSER,
+		.exit_signal = SIGCHLD
+	};
+	pid_t pid = syscall(SYS_clone3, &ca, sizeof ca);
+	if( !pid ){
+		char self[32] = {0};
+		ssize_t len = readlink("/proc/self", self, sizeof self - 1);
+		//parent read end of pipe on failure and never wait a child that can't write
+		if( len <= 0 || write(sync[1], self, len) != len ) _exit(1);
+		close(sync[1]);
+		for(;;) pause();
+	}
+	close(sync[1]);
+	if( pid == -1 ){
+		dbg_error("clone user namespace: %m");
+		close(sync[0]);
+		return -1;
+	}
+	int fd = -1;
+	char self[32] = {0};
+	if( read(sync[0], self, sizeof self - 1) > 0 ){
+		pid_t const ppid = strtol(self, NULL, 10);
+		__free char* umap = idmap_swap(ufrom, uto);
+		__free char* gmap = idmap_swap(gfrom, gto);
+		__free char* ns   = str_printf("/proc/%d/ns/user", ppid);
+		if( !proc_write(ppid, "uid_map", umap) && !proc_write(ppid, "gid_map", gmap) && (fd=open(ns, O_RDONLY | O_CLOEXEC)) == -1 ){
+			dbg_error("open %s: %m", ns);
+		}
+	}
+	else{
+		dbg_error("idmap child not ready");
+	}
+	close(sync[0]);
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	return fd;
+}
+
 __private int pivot_root(const char *new_root, const char *put_old){
     return syscall(SYS_pivot_root, new_root, put_old);
 }
@@ -204,6 +1215,16 @@ int change_root(const char* path){
 	return 0;
 }
 
+//unprivileged user namespace write deny before gid_map, supplementary groups can't change
+__private int setgroups_denied(void){
+	char buf[8] = {0};
+	int fd = open("/proc/self/setgroups", O_RDONLY | O_CLOEXEC);
+	if( fd == -1 ) return 0;
+	ssize_t nr = read(fd, buf, sizeof buf - 1);
+	close(fd);
+	return nr > 0 && !strncmp(buf, "deny", 4);
+}
+
 int privilege_drop(uid_t uid, gid_t gid ){
 	dbg_info("drop privilege to: %u@%u", uid, gid);
 	gid_t groups[1024];
@@ -226,7 +1247,10 @@ int privilege_drop(uid_t uid, gid_t gid ){
 		return -1;
 	}
 	
-	if( setgroups(totalgroups,groups) < 0 ){
+	if( setgroups_denied() ){
+		dbg_warning("setgroups denied in user namespace, keep groups");
+	}
+	else if( setgroups(totalgroups,groups) < 0 ){
 		dbg_error("setgroups: %m");
 		return -1;
 	}
@@ -0,0 +1,278 @@
+#define _GNU_SOURCE
+#include <notstd/core.h>
+#include <notstd/str.h>
+
+#include <hestia/inutility.h>
+#include <hestia/teardown.h>
+
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+
+/*
+ * minimal io_uring, only unlinkat is submitted
+ * ring fd -1 mean io_uring is not available and unlinkat is called in place
+ * each pending sqe remember its arguments, kernel without IORING_OP_UNLINKAT are retried in place
+*/
+typedef struct uring{
+	int                  fd;
+	unsigned             pending;
+	unsigned             removed;
+	int                  pfd[HESTIA_TEARDOWN_RING];
+	int                  pflags[HESTIA_TEARDOWN_RING];
+	const char*          pname[HESTIA_TEARDOWN_RING];
+	unsigned*            sqtail;
+	unsigned*            sqmask;
+	unsigned*            sqarray;
+	struct io_uring_sqe* sqe;
+	unsigned*            cqhead;
+	unsigned*            cqtail;
+	unsigned*            cqmask;
+	struct io_uring_cqe* cqe;
+	void*                ring;
+	size_t               ringsize;
+	size_t               sqesize;
+}uring_s;
+
+__private void uring_ctor(uring_s* r){
+	memset(r, 0, sizeof *r);
+	struct io_uring_params p;
+	memset(&p, 0, sizeof p);
+	r->fd = syscall(SYS_io_uring_setup, HESTIA_TEARDOWN_RING, &p);
+	if( r->fd < 0 ){
+		dbg_warning("io_uring not available: %m");
+		r->fd = -1;
+		return;
+	}
+	if( !(p.features & IORING_FEAT_SINGLE_MMAP) ){
+		dbg_warning("io_uring without single mmap");
+		goto ONERR;
+	}
+	size_t sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cqsize = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->ringsize = sqsize > cqsize ? sqsize : cqsize;
+	r->ring = mmap(NULL, r->ringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if( r->ring == MAP_FAILED ){
+		r->ring = NULL;
+		goto ONERR;
+	}
+	r->sqesize = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqe = mmap(NULL, r->sqesize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if( r->sqe == MAP_FAILED ){
+		r->sqe = NULL;
+		goto ONERR;
+	}
+	r->sqtail  = r->ring + p.sq_off.tail;
+	r->sqmask  = r->ring + p.sq_off.ring_mask;
+	r->sqarray = r->ring + p.sq_off.array;
+	r->cqhead  = r->ring + p.cq_off.head;
+	r->cqtail  = r->ring + p.cq_off.tail;
+	r->cqmask  = r->ring + p.cq_off.ring_mask;
+	r->cqe     = r->ring + p.cq_off.cqes;
+	return;
+ONERR:
+	dbg_warning("io_uring map fail: %m");
+	if( r->ring ) munmap(r->ring, r->ringsize);
+	close(r->fd);
+	r->fd = -1;
+}
+
+__private void uring_dtor(uring_s* r){
+	if( r->fd == -1 ) return;
+	munmap(r->sqe, r->sqesize);
+	munmap(r->ring, r->ringsize);
+	close(r->fd);
+}
+
+__private void unlink_now(uring_s* r, int dirfd, const char* name, int flags){
+	if( !unlinkat(dirfd, name, flags) ){
+		++r->removed;
+	}
+	else if( errno != ENOENT ){
+		dbg_warning("unlinkat %s: %m", name);
+	}
+}
+
+//submit all pending and wait completion, name passed to uring_unlink need to be valid until flush
+__private void uring_flush(uring_s* r){
+	if( !r->pending ) return;
+	unsigned wait = r->pending;
+	r->pending = 0;
+	while( syscall(SYS_io_uring_enter, r->fd, wait, wait, IORING_ENTER_GETEVENTS, NULL, 0) < 0 ){
+		if( errno != EINTR ){
+			dbg_error("io_uring_enter: %m");
+			return;
+		}
+	}
+	int unsupported = 0;
+	unsigned head = *r->cqhead;
+	while( head != __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE) ){
+		struct io_uring_cqe* cqe = &r->cqe[head & *r->cqmask];
+		unsigned id = cqe->user_data;
+		if( cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP ){
+			unsupported = 1;
+			unlink_now(r, r->pfd[id], r->pname[id], r->pflags[id]);
+		}
+		else if( !cqe->res ){
+			++r->removed;
+		}
+		else if( cqe->res != -ENOENT ){
+			dbg_warning("unlinkat: %s", strerror(-cqe->res));
+		}
+		++head;
+	}
+	__atomic_store_n(r->cqhead, head, __ATOMIC_RELEASE);
+	if( unsupported ){
+		dbg_warning("io_uring unlinkat not supported, fallback to unlinkat");
+		uring_dtor(r);
+		r->fd = -1;
+	}
+}
+
+__private void uring_unlink(uring_s* r, int dirfd, const char* name, int flags){
+	if( r->fd == -1 ){
+		unlink_now(r, dirfd, name, flags);
+		return;
+	}
+	if( r->pending == HESTIA_TEARDOWN_RING ){
+		uring_flush(r);
+		if( r->fd == -1 ){
+			unlink_now(r, dirfd, name, flags);
+			return;
+		}
+	}
+	unsigned tail = *r->sqtail;
+	unsigned idx  = tail & *r->sqmask;
+	struct io_uring_sqe* sqe = &r->sqe[idx];
+	memset(sqe, 0, sizeof *sqe);
+	sqe->opcode       = IORING_OP_UNLINKAT;
+	sqe->fd           = dirfd;
+	sqe->addr         = (uintptr_t)name;
+	sqe->unlink_flags = flags;
+	sqe->user_data    = r->pending;
+	r->pfd[r->pending]    = dirfd;
+	r->pname[r->pending]  = name;
+	r->pflags[r->pending] = flags;
+	r->sqarray[idx]   = idx;
+	__atomic_store_n(r->sqtail, tail + 1, __ATOMIC_RELEASE);
+	++r->pending;
+}
+
+//remove all content of dirfd, return count of entry really removed, failed unlink are not counted
+__private unsigned dir_clean(uring_s* r, int dirfd){
+	__free char* buf = MANY(char, HESTIA_TEARDOWN_DENTS);
+	unsigned start = r->removed;
+	ssize_t nr;
+	while( (nr=getdents64(dirfd, buf, HESTIA_TEARDOWN_DENTS)) > 0 ){
+		for( ssize_t off = 0; off < nr; ){
+			struct dirent64* ent = (struct dirent64*)&buf[off];
+			off += ent->d_reclen;
+			if( !strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..") ) continue;
+			unsigned type = ent->d_type;
+			if( type == DT_UNKNOWN ){
+				struct stat st;
+				if( fstatat(dirfd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) ) continue;
+				type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+			}
+			if( type == DT_DIR ){
+				int sub = openat(dirfd, ent->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+				if( sub != -1 ){
+					dir_clean(r, sub);
+					close(sub);
+				}
+				uring_unlink(r, dirfd, ent->d_name, AT_REMOVEDIR);
+			}
+			else{
+				uring_unlink(r, dirfd, ent->d_name, 0);
+			}
+		}
+		uring_flush(r);
+	}
+	if( nr < 0 ){
+		dbg_error("getdents64: %m");
+	}
+	return r->removed - start;
+}
+
+//synchronous, ring setup cost more than small directory removed by rm
+int rm_at(int dirfd){
+	uring_s r = { .fd = -1 };
+	return dir_clean(&r, dirfd);
+}
+
+int teardown_bury(const char* destdir, const char* path){
+	__private unsigned BURYID;
+	__free char* grave = str_printf("%s/" HESTIA_GRAVEYARD, destdir);
+	if( mkdir(grave, 0700) && errno != EEXIST ){
+		dbg_error("mkdir graveyard %s: %m", grave);
+		rm(path);
+		return -1;
+	}
+	const char* name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+	while( 1 ){
+		__free char* dst = str_printf("%s/%s.%d.%u", grave, name, getpid(), BURYID++);
+		if( !renameat2(AT_FDCWD, path, AT_FDCWD, dst, RENAME_NOREPLACE) ){
+			dbg_info("bury %s", path);
+			return 0;
+		}
+		if( errno == EEXIST ) continue;
+		if( errno == ENOENT ) return 0;
+		dbg_warning("bury %s: %m", path);
+		break;
+	}
+	rm(path);
+	return -1;
+}
+
+//another reaper hold the lock, leave it the work
+__private void graveyard_reap(const char* grave){
+	int fd = open(grave, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if( fd == -1 ) return;
+	if( flock(fd, LOCK_EX | LOCK_NB) ){
+		close(fd);
+		return;
+	}
+	uring_s r;
+	uring_ctor(&r);
+	//repeat while new entry are buried during clean, stop when a pass remove nothing (EBUSY, EPERM, immutable)
+	do{
+		lseek(fd, 0, SEEK_SET);
+	}while( dir_clean(&r, fd) );
+	uring_dtor(&r);
+	close(fd);
+}
+
+void teardown_reap(const char* destdir){
+	__free char* grave = str_printf("%s/" HESTIA_GRAVEYARD, destdir);
+	if( !dir_exists(grave) ) return;
+	pid_t pid = fork();
+	if( pid == -1 ){
+		dbg_error("fork reaper: %m");
+		graveyard_reap(grave);
+		return;
+	}
+	if( pid ){
+		waitpid(pid, NULL, 0);
+		return;
+	}
+	//double fork, reaper is reparented and never become a zombie of caller
+	if( fork() ) _exit(0);
+	setsid();
+	int null = open("/dev/null", O_RDWR);
+	if( null != -1 ){
+		dup2(null, STDIN_FILENO);
+		dup2(null, STDOUT_FILENO);
+		dup2(null, STDERR_FILENO);
+		if( null > STDERR_FILENO ) close(null);
+	}
+	graveyard_reap(grave);
+	_exit(0);
+}
@@ -0,0 +1,106 @@
+#include <notstd/core.h>
+#include <notstd/str.h>
+#include <notstd/delay.h>
+#include <notstd/json.h>
+
+#include <hestia/trace.h>
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+__private size_t trace_size(unsigned max){
+	return sizeof(trace_s) + sizeof(traceEvent_s) * max;
+}
+
+trace_s* trace_new(void){
+	trace_s* t = mmap(NULL, trace_size(HESTIA_TRACE_MAX), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if( t == MAP_FAILED ){
+		dbg_error("mmap trace: %m");
+		return NULL;
+	}
+	t->count = 0;
+	t->max   = HESTIA_TRACE_MAX;
+	return t;
+}
+
+void trace_free(trace_s* t){
+	if( t ) munmap(t, trace_size(t->max));
+}
+
+//return id of event, -1 if trace is disabled or full
+int trace_begin(trace_s* t, const char* stage, const char* label){
+	if( !t ) return -1;
+	unsigned id = __atomic_fetch_add(&t->count, 1, __ATOMIC_RELAXED);
+	if( id >= t->max ) return -1;
+	traceEvent_s* ev = &t->event[id];
+	ev->pid = getpid();
+	ev->end = 0;
+	strncpy(ev->stage, stage, HESTIA_TRACE_STAGE - 1);
+	ev->stage[HESTIA_TRACE_STAGE - 1] = 0;
+	strncpy(ev->label, label ? label : "", HESTIA_TRACE_LABEL - 1);
+	ev->label[HESTIA_TRACE_LABEL - 1] = 0;
+	ev->begin = time_mono_ns();
+	return id;
+}
+
+void trace_end(trace_s* t, int id){
+	if( !t || id < 0 ) return;
+	t->event[id].end = time_mono_ns();
+}
+
+//event without end, as exec replaced by app, end now
+void trace_close(trace_s* t){
+	if( !t ) return;
+	uint64_t const now = time_mono_ns();
+	unsigned const count = t->count < t->max ? t->count : t->max;
+	for( unsigned i = 0; i < count; ++i ){
+		if( !t->event[i].end ) t->event[i].end = now;
+	}
+}
+
+__private void json_num(jvalue_s* obj, const char* name, long n){
+	jvalue_s* jv = jvalue_property_new(obj, str_dup(name, 0));
+	jv->type = JV_NUM;
+	jv->n    = n;
+}
+
+__private void json_str(jvalue_s* obj, const char* name, const char* s){
+	jvalue_string_ctor(jvalue_property_new(obj, str_dup(name, 0)), obj, str_dup(s, 0));
+}
+
+__private int event_cmp(const void* a, const void* b){
+	const traceEvent_s* ea = a;
+	const traceEvent_s* eb = b;
+	return ea->begin < eb->begin ? -1 : ea->begin > eb->begin;
+}
+
+//event are sorted by begin, trace can't be used after
+int trace_json(trace_s* t, FILE* out){
+	if( !t ) return -1;
+	trace_close(t);
+	unsigned const count = t->count < t->max ? t->count : t->max;
+	qsort(t->event, count, sizeof(traceEvent_s), event_cmp);
+	uint64_t start = count ? t->event[0].begin : 0;
+	uint64_t stop  = start;
+	for( unsigned i = 0; i < count; ++i ){
+		if( t->event[i].begin < start ) start = t->event[i].begin;
+		if( t->event[i].end > stop ) stop = t->event[i].end;
+	}
+
+	jvalue_s root;
+	jvalue_object_ctor(&root, NULL);
+	json_num(&root, "total_ns", stop - start);
+	if( t->count > t->max ) json_num(&root, "dropped", t->count - t->max);
+	jvalue_s* ev = jvalue_array_ctor(jvalue_property_new(&root, str_dup("event", 0)), &root);
+	for( unsigned i = 0; i < count; ++i ){
+		jvalue_s* e = jvalue_object_ctor(jvalue_array_new(ev), ev);
+		json_str(e, "stage", t->event[i].stage);
+		json_str(e, "label", t->event[i].label);
+		json_num(e, "pid", t->event[i].pid);
+		json_num(e, "begin_ns", t->event[i].begin - start);
+		json_num(e, "dur_ns", t->event[i].end - t->event[i].begin);
+	}
+	__free char* str = json_encode(&root, 0, 1);
+	jvalue_dtor(&root);
+	return fprintf(out, "%s\n", str) < 0 ? -1 : 0;
+}
@@ -0,0 +1,147 @@
+#include <notstd/core.h>
+#include <notstd/str.h>
+
+#include <hestia/system.h>
+
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * seccomp test, run with meson test
+ *	each case compile rules in deny mode, apply the filter in a child and check errno of real syscall
+ *	deny action is errno:EPERM, a syscall that escape the filter return another error or success
+ *	i386 syscall are issued with int 0x80 from x86_64, skipped if kernel has not ia32 emulation
+ *	exit 0 if all case pass
+*/
+
+#define I386_GETPID      20
+#define I386_SETUID      23
+#define I386_SOCKETCALL  102
+#define I386_IPC         117
+#define I386_SETRESUID32 208
+#define I386_CHOWN32     212
+#define I386_SETUID32    213
+#define I386_FCNTL64     221
+
+#define TEST_CALL_MAX 8
+
+typedef struct tcall{
+	const char* name;
+	int         i386;
+	long        nr;
+	long        arg[3];
+	int         deny;
+}tcall_s;
+
+typedef struct tcase{
+	const char* rule;
+	tcall_s     call[TEST_CALL_MAX];
+}tcase_s;
+
+__private const tcase_s CASE[] = {
+	{ "@privileged @network-io", {
+		{ "setuid32",      1, I386_SETUID32,    { -1 },         1 },
+		{ "chown32",       1, I386_CHOWN32,     { 0, -1, -1 }, 1 },
+		{ "setresuid32",   1, I386_SETRESUID32, { -1, -1, -1 }, 1 },
+		{ "socketcall",    1, I386_SOCKETCALL,  { 1, 0 },       1 },
+		{ "getpid",        1, I386_GETPID,      { 0 },          0 },
+		{ "setuid",        0, SYS_setuid,       { -1 },         1 },
+		{ "getpid",        0, SYS_getpid,       { 0 },          0 },
+	}},
+	{ "setuid socket msgget", {
+		{ "setuid",        1, I386_SETUID,      { -1 },         1 },
+		{ "setuid32",      1, I386_SETUID32,    { -1 },         1 },
+		{ "socketcall",    1, I386_SOCKETCALL,  { 1, 0 },       1 },
+		{ "socketcall",    1, I386_SOCKETCALL,  { 2, 0 },       0 },
+		{ "ipc msgget",    1, I386_IPC,         { 13, 1 },      1 },
+		{ "ipc semget",    1, I386_IPC,         { 2, 0 },       1 },
+		{ "setuid",        0, SYS_setuid,       { -1 },         1 },
+	}},
+	{ "fcntl:1==4 socket:0==2", {
+		{ "fcntl64",       1, I386_FCNTL64,     { -1, 4 },      1 },
+		{ "fcntl64",       1, I386_FCNTL64,     { -1, 3 },      0 },
+		{ "socketcall",    1, I386_SOCKETCALL,  { 1, 0 },       1 },
+		{ "fcntl",         0, SYS_fcntl,        { -1, 4 },      1 },
+		{ "fcntl",         0, SYS_fcntl,        { -1, 3 },      0 },
+	}},
+};
+
+#if defined(__x86_64__)
+__private long int80(long nr, long a0, long a1, long a2){
+	long ret;
+	__asm__ volatile("int $0x80" : "=a"(ret) : "a"(nr), "b"(a0), "c"(a1), "d"(a2) : "r8", "r9", "r10", "r11", "memory");
+	return ret;
+}
+
+__private int i386_able(void){
+	return int80(I386_GETPID, 0, 0, 0) == getpid();
+}
+#else
+__private long int80(__unused long nr, __unused long a0, __unused long a1, __unused long a2){
+	return -ENOSYS;
+}
+
+__private int i386_able(void){
+	return 0;
+}
+#endif
+
+//return -errno or value
+__private long call_do(const tcall_s* c){
+	if( c->i386 ) return int80(c->nr, c->arg[0], c->arg[1], c->arg[2]);
+	long ret = syscall(c->nr, c->arg[0], c->arg[1], c->arg[2]);
+	return ret == -1 ? -errno : ret;
+}
+
+//child apply filter and check each call, exit with count of fail
+__private void case_child(const tcase_s* t, struct sock_filter* filter, int i386){
+	if( prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) || syscall_apply(filter, 0) < 0 ){
+		printf("fail [%s] apply filter\n", t->rule);
+		fflush(stdout);
+		_exit(TEST_CALL_MAX);
+	}
+	unsigned fail = 0;
+	for( unsigned i = 0; i < TEST_CALL_MAX && t->call[i].name; ++i ){
+		const tcall_s* c = &t->call[i];
+		if( c->i386 && !i386 ) continue;
+		long ret = call_do(c);
+		int denied = ret == -EPERM;
+		printf("%s [%s] %s/%s(%ld, %ld, %ld) = %ld\n", denied == c->deny ? "ok  " : "fail", t->rule, c->i386 ? "i386" : HESTIA_ARCH_NAME, c->name, c->arg[0], c->arg[1], c->arg[2], ret);
+		if( denied != c->deny ) ++fail;
+	}
+	fflush(stdout);
+	_exit(fail);
+}
+
+__private int case_run(const tcase_s* t, int i386){
+	__free sysRule_s* rule = MANY(sysRule_s, 16);
+	__free char* rules = str_dup(t->rule, 0);
+	for( char* save = NULL, *tok = strtok_r(rules, " ", &save); tok; tok = strtok_r(NULL, " ", &save) ){
+		if( syscall_add(&rule, tok, SECCOMP_RET_ERRNO | EPERM) ) die("invalid rule %s", tok);
+	}
+	__free struct sock_filter* filter = syscall_compile(rule, SECCOMP_RET_ALLOW);
+	fflush(stdout);
+	pid_t pid = fork();
+	if( pid == -1 ) die("fork: %m");
+	if( !pid ) case_child(t, filter, i386);
+	int status;
+	if( waitpid(pid, &status, 0) != pid ) die("waitpid: %m");
+	if( !WIFEXITED(status) ){
+		printf("fail [%s] killed\n", t->rule);
+		return 1;
+	}
+	return WEXITSTATUS(status) ? 1 : 0;
+}
+
+int main(void){
+	notstd_begin();
+	int i386 = i386_able();
+	if( !i386 ) puts("skip i386, kernel without ia32 emulation");
+	int fail = 0;
+	for( unsigned i = 0; i < sizeof_vector(CASE); ++i ){
+		fail |= case_run(&CASE[i], i386);
+	}
+	return fail;
+}